@@ -21,12 +21,25 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <pthread.h>
 
 #include "server/server.h"
 #include "server/prime.h"
 #include "server/verify.h"
+#include "server/stanzas.h"
+#include "server/rtt.h"
+#include "server/lockstats.h"
+#include "server/httpapi.h"
+#include "server/ctlapi.h"
+#include "server/stubfile.h"
+#include "server/autoreply.h"
+#include "server/netem.h"
+#include "server/generator.h"
+#include "server/roster.h"
+#include "server/muc.h"
+#include "server/trace.h"
 
 #include "stabber.h"
 
@@ -36,12 +49,48 @@ stbbr_start(stbbr_log_t loglevel, int port, int httpport)
     return server_run(loglevel, port, httpport);
 }
 
+void
+stbbr_http_threads(int threads)
+{
+    httpapi_set_threads(threads);
+}
+
+void
+stbbr_unix_sockets(char *path, char *httppath)
+{
+    server_set_unix_sockets(path, httppath);
+}
+
+void
+stbbr_control(int port, char *path)
+{
+    ctlapi_set_listen(port, path);
+}
+
+int
+stbbr_load_stubs(char *path)
+{
+    return stubfile_load(path);
+}
+
+void
+stbbr_autoreply(int enabled)
+{
+    autoreply_enable(enabled ? TRUE : FALSE);
+}
+
 void
 stbbr_set_timeout(int seconds)
 {
     verify_set_timeout(seconds);
 }
 
+void
+stbbr_netem(stbbr_netem_t *conditions)
+{
+    netem_set(conditions);
+}
+
 int
 stbbr_auth_passwd(char *password)
 {
@@ -56,6 +105,12 @@ stbbr_for_id(char *id, char *stream)
     return 1;
 }
 
+int
+stbbr_for_id_next(char *id, char *stream)
+{
+    return prime_for_id_next(id, stream);
+}
+
 int
 stbbr_for_query(char *query, char *stream)
 {
@@ -63,6 +118,30 @@ stbbr_for_query(char *query, char *stream)
     return 1;
 }
 
+int
+stbbr_for_query_next(char *query, char *stream)
+{
+    return prime_for_query_next(query, stream);
+}
+
+int
+stbbr_for_rule(char *rule, char *stream)
+{
+    return prime_for_rule(rule, stream);
+}
+
+void
+stbbr_for_roster(stbbr_roster_t *roster)
+{
+    roster_set(roster);
+}
+
+void
+stbbr_muc_room(char *room, int occupants)
+{
+    muc_room(room, occupants);
+}
+
 void
 stbbr_wait_for(char *id)
 {
@@ -75,18 +154,175 @@ stbbr_last_received(char *stanza)
     return verify_last(stanza);
 }
 
+long
+stbbr_mark(void)
+{
+    return stanzas_last_seq();
+}
+
+// the position of the match, 0 if there is none
+long
+stbbr_received_after(long mark, char *stanza)
+{
+    return verify_after(stanza, mark);
+}
+
+long
+stbbr_last_received_after(long mark, char *stanza)
+{
+    return verify_last_after(stanza, mark);
+}
+
+long
+stbbr_wait_for_after(long mark, char *id)
+{
+    return server_wait_for_after(id, mark);
+}
+
+// the cursor moves to the match, so the next call starts after it
+int
+stbbr_received_next(long *cursor, char *stanza)
+{
+    long seq = verify_after(stanza, *cursor);
+    if (!seq) {
+        return 0;
+    }
+
+    *cursor = seq;
+    return 1;
+}
+
+void
+stbbr_wait_for_next(long *cursor, char *id)
+{
+    long seq = server_wait_for_after(id, *cursor);
+    if (seq) {
+        *cursor = seq;
+    }
+}
+
+// the list of stanzas is terminated by NULL
+int
+stbbr_received_in_order(char *first, ...)
+{
+    GList *stanzas = NULL;
+    va_list ap;
+    va_start(ap, first);
+    char *curr = first;
+    while (curr) {
+        stanzas = g_list_append(stanzas, curr);
+        curr = va_arg(ap, char *);
+    }
+    va_end(ap);
+
+    int res = verify_in_order(stanzas);
+    g_list_free(stanzas);
+
+    return res;
+}
+
 int
 stbbr_received(char *stanza)
 {
     return verify_any(stanza, FALSE);
 }
 
+void
+stbbr_history(stbbr_history_t *history)
+{
+    stanzas_set_limit(history);
+}
+
+int
+stbbr_history_watch(char *pattern)
+{
+    return stanzas_watch(pattern);
+}
+
+void
+stbbr_history_stats(stbbr_history_stats_t *stats)
+{
+    stanzas_stats(stats);
+}
+
 void
 stbbr_send(char *stream)
 {
     server_send(stream);
 }
 
+int
+stbbr_generate(char *template, int rate, int burst, int duration_ms, int count)
+{
+    return generator_start(template, rate, burst, duration_ms, count);
+}
+
+void
+stbbr_generate_stop(void)
+{
+    generator_stop_all();
+}
+
+int
+stbbr_muc_message(char *room, char *nick, char *body)
+{
+    return muc_message(room, nick, body);
+}
+
+int
+stbbr_record(char *path)
+{
+    return trace_record(path);
+}
+
+void
+stbbr_record_stop(void)
+{
+    trace_record_stop();
+}
+
+int
+stbbr_replay(char *path, int speed)
+{
+    return trace_replay(path, speed);
+}
+
+void
+stbbr_replay_stop(void)
+{
+    trace_replay_stop();
+}
+
+int
+stbbr_rtt(char *ns, stbbr_rtt_t *stats)
+{
+    return rtt_stats(ns, stats);
+}
+
+void
+stbbr_rtt_reset(void)
+{
+    rtt_reset();
+}
+
+void
+stbbr_lockstats_enable(int enabled)
+{
+    lockstats_enable(enabled ? TRUE : FALSE);
+}
+
+int
+stbbr_lockstats(char *lockname, stbbr_lockstats_t *stats)
+{
+    return lockstats_get(lockname, stats);
+}
+
+void
+stbbr_lockstats_reset(void)
+{
+    lockstats_reset();
+}
+
 void
 stbbr_stop(void)
 {
@@ -0,0 +1,194 @@
+/*
+ * autoreply.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "server/autoreply.h"
+#include "server/stanza.h"
+
+#define SERVER_JID "localhost"
+
+#define RESULT_START "<iq type=\"result\" from=\"" SERVER_JID "\" id=\""
+
+#define PING_END "\"/>"
+
+#define DISCO_END "\">" \
+    "<query xmlns=\"http://jabber.org/protocol/disco#info\">" \
+        "<identity category=\"server\" type=\"im\" name=\"Stabber\"/>" \
+        "<feature var=\"http://jabber.org/protocol/disco#info\"/>" \
+        "<feature var=\"urn:xmpp:ping\"/>" \
+        "<feature var=\"jabber:iq:version\"/>" \
+        "<feature var=\"urn:xmpp:time\"/>" \
+    "</query>" \
+    "</iq>"
+
+#define VERSION_END "\">" \
+    "<query xmlns=\"jabber:iq:version\">" \
+        "<name>Stabber</name>" \
+        "<version>" PACKAGE_VERSION "</version>" \
+    "</query>" \
+    "</iq>"
+
+#define TIME_START "\"><time xmlns=\"urn:xmpp:time\"><tzo>+00:00</tzo><utc>"
+#define TIME_END "</utc></time></iq>"
+
+static gint enabled = FALSE;
+
+static void _part(AutoReply *reply, const char *text, size_t len);
+static size_t _escape_id(const char *id, char *buf, size_t size);
+static XMPPStanza* _request(XMPPStanza *stanza);
+
+void
+autoreply_enable(gboolean enable)
+{
+    g_atomic_int_set(&enabled, enable);
+}
+
+// only answers gets addressed to the server, the reply is made of constant
+// text around the request's id so nothing is parsed or allocated
+int
+autoreply_match(XMPPStanza *stanza, AutoReply *reply)
+{
+    if (!g_atomic_int_get(&enabled)) {
+        return 0;
+    }
+
+    XMPPStanza *request = _request(stanza);
+    if (!request) {
+        return 0;
+    }
+
+    const char *name = request->name;
+    const char *xmlns = stanza_get_attr(request, "xmlns");
+    const char *id = stanza_get_id(stanza);
+    size_t id_len = strlen(id);
+
+    // the id was unescaped when it was read
+    if (strpbrk(id, "&<>\"")) {
+        id_len = _escape_id(id, reply->id, sizeof(reply->id));
+        if (id_len == 0) {
+            return 0;
+        }
+        id = reply->id;
+    }
+
+    reply->count = 0;
+    _part(reply, RESULT_START, strlen(RESULT_START));
+    _part(reply, id, id_len);
+
+    if (g_strcmp0(name, "ping") == 0 && g_strcmp0(xmlns, "urn:xmpp:ping") == 0) {
+        _part(reply, PING_END, strlen(PING_END));
+    } else if (g_strcmp0(name, "query") == 0 && g_strcmp0(xmlns, "http://jabber.org/protocol/disco#info") == 0
+            && !stanza_get_attr(request, "node")) {
+        _part(reply, DISCO_END, strlen(DISCO_END));
+    } else if (g_strcmp0(name, "query") == 0 && g_strcmp0(xmlns, "jabber:iq:version") == 0) {
+        _part(reply, VERSION_END, strlen(VERSION_END));
+    } else if (g_strcmp0(name, "time") == 0 && g_strcmp0(xmlns, "urn:xmpp:time") == 0) {
+        time_t now = time(NULL);
+        struct tm utc;
+        gmtime_r(&now, &utc);
+        size_t utc_len = strftime(reply->utc, sizeof(reply->utc), "%Y-%m-%dT%H:%M:%SZ", &utc);
+        _part(reply, TIME_START, strlen(TIME_START));
+        _part(reply, reply->utc, utc_len);
+        _part(reply, TIME_END, strlen(TIME_END));
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+_part(AutoReply *reply, const char *text, size_t len)
+{
+    reply->parts[reply->count].iov_base = (void *)text;
+    reply->parts[reply->count].iov_len = len;
+    reply->count++;
+}
+
+// the length written, 0 if it does not fit
+static size_t
+_escape_id(const char *id, char *buf, size_t size)
+{
+    size_t len = 0;
+    const char *curr;
+    for (curr = id; *curr; curr++) {
+        const char *entity = NULL;
+        switch (*curr) {
+            case '&':
+                entity = "&amp;";
+                break;
+            case '<':
+                entity = "&lt;";
+                break;
+            case '>':
+                entity = "&gt;";
+                break;
+            case '"':
+                entity = "&quot;";
+                break;
+        }
+
+        size_t entity_len = entity ? strlen(entity) : 1;
+        if (len + entity_len >= size) {
+            return 0;
+        }
+        if (entity) {
+            memcpy(buf + len, entity, entity_len);
+        } else {
+            buf[len] = *curr;
+        }
+        len += entity_len;
+    }
+
+    return len;
+}
+
+// the single child of an iq get with an id, sent to the server
+static XMPPStanza*
+_request(XMPPStanza *stanza)
+{
+    if (g_strcmp0(stanza->name, "iq") != 0) {
+        return NULL;
+    }
+    if (g_strcmp0(stanza_get_attr(stanza, "type"), "get") != 0) {
+        return NULL;
+    }
+    if (!stanza_get_id(stanza)) {
+        return NULL;
+    }
+
+    const char *to = stanza_get_attr(stanza, "to");
+    if (to && g_strcmp0(to, SERVER_JID) != 0) {
+        return NULL;
+    }
+
+    if (!stanza->children || g_list_next(stanza->children)) {
+        return NULL;
+    }
+
+    return stanza->children->data;
+}
@@ -0,0 +1,46 @@
+/*
+ * autoreply.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_AUTOREPLY
+#define __H_AUTOREPLY
+
+#include <sys/uio.h>
+
+#include "server/stanza.h"
+
+#define AUTOREPLY_PARTS 5
+
+// longest escaped id answered, a longer one is left to the stubs
+#define AUTOREPLY_ID_MAX 256
+
+// the parts of a reply to a stock server request, written as they are
+typedef struct autoreply_t {
+    struct iovec parts[AUTOREPLY_PARTS];
+    int count;
+    char utc[32];
+    char id[AUTOREPLY_ID_MAX];
+} AutoReply;
+
+void autoreply_enable(gboolean enabled);
+int autoreply_match(XMPPStanza *stanza, AutoReply *reply);
+
+#endif
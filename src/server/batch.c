@@ -0,0 +1,303 @@
+/*
+ * batch.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <expat.h>
+#include <glib.h>
+
+#include "server/batch.h"
+#include "server/prime.h"
+#include "server/server.h"
+#include "server/verify.h"
+#include "server/log.h"
+
+typedef struct batch_state_t {
+    XML_Parser parser;
+    const char *body;
+    int depth;
+    GList *ops;
+    BatchOp *curr;
+    long payload_start;
+    long rule_start;
+    GString *error;
+} BatchState;
+
+static void _start_element(void *data, const char *element, const char **attributes);
+static void _end_element(void *data, const char *element);
+static const char* _attr(const char **attributes, const char *name);
+static void _op_free(BatchOp *op);
+
+GList*
+batch_parse(const char *body, GString *error)
+{
+    BatchState state;
+    state.body = body;
+    state.depth = 0;
+    state.ops = NULL;
+    state.curr = NULL;
+    state.payload_start = 0;
+    state.rule_start = -1;
+    state.error = error;
+
+    state.parser = XML_ParserCreate(NULL);
+    XML_SetElementHandler(state.parser, _start_element, _end_element);
+    XML_SetUserData(state.parser, &state);
+
+    if (XML_Parse(state.parser, body, strlen(body), 1) == XML_STATUS_ERROR && error->len == 0) {
+        g_string_append_printf(error, "invalid batch: %s", XML_ErrorString(XML_GetErrorCode(state.parser)));
+    }
+    XML_ParserFree(state.parser);
+
+    if (state.curr) {
+        _op_free(state.curr);
+    }
+
+    GList *ops = g_list_reverse(state.ops);
+    if (error->len > 0) {
+        batch_free(ops);
+        return NULL;
+    }
+
+    return ops;
+}
+
+// stubs are primed together first, then the other operations run in order
+int
+batch_run(GList *ops, GString *results)
+{
+    GList *stubs = NULL;
+    GList *curr = ops;
+    while (curr) {
+        BatchOp *op = curr->data;
+        if (op->type == BATCH_FOR) {
+            StubDef *stub = malloc(sizeof(StubDef));
+            stub->id = op->id;
+            stub->query = op->query;
+            stub->rule = op->rule;
+            stub->stream = op->payload;
+            stub->next = 0;
+            stub->source = NULL;
+            stubs = g_list_append(stubs, stub);
+        }
+        curr = g_list_next(curr);
+    }
+    prime_for_all(stubs);
+    g_list_free_full(stubs, free);
+
+    int count = 0;
+    curr = ops;
+    while (curr) {
+        BatchOp *op = curr->data;
+        switch (op->type) {
+            case BATCH_FOR:
+                g_string_append(results, "for ok\n");
+                break;
+            case BATCH_SEND:
+                server_send(op->payload);
+                g_string_append(results, "send ok\n");
+                break;
+            case BATCH_VERIFY:
+                if (verify_any(op->payload, TRUE)) {
+                    g_string_append(results, "verify true\n");
+                } else {
+                    g_string_append(results, "verify false\n");
+                }
+                break;
+            case BATCH_TIMEOUT:
+                verify_set_timeout(atoi(op->seconds));
+                g_string_append(results, "timeout ok\n");
+                break;
+            case BATCH_PASSWD:
+                prime_required_passwd(op->payload);
+                g_string_append(results, "passwd ok\n");
+                break;
+        }
+        count++;
+        curr = g_list_next(curr);
+    }
+
+    return count;
+}
+
+void
+batch_free(GList *ops)
+{
+    g_list_free_full(ops, (GDestroyNotify)_op_free);
+}
+
+static void
+_start_element(void *data, const char *element, const char **attributes)
+{
+    BatchState *state = data;
+    state->depth++;
+
+    if (state->depth == 1) {
+        if (g_strcmp0(element, "batch") != 0) {
+            g_string_append_printf(state->error, "invalid batch: root element must be <batch>, found <%s>", element);
+            XML_StopParser(state->parser, XML_FALSE);
+        }
+        return;
+    }
+
+    // a <for> with neither id nor query starts with the <rule> to match
+    if (state->depth == 3 && state->curr && state->curr->type == BATCH_FOR && !state->curr->id
+            && !state->curr->query && !state->curr->rule && state->rule_start == -1) {
+        if (g_strcmp0(element, "rule") != 0) {
+            g_string_append(state->error, "invalid batch: <for> requires one of id, query or a <rule>");
+            XML_StopParser(state->parser, XML_FALSE);
+            return;
+        }
+        state->rule_start = XML_GetCurrentByteIndex(state->parser) + XML_GetCurrentByteCount(state->parser);
+        return;
+    }
+
+    if (state->depth != 2) {
+        return;
+    }
+
+    BatchOp *op = malloc(sizeof(BatchOp));
+    op->name = strdup(element);
+    op->id = NULL;
+    op->query = NULL;
+    op->rule = NULL;
+    op->seconds = NULL;
+    op->payload = NULL;
+    state->curr = op;
+
+    // payloads are taken verbatim from the body, not reserialised
+    state->payload_start = XML_GetCurrentByteIndex(state->parser) + XML_GetCurrentByteCount(state->parser);
+
+    const char *id = _attr(attributes, "id");
+    const char *query = _attr(attributes, "query");
+    const char *seconds = _attr(attributes, "seconds");
+
+    if (g_strcmp0(element, "for") == 0) {
+        op->type = BATCH_FOR;
+        if (id && query) {
+            g_string_append(state->error, "invalid batch: <for> requires one of id, query or a <rule>");
+            XML_StopParser(state->parser, XML_FALSE);
+            return;
+        }
+        op->id = id ? strdup(id) : NULL;
+        op->query = query ? strdup(query) : NULL;
+    } else if (g_strcmp0(element, "send") == 0) {
+        op->type = BATCH_SEND;
+    } else if (g_strcmp0(element, "verify") == 0) {
+        op->type = BATCH_VERIFY;
+    } else if (g_strcmp0(element, "timeout") == 0) {
+        op->type = BATCH_TIMEOUT;
+        if (!seconds) {
+            g_string_append(state->error, "invalid batch: <timeout> requires seconds");
+            XML_StopParser(state->parser, XML_FALSE);
+            return;
+        }
+        op->seconds = strdup(seconds);
+    } else if (g_strcmp0(element, "passwd") == 0) {
+        op->type = BATCH_PASSWD;
+    } else {
+        g_string_append_printf(state->error, "invalid batch: unknown operation <%s>", element);
+        XML_StopParser(state->parser, XML_FALSE);
+    }
+}
+
+static void
+_end_element(void *data, const char *element)
+{
+    BatchState *state = data;
+    state->depth--;
+
+    // the stanza follows the rule
+    if (state->depth == 2 && state->rule_start != -1) {
+        long rule_end = XML_GetCurrentByteIndex(state->parser);
+        if (rule_end > state->rule_start) {
+            state->curr->rule = g_strndup(state->body + state->rule_start, rule_end - state->rule_start);
+        } else {
+            state->curr->rule = g_strdup("");
+        }
+        g_strstrip(state->curr->rule);
+        state->rule_start = -1;
+        state->payload_start = rule_end + XML_GetCurrentByteCount(state->parser);
+
+        if (!prime_rule_valid(state->curr->rule)) {
+            g_string_append(state->error, "invalid batch: <rule> must contain one element");
+            XML_StopParser(state->parser, XML_FALSE);
+        }
+        return;
+    }
+
+    if (state->depth != 1 || !state->curr) {
+        return;
+    }
+
+    long payload_end = XML_GetCurrentByteIndex(state->parser);
+    if (payload_end > state->payload_start) {
+        state->curr->payload = g_strndup(state->body + state->payload_start, payload_end - state->payload_start);
+    } else {
+        state->curr->payload = g_strdup("");
+    }
+    g_strstrip(state->curr->payload);
+
+    BatchOp *op = state->curr;
+    state->curr = NULL;
+    state->ops = g_list_prepend(state->ops, op);
+
+    if (op->type == BATCH_FOR && !op->id && !op->query && !op->rule) {
+        g_string_append(state->error, "invalid batch: <for> requires one of id, query or a <rule>");
+        XML_StopParser(state->parser, XML_FALSE);
+        return;
+    }
+
+    if (op->type != BATCH_TIMEOUT && strlen(op->payload) == 0) {
+        g_string_append_printf(state->error, "invalid batch: <%s> must not be empty", op->name);
+        XML_StopParser(state->parser, XML_FALSE);
+    }
+}
+
+static const char*
+_attr(const char **attributes, const char *name)
+{
+    int i;
+    for (i = 0; attributes[i]; i += 2) {
+        if (g_strcmp0(attributes[i], name) == 0) {
+            return attributes[i+1];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+_op_free(BatchOp *op)
+{
+    if (!op) {
+        return;
+    }
+
+    free(op->name);
+    free(op->id);
+    free(op->query);
+    g_free(op->rule);
+    free(op->seconds);
+    g_free(op->payload);
+    free(op);
+}
@@ -0,0 +1,50 @@
+/*
+ * batch.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_BATCH
+#define __H_BATCH
+
+#include <glib.h>
+
+typedef enum {
+    BATCH_FOR,
+    BATCH_SEND,
+    BATCH_VERIFY,
+    BATCH_TIMEOUT,
+    BATCH_PASSWD
+} batch_op_t;
+
+typedef struct batch_op_item_t {
+    batch_op_t type;
+    char *name;
+    char *id;
+    char *query;
+    char *rule;
+    char *seconds;
+    char *payload;
+} BatchOp;
+
+GList* batch_parse(const char *body, GString *error);
+int batch_run(GList *ops, GString *results);
+void batch_free(GList *ops);
+
+#endif
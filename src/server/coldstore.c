@@ -0,0 +1,335 @@
+/*
+ * coldstore.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "server/log.h"
+#include "server/stanza.h"
+#include "server/coldstore.h"
+
+// about 3% false positives for a full block of ids
+#define COLD_BLOOM_BYTES 1024
+#define COLD_BLOOM_HASHES 3
+
+#define COLD_ZSTD_LEVEL 3
+
+// a block is built from stanzas as the client sent them, each a ColdHeader
+// followed by the text and a NUL, then compressed in one go when it is sealed
+typedef struct cold_header_t {
+    gint64 seq;
+    gint64 timestamp;
+    guint32 len;
+} ColdHeader;
+
+// the summary lets a search skip blocks that cannot hold a match, names and
+// namespaces are few, so they are searched in order
+struct cold_block_t {
+    int count;
+    long last_seq;
+    GString *raw;
+    size_t raw_len;
+    char *data;
+    size_t len;
+    gboolean compressed;
+    guint8 ids[COLD_BLOOM_BYTES];
+    GPtrArray *names;
+    GPtrArray *namespaces;
+};
+
+static void _bloom_add(ColdBlock *block, const char *id);
+static gboolean _bloom_test(ColdBlock *block, const char *id);
+static guint _hash2(const char *str);
+static void _set_add(GPtrArray *set, const char *str);
+static gboolean _set_has(GPtrArray *set, const char *str);
+static void _add_namespaces(ColdBlock *block, XMPPStanza *stanza);
+static gboolean _namespaces_present(ColdBlock *block, XMPPStanza *stanza);
+
+ColdBlock*
+coldstore_block_new(void)
+{
+    ColdBlock *block = malloc(sizeof(ColdBlock));
+    block->count = 0;
+    block->last_seq = 0;
+    block->raw = g_string_sized_new(64 * COLD_BLOCK_STANZAS);
+    block->raw_len = 0;
+    block->data = NULL;
+    block->len = 0;
+    block->compressed = FALSE;
+    memset(block->ids, 0, COLD_BLOOM_BYTES);
+    block->names = g_ptr_array_new();
+    block->namespaces = g_ptr_array_new();
+
+    return block;
+}
+
+// text is what was received, the stanza is only read for the summary
+void
+coldstore_block_add(ColdBlock *block, long seq, gint64 timestamp, XMPPStanza *stanza, const char *text)
+{
+    ColdHeader header;
+    header.seq = seq;
+    header.timestamp = timestamp;
+    header.len = strlen(text);
+    g_string_append_len(block->raw, (const char *)&header, sizeof(ColdHeader));
+    g_string_append_len(block->raw, text, header.len + 1);
+
+    const char *id = stanza_get_id(stanza);
+    if (id) {
+        _bloom_add(block, id);
+    }
+    _set_add(block->names, stanza->name);
+    _add_namespaces(block, stanza);
+
+    block->count++;
+    block->last_seq = seq;
+}
+
+// stored as it is when zstd is not available or does not help
+void
+coldstore_block_seal(ColdBlock *block)
+{
+    block->raw_len = block->raw->len;
+
+#ifdef HAVE_ZSTD
+    size_t bound = ZSTD_compressBound(block->raw_len);
+    char *data = malloc(bound);
+    size_t len = ZSTD_compress(data, bound, block->raw->str, block->raw_len, COLD_ZSTD_LEVEL);
+    if (!ZSTD_isError(len) && len < block->raw_len) {
+        block->data = realloc(data, len);
+        block->len = len;
+        block->compressed = TRUE;
+        g_string_free(block->raw, TRUE);
+        block->raw = NULL;
+        return;
+    }
+    free(data);
+#endif
+
+    block->len = block->raw_len;
+    block->data = g_string_free(block->raw, FALSE);
+    block->raw = NULL;
+}
+
+void
+coldstore_block_free(ColdBlock *block)
+{
+    if (!block) {
+        return;
+    }
+
+    if (block->raw) {
+        g_string_free(block->raw, TRUE);
+    }
+    if (block->compressed) {
+        free(block->data);
+    } else {
+        g_free(block->data);
+    }
+    g_ptr_array_free(block->names, TRUE);
+    g_ptr_array_free(block->namespaces, TRUE);
+    free(block);
+}
+
+int
+coldstore_block_count(ColdBlock *block)
+{
+    return block->count;
+}
+
+long
+coldstore_block_last_seq(ColdBlock *block)
+{
+    return block->last_seq;
+}
+
+size_t
+coldstore_block_bytes(ColdBlock *block)
+{
+    return sizeof(ColdBlock) + block->len
+        + (block->names->len + block->namespaces->len) * sizeof(gpointer);
+}
+
+// ids with wildcards could be anything
+gboolean
+coldstore_block_may_contain_id(ColdBlock *block, const char *id)
+{
+    if (strpbrk(id, "*?[")) {
+        return TRUE;
+    }
+
+    return _bloom_test(block, id);
+}
+
+// false when no stanza in the block can equal the template
+gboolean
+coldstore_block_may_match(ColdBlock *block, XMPPStanza *stanza)
+{
+    if (!_set_has(block->names, stanza->name)) {
+        return FALSE;
+    }
+
+    const char *id = stanza_get_id(stanza);
+    if (id && g_strcmp0(id, "*") != 0 && !_bloom_test(block, id)) {
+        return FALSE;
+    }
+
+    return _namespaces_present(block, stanza);
+}
+
+// oldest first
+void
+coldstore_block_foreach(ColdBlock *block, coldstore_func func, void *userdata)
+{
+    char *raw = block->data;
+#ifdef HAVE_ZSTD
+    if (block->compressed) {
+        raw = malloc(block->raw_len);
+        size_t len = ZSTD_decompress(raw, block->raw_len, block->data, block->len);
+        if (ZSTD_isError(len) || len != block->raw_len) {
+            log_println(STBBR_LOGERROR, "Could not decompress stanzas up to %ld", block->last_seq);
+            free(raw);
+            return;
+        }
+    }
+#endif
+
+    size_t pos = 0;
+    while (pos + sizeof(ColdHeader) <= block->raw_len) {
+        ColdHeader header;
+        memcpy(&header, raw + pos, sizeof(ColdHeader));
+        pos += sizeof(ColdHeader);
+        if (!func(header.seq, header.timestamp, raw + pos, userdata)) {
+            break;
+        }
+        pos += header.len + 1;
+    }
+
+    if (raw != block->data) {
+        free(raw);
+    }
+}
+
+static void
+_bloom_add(ColdBlock *block, const char *id)
+{
+    guint h1 = g_str_hash(id);
+    guint h2 = _hash2(id);
+    int i;
+    for (i = 0; i < COLD_BLOOM_HASHES; i++) {
+        guint bit = (h1 + i * h2) % (COLD_BLOOM_BYTES * 8);
+        block->ids[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static gboolean
+_bloom_test(ColdBlock *block, const char *id)
+{
+    guint h1 = g_str_hash(id);
+    guint h2 = _hash2(id);
+    int i;
+    for (i = 0; i < COLD_BLOOM_HASHES; i++) {
+        guint bit = (h1 + i * h2) % (COLD_BLOOM_BYTES * 8);
+        if (!(block->ids[bit / 8] & (1 << (bit % 8)))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// FNV-1a, independent of g_str_hash, odd so every bit can be reached
+static guint
+_hash2(const char *str)
+{
+    guint32 hash = 2166136261u;
+    while (*str) {
+        hash ^= (guchar)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash | 1;
+}
+
+// interned, the names and namespaces a client uses are few
+static void
+_set_add(GPtrArray *set, const char *str)
+{
+    if (!_set_has(set, str)) {
+        g_ptr_array_add(set, (gpointer)g_intern_string(str));
+    }
+}
+
+static gboolean
+_set_has(GPtrArray *set, const char *str)
+{
+    guint i;
+    for (i = 0; i < set->len; i++) {
+        if (g_strcmp0(g_ptr_array_index(set, i), str) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void
+_add_namespaces(ColdBlock *block, XMPPStanza *stanza)
+{
+    const char *xmlns = stanza_get_attr(stanza, "xmlns");
+    if (xmlns) {
+        _set_add(block->namespaces, xmlns);
+    }
+
+    GList *curr = stanza->children;
+    while (curr) {
+        _add_namespaces(block, curr->data);
+        curr = g_list_next(curr);
+    }
+}
+
+// every namespace the template names must appear somewhere in the block
+static gboolean
+_namespaces_present(ColdBlock *block, XMPPStanza *stanza)
+{
+    const char *xmlns = stanza_get_attr(stanza, "xmlns");
+    if (xmlns && g_strcmp0(xmlns, "*") != 0 && !_set_has(block->namespaces, xmlns)) {
+        return FALSE;
+    }
+
+    GList *curr = stanza->children;
+    while (curr) {
+        if (!_namespaces_present(block, curr->data)) {
+            return FALSE;
+        }
+        curr = g_list_next(curr);
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,50 @@
+/*
+ * coldstore.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_COLDSTORE
+#define __H_COLDSTORE
+
+#include <glib.h>
+
+#include "server/stanza.h"
+
+#define COLD_BLOCK_STANZAS 1024
+
+typedef struct cold_block_t ColdBlock;
+
+// return FALSE to stop
+typedef gboolean (*coldstore_func)(long seq, gint64 timestamp, const char *text, void *userdata);
+
+ColdBlock* coldstore_block_new(void);
+void coldstore_block_add(ColdBlock *block, long seq, gint64 timestamp, XMPPStanza *stanza, const char *text);
+void coldstore_block_seal(ColdBlock *block);
+void coldstore_block_free(ColdBlock *block);
+
+int coldstore_block_count(ColdBlock *block);
+long coldstore_block_last_seq(ColdBlock *block);
+size_t coldstore_block_bytes(ColdBlock *block);
+
+gboolean coldstore_block_may_contain_id(ColdBlock *block, const char *id);
+gboolean coldstore_block_may_match(ColdBlock *block, XMPPStanza *stanza);
+void coldstore_block_foreach(ColdBlock *block, coldstore_func func, void *userdata);
+
+#endif
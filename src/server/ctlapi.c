@@ -0,0 +1,829 @@
+/*
+ * ctlapi.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifdef PLATFORM_OSX
+#include <pthread.h>
+#else
+#include <sys/prctl.h>
+#endif
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/server.h"
+#include "server/prime.h"
+#include "server/verify.h"
+#include "server/rtt.h"
+#include "server/lockstats.h"
+#include "server/batch.h"
+#include "server/ctlapi.h"
+#include "server/netem.h"
+#include "server/stubfile.h"
+#include "server/autoreply.h"
+#include "server/generator.h"
+#include "server/roster.h"
+#include "server/muc.h"
+#include "server/trace.h"
+#include "server/stanzas.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define CTL_READ_SIZE 65536
+
+typedef struct ctl_conn_t {
+    int sock;
+    gint refs;
+    pthread_mutex_t write_lock;
+} CtlConn;
+
+typedef struct ctl_request_t {
+    CtlConn *conn;
+    guint32 reqid;
+    guint8 op;
+    GPtrArray *args;
+} CtlRequest;
+
+static int listen_port = 0;
+static char *listen_path = NULL;
+static int listen_socket = -1;
+static pthread_t listen_thread;
+static gboolean running = FALSE;
+
+// open connections, each reader removes its own on exit, and the number of
+// workers still running a blocking operation
+StbbrMutex ctl_lock = STBBR_MUTEX_INIT("ctl_lock");
+static pthread_cond_t conns_cond = PTHREAD_COND_INITIALIZER;
+static GList *conns = NULL;
+static int workers = 0;
+
+static void* _listen_cb(void *userdata);
+static void* _reader_cb(void *userdata);
+static void* _worker_cb(void *userdata);
+static void _worker_done(void);
+
+static void
+_set_thread_name(void)
+{
+#ifdef PLATFORM_OSX
+    pthread_setname_np("ctl");
+#else
+    prctl(PR_SET_NAME, "ctl");
+#endif
+}
+
+static void
+_conn_unref(CtlConn *conn)
+{
+    if (g_atomic_int_dec_and_test(&conn->refs)) {
+        close(conn->sock);
+        pthread_mutex_destroy(&conn->write_lock);
+        free(conn);
+    }
+}
+
+// workers answer out of order, one lock per connection keeps frames whole
+static void
+_conn_write(CtlConn *conn, GByteArray *out)
+{
+    if (out->len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->write_lock);
+    guint sent = 0;
+    while (sent < out->len) {
+        ssize_t res = send(conn->sock, out->data + sent, out->len - sent, MSG_NOSIGNAL);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        sent += res;
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+
+    g_byte_array_set_size(out, 0);
+}
+
+static void
+_put_u32(GByteArray *out, guint32 val)
+{
+    guint32 be = htonl(val);
+    g_byte_array_append(out, (guint8 *)&be, 4);
+}
+
+static guint32
+_get_u32(const guint8 *buf)
+{
+    guint32 be;
+    memcpy(&be, buf, 4);
+    return ntohl(be);
+}
+
+static guint
+_response_begin(GByteArray *out, guint32 reqid, ctl_status_t status)
+{
+    guint start = out->len;
+    guint8 status_byte = status;
+
+    _put_u32(out, 0);
+    _put_u32(out, reqid);
+    g_byte_array_append(out, &status_byte, 1);
+
+    return start;
+}
+
+static void
+_response_value(GByteArray *out, const char *value)
+{
+    guint32 len = strlen(value);
+    _put_u32(out, len);
+    g_byte_array_append(out, (const guint8 *)value, len);
+}
+
+static void
+_response_printf(GByteArray *out, const char *fmt, ...)
+{
+    va_list arg;
+    va_start(arg, fmt);
+    char *value = g_strdup_vprintf(fmt, arg);
+    va_end(arg);
+
+    _response_value(out, value);
+    g_free(value);
+}
+
+static void
+_response_end(GByteArray *out, guint start)
+{
+    guint32 be = htonl(out->len - start - 4);
+    memcpy(out->data + start, &be, 4);
+}
+
+static void
+_response_status(GByteArray *out, guint32 reqid, ctl_status_t status)
+{
+    _response_end(out, _response_begin(out, reqid, status));
+}
+
+static void
+_response_text(GByteArray *out, guint32 reqid, ctl_status_t status, const char *text)
+{
+    guint start = _response_begin(out, reqid, status);
+    _response_value(out, text);
+    _response_end(out, start);
+}
+
+static void
+_request_free(CtlRequest *req)
+{
+    if (req->args) {
+        g_ptr_array_free(req->args, TRUE);
+    }
+    free(req);
+}
+
+// args is left NULL when the arguments do not fill the frame exactly
+static CtlRequest*
+_request_parse(const guint8 *frame, guint32 len)
+{
+    CtlRequest *req = malloc(sizeof(CtlRequest));
+    req->conn = NULL;
+    req->reqid = _get_u32(frame);
+    req->op = frame[4];
+    req->args = g_ptr_array_new_with_free_func(free);
+
+    guint32 pos = 5;
+    while (pos < len) {
+        if (len - pos < 4) {
+            g_ptr_array_free(req->args, TRUE);
+            req->args = NULL;
+            break;
+        }
+        guint32 arglen = _get_u32(frame + pos);
+        pos += 4;
+        if (arglen > len - pos) {
+            g_ptr_array_free(req->args, TRUE);
+            req->args = NULL;
+            break;
+        }
+        char *arg = malloc(arglen + 1);
+        memcpy(arg, frame + pos, arglen);
+        arg[arglen] = '\0';
+        g_ptr_array_add(req->args, arg);
+        pos += arglen;
+    }
+
+    return req;
+}
+
+static gboolean
+_args(CtlRequest *req, guint count)
+{
+    return req->args && req->args->len == count;
+}
+
+#define ARG(req, n) ((char *)g_ptr_array_index((req)->args, (n)))
+
+// operations that may wait on the client run on their own thread
+static gboolean
+_blocking(guint8 op)
+{
+    switch (op) {
+        case CTL_OP_RECEIVED:
+        case CTL_OP_LAST_RECEIVED:
+        case CTL_OP_WAIT_FOR:
+        case CTL_OP_RECEIVED_AFTER:
+        case CTL_OP_LAST_RECEIVED_AFTER:
+        case CTL_OP_WAIT_FOR_AFTER:
+        case CTL_OP_RECEIVED_IN_ORDER:
+        case CTL_OP_BATCH:
+        case CTL_OP_STOP:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+static void
+_handle(CtlRequest *req, GByteArray *out)
+{
+    guint start;
+    int res;
+    GString *report = NULL;
+    long seq;
+    guint i;
+    GList *ops = NULL;
+    GList *stanzas = NULL;
+    stbbr_rtt_t rtt;
+    stbbr_lockstats_t lockstats;
+    stbbr_netem_t conditions;
+    stbbr_roster_t roster;
+    stbbr_history_t history;
+    stbbr_history_stats_t history_stats;
+
+    switch (req->op) {
+        case CTL_OP_AUTH_PASSWD:
+            if (!_args(req, 1)) break;
+            prime_required_passwd(ARG(req, 0));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_ID:
+            if (!_args(req, 2)) break;
+            prime_for_id(ARG(req, 0), ARG(req, 1));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_QUERY:
+            if (!_args(req, 2)) break;
+            prime_for_query(ARG(req, 0), ARG(req, 1));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_ID_NEXT:
+            if (!_args(req, 2)) break;
+            prime_for_id_next(ARG(req, 0), ARG(req, 1));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_QUERY_NEXT:
+            if (!_args(req, 2)) break;
+            prime_for_query_next(ARG(req, 0), ARG(req, 1));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_RULE:
+            if (!_args(req, 2)) break;
+            if (!prime_for_rule(ARG(req, 0), ARG(req, 1))) break;
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_SEND:
+            if (!_args(req, 1)) break;
+            server_send(ARG(req, 0));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_RECEIVED:
+            if (!_args(req, 1)) break;
+            res = verify_any(ARG(req, 0), FALSE);
+            _response_status(out, req->reqid, res ? CTL_STATUS_OK : CTL_STATUS_FALSE);
+            return;
+        case CTL_OP_LAST_RECEIVED:
+            if (!_args(req, 1)) break;
+            res = verify_last(ARG(req, 0));
+            _response_status(out, req->reqid, res ? CTL_STATUS_OK : CTL_STATUS_FALSE);
+            return;
+        case CTL_OP_WAIT_FOR:
+            if (!_args(req, 1)) break;
+            res = server_wait_for(ARG(req, 0));
+            _response_status(out, req->reqid, res ? CTL_STATUS_OK : CTL_STATUS_FALSE);
+            return;
+        case CTL_OP_SET_TIMEOUT:
+            if (!_args(req, 1)) break;
+            verify_set_timeout(atoi(ARG(req, 0)));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_RTT:
+            if (!_args(req, 0) && !_args(req, 1)) break;
+            if (!rtt_stats(req->args->len == 1 ? ARG(req, 0) : NULL, &rtt)) {
+                _response_status(out, req->reqid, CTL_STATUS_FALSE);
+                return;
+            }
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", rtt.count);
+            _response_printf(out, "%.3f", rtt.min);
+            _response_printf(out, "%.3f", rtt.mean);
+            _response_printf(out, "%.3f", rtt.p50);
+            _response_printf(out, "%.3f", rtt.p90);
+            _response_printf(out, "%.3f", rtt.p99);
+            _response_printf(out, "%.3f", rtt.max);
+            _response_end(out, start);
+            return;
+        case CTL_OP_RTT_RESET:
+            rtt_reset();
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_LOCKSTATS_ENABLE:
+            if (!_args(req, 1)) break;
+            lockstats_enable(atoi(ARG(req, 0)) ? TRUE : FALSE);
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_LOCKSTATS:
+            if (!_args(req, 1)) break;
+            if (!lockstats_get(ARG(req, 0), &lockstats)) {
+                _response_status(out, req->reqid, CTL_STATUS_FALSE);
+                return;
+            }
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%lu", lockstats.acquisitions);
+            _response_printf(out, "%lu", lockstats.contended);
+            _response_printf(out, "%.3f", lockstats.wait_total_ms);
+            _response_printf(out, "%.3f", lockstats.wait_max_ms);
+            _response_printf(out, "%.3f", lockstats.hold_total_ms);
+            _response_printf(out, "%.3f", lockstats.hold_max_ms);
+            for (res = 0; res < STBBR_LOCK_BUCKETS; res++) {
+                _response_printf(out, "%lu", lockstats.hold_hist[res]);
+            }
+            _response_end(out, start);
+            return;
+        case CTL_OP_LOCKSTATS_RESET:
+            lockstats_reset();
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_METRICS:
+            report = g_string_new("");
+            lockstats_metrics(report);
+            rtt_metrics(report);
+            stanzas_metrics(report);
+            _response_text(out, req->reqid, CTL_STATUS_OK, report->str);
+            g_string_free(report, TRUE);
+            return;
+        case CTL_OP_BATCH:
+            if (!_args(req, 1)) break;
+            report = g_string_new("");
+            ops = batch_parse(ARG(req, 0), report);
+            if (!ops) {
+                log_println(STBBR_LOGWARN, "Batch rejected: %s", report->str);
+                _response_text(out, req->reqid, CTL_STATUS_ERROR, report->str);
+                g_string_free(report, TRUE);
+                return;
+            }
+            batch_run(ops, report);
+            batch_free(ops);
+            _response_text(out, req->reqid, CTL_STATUS_OK, report->str);
+            g_string_free(report, TRUE);
+            return;
+        case CTL_OP_NETEM:
+            if (!_args(req, 0) && !_args(req, 7)) break;
+            if (req->args->len == 0) {
+                netem_set(NULL);
+            } else {
+                conditions.delay_ms = atoi(ARG(req, 0));
+                conditions.jitter_ms = atoi(ARG(req, 1));
+                conditions.jitter_normal = atoi(ARG(req, 2));
+                conditions.out_bytes_per_sec = atoi(ARG(req, 3));
+                conditions.in_bytes_per_sec = atoi(ARG(req, 4));
+                conditions.fragment_bytes = atoi(ARG(req, 5));
+                conditions.fragment_gap_ms = atoi(ARG(req, 6));
+                netem_set(&conditions);
+            }
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_LOAD_STUBS:
+            if (!_args(req, 1)) break;
+            res = stubfile_load(ARG(req, 0));
+            if (res == -1) break;
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", res);
+            _response_end(out, start);
+            return;
+        case CTL_OP_AUTOREPLY:
+            if (!_args(req, 1)) break;
+            autoreply_enable(atoi(ARG(req, 0)) ? TRUE : FALSE);
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_GENERATE:
+            if (!_args(req, 5)) break;
+            res = generator_start(ARG(req, 0), atoi(ARG(req, 1)), atoi(ARG(req, 2)), atoi(ARG(req, 3)), atoi(ARG(req, 4)));
+            if (!res) break;
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", res);
+            _response_end(out, start);
+            return;
+        case CTL_OP_GENERATE_STOP:
+            generator_stop_all();
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_FOR_ROSTER:
+            if (!_args(req, 0) && !_args(req, 8)) break;
+            if (req->args->len == 0) {
+                roster_set(NULL);
+            } else {
+                roster.count = atoi(ARG(req, 0));
+                roster.groups = atoi(ARG(req, 1));
+                roster.ungrouped_percent = atoi(ARG(req, 2));
+                roster.both_percent = atoi(ARG(req, 3));
+                roster.to_percent = atoi(ARG(req, 4));
+                roster.from_percent = atoi(ARG(req, 5));
+                roster.online_percent = atoi(ARG(req, 6));
+                roster.seed = strtoul(ARG(req, 7), NULL, 10);
+                roster_set(&roster);
+            }
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_MUC_ROOM:
+            if (!_args(req, 2)) break;
+            muc_room(ARG(req, 0), atoi(ARG(req, 1)));
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_MUC_MESSAGE:
+            if (!_args(req, 3)) break;
+            res = muc_message(ARG(req, 0), ARG(req, 1), ARG(req, 2));
+            if (res == -1) break;
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", res);
+            _response_end(out, start);
+            return;
+        case CTL_OP_RECORD:
+            if (!_args(req, 0) && !_args(req, 1)) break;
+            if (req->args->len == 0) {
+                trace_record_stop();
+            } else if (!trace_record(ARG(req, 0))) {
+                break;
+            }
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_REPLAY:
+            if (!_args(req, 0) && !_args(req, 2)) break;
+            if (req->args->len == 0) {
+                trace_replay_stop();
+                _response_status(out, req->reqid, CTL_STATUS_OK);
+                return;
+            }
+            res = trace_replay(ARG(req, 0), atoi(ARG(req, 1)));
+            if (res == -1) break;
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", res);
+            _response_end(out, start);
+            return;
+        case CTL_OP_HISTORY:
+            if (!_args(req, 0) && !_args(req, 3) && !_args(req, 4)) break;
+            if (req->args->len == 0) {
+                stanzas_set_limit(NULL);
+            } else {
+                history.max_stanzas = atoi(ARG(req, 0));
+                history.max_bytes = atol(ARG(req, 1));
+                history.policy = atoi(ARG(req, 2));
+                if (history.policy < STBBR_HISTORY_OLDEST || history.policy > STBBR_HISTORY_BODIES) break;
+                history.hot_stanzas = req->args->len == 4 ? atoi(ARG(req, 3)) : 0;
+                stanzas_set_limit(&history);
+            }
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_HISTORY_WATCH:
+            if (!_args(req, 1)) break;
+            if (!stanzas_watch(ARG(req, 0))) break;
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        case CTL_OP_HISTORY_STATS:
+            stanzas_stats(&history_stats);
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%d", history_stats.stanzas);
+            _response_printf(out, "%ld", history_stats.bytes);
+            _response_printf(out, "%ld", history_stats.evicted);
+            _response_printf(out, "%ld", history_stats.bodies_dropped);
+            _response_printf(out, "%d", history_stats.cold_stanzas);
+            _response_printf(out, "%ld", history_stats.cold_bytes);
+            _response_end(out, start);
+            return;
+        case CTL_OP_MARK:
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%ld", stanzas_last_seq());
+            _response_end(out, start);
+            return;
+        case CTL_OP_RECEIVED_AFTER:
+        case CTL_OP_LAST_RECEIVED_AFTER:
+            if (!_args(req, 2)) break;
+            if (req->op == CTL_OP_RECEIVED_AFTER) {
+                seq = verify_after(ARG(req, 1), atol(ARG(req, 0)));
+            } else {
+                seq = verify_last_after(ARG(req, 1), atol(ARG(req, 0)));
+            }
+            if (!seq) {
+                _response_status(out, req->reqid, CTL_STATUS_FALSE);
+                return;
+            }
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%ld", seq);
+            _response_end(out, start);
+            return;
+        case CTL_OP_WAIT_FOR_AFTER:
+            if (!_args(req, 2)) break;
+            seq = server_wait_for_after(ARG(req, 1), atol(ARG(req, 0)));
+            if (!seq) {
+                _response_status(out, req->reqid, CTL_STATUS_FALSE);
+                return;
+            }
+            start = _response_begin(out, req->reqid, CTL_STATUS_OK);
+            _response_printf(out, "%ld", seq);
+            _response_end(out, start);
+            return;
+        case CTL_OP_RECEIVED_IN_ORDER:
+            if (!req->args || req->args->len == 0) break;
+            for (i = req->args->len; i > 0; i--) {
+                stanzas = g_list_prepend(stanzas, ARG(req, i - 1));
+            }
+            res = verify_in_order(stanzas);
+            g_list_free(stanzas);
+            _response_status(out, req->reqid, res ? CTL_STATUS_OK : CTL_STATUS_FALSE);
+            return;
+        case CTL_OP_STOP:
+            _response_status(out, req->reqid, CTL_STATUS_OK);
+            return;
+        default:
+            break;
+    }
+
+    _response_text(out, req->reqid, CTL_STATUS_ERROR, "Bad request");
+}
+
+void
+ctlapi_set_listen(int port, const char *path)
+{
+    listen_port = port;
+
+    free(listen_path);
+    listen_path = path ? strdup(path) : NULL;
+}
+
+int
+ctlapi_start(void)
+{
+    if (listen_path) {
+        listen_socket = server_listen_unix(listen_path);
+    } else if (listen_port > 0) {
+        listen_socket = server_listen_tcp(listen_port);
+    } else {
+        return 1;
+    }
+
+    if (listen_socket == -1) {
+        return 0;
+    }
+
+    running = TRUE;
+    if (pthread_create(&listen_thread, NULL, _listen_cb, NULL) != 0) {
+        running = FALSE;
+        close(listen_socket);
+        listen_socket = -1;
+        return 0;
+    }
+
+    if (listen_path) {
+        log_println(STBBR_LOGINFO, "Control API started on socket: %s", listen_path);
+    } else {
+        log_println(STBBR_LOGINFO, "Control API started on port: %d", listen_port);
+    }
+
+    return 1;
+}
+
+void
+ctlapi_stop(void)
+{
+    if (!running) {
+        return;
+    }
+
+    running = FALSE;
+    pthread_join(listen_thread, NULL);
+    close(listen_socket);
+    listen_socket = -1;
+    if (listen_path) {
+        unlink(listen_path);
+    }
+
+    // wake the readers and wait for them to finish, blocking operations
+    // give up once the server is stopping
+    lockstats_lock(&ctl_lock);
+    GList *curr = conns;
+    while (curr) {
+        CtlConn *conn = curr->data;
+        shutdown(conn->sock, SHUT_RDWR);
+        curr = g_list_next(curr);
+    }
+    while (conns || workers > 0) {
+        lockstats_cond_timedwait(&ctl_lock, &conns_cond, -1);
+    }
+    lockstats_unlock(&ctl_lock);
+
+    log_println(STBBR_LOGINFO, "Control API stopped.");
+}
+
+static void*
+_listen_cb(void *userdata)
+{
+    _set_thread_name();
+
+    struct pollfd pfd;
+    pfd.fd = listen_socket;
+    pfd.events = POLLIN;
+
+    while (running) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        int sock = accept(listen_socket, NULL, NULL);
+        if (sock == -1) {
+            continue;
+        }
+
+        // fails harmlessly on unix sockets
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        CtlConn *conn = malloc(sizeof(CtlConn));
+        conn->sock = sock;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->write_lock, NULL);
+
+        lockstats_lock(&ctl_lock);
+        conns = g_list_append(conns, conn);
+        lockstats_unlock(&ctl_lock);
+
+        pthread_t reader;
+        if (pthread_create(&reader, NULL, _reader_cb, conn) != 0) {
+            log_println(STBBR_LOGERROR, "Could not start control connection thread");
+            lockstats_lock(&ctl_lock);
+            conns = g_list_remove(conns, conn);
+            lockstats_unlock(&ctl_lock);
+            _conn_unref(conn);
+            continue;
+        }
+        pthread_detach(reader);
+        log_println(STBBR_LOGINFO, "Control connection accepted");
+    }
+
+    return NULL;
+}
+
+static void*
+_reader_cb(void *userdata)
+{
+    _set_thread_name();
+
+    CtlConn *conn = userdata;
+    GByteArray *in = g_byte_array_new();
+    GByteArray *out = g_byte_array_new();
+    guint8 *chunk = malloc(CTL_READ_SIZE);
+    gboolean open = TRUE;
+
+    while (open) {
+        ssize_t res = recv(conn->sock, chunk, CTL_READ_SIZE, 0);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        g_byte_array_append(in, chunk, res);
+
+        // handle every complete frame, replies to pipelined requests go out in one write
+        guint pos = 0;
+        while (in->len - pos >= 4) {
+            guint32 len = _get_u32(in->data + pos);
+            if (len < 5 || len > CTL_MAX_FRAME) {
+                log_println(STBBR_LOGWARN, "Invalid control frame length: %u", len);
+                open = FALSE;
+                break;
+            }
+            if (in->len - pos - 4 < len) {
+                break;
+            }
+
+            CtlRequest *req = _request_parse(in->data + pos + 4, len);
+            pos += 4 + len;
+
+            if (!_blocking(req->op)) {
+                _handle(req, out);
+                _request_free(req);
+                continue;
+            }
+
+            g_atomic_int_inc(&conn->refs);
+            req->conn = conn;
+            lockstats_lock(&ctl_lock);
+            workers++;
+            lockstats_unlock(&ctl_lock);
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, _worker_cb, req) != 0) {
+                _response_text(out, req->reqid, CTL_STATUS_ERROR, "Could not start worker");
+                _worker_done();
+                _conn_unref(conn);
+                _request_free(req);
+                continue;
+            }
+            pthread_detach(worker);
+        }
+        g_byte_array_remove_range(in, 0, pos);
+        _conn_write(conn, out);
+    }
+
+    free(chunk);
+    g_byte_array_free(in, TRUE);
+    g_byte_array_free(out, TRUE);
+
+    lockstats_lock(&ctl_lock);
+    conns = g_list_remove(conns, conn);
+    pthread_cond_broadcast(&conns_cond);
+    lockstats_unlock(&ctl_lock);
+
+    _conn_unref(conn);
+
+    return NULL;
+}
+
+static void*
+_worker_cb(void *userdata)
+{
+    _set_thread_name();
+
+    CtlRequest *req = userdata;
+    GByteArray *out = g_byte_array_new();
+
+    _handle(req, out);
+    _conn_write(req->conn, out);
+    g_byte_array_free(out, TRUE);
+
+    // answered first, stopping closes the connection and waits for the
+    // other workers, so this one no longer counts
+    _worker_done();
+    if (req->op == CTL_OP_STOP) {
+        server_stop();
+    }
+
+    _conn_unref(req->conn);
+    _request_free(req);
+
+    return NULL;
+}
+
+static void
+_worker_done(void)
+{
+    lockstats_lock(&ctl_lock);
+    workers--;
+    pthread_cond_broadcast(&conns_cond);
+    lockstats_unlock(&ctl_lock);
+}
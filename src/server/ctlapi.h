@@ -0,0 +1,83 @@
+/*
+ * ctlapi.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_CTLAPI
+#define __H_CTLAPI
+
+// frames are a big endian uint32 length followed by that many bytes:
+// request:  uint32 request id, uint8 op, then arguments
+// response: uint32 request id, uint8 status, then values
+// arguments and values are a big endian uint32 length followed by the bytes
+
+#define CTL_MAX_FRAME (16 * 1024 * 1024)
+
+typedef enum {
+    CTL_OP_AUTH_PASSWD = 1,
+    CTL_OP_FOR_ID,
+    CTL_OP_FOR_QUERY,
+    CTL_OP_SEND,
+    CTL_OP_RECEIVED,
+    CTL_OP_LAST_RECEIVED,
+    CTL_OP_WAIT_FOR,
+    CTL_OP_SET_TIMEOUT,
+    CTL_OP_RTT,
+    CTL_OP_RTT_RESET,
+    CTL_OP_LOCKSTATS_ENABLE,
+    CTL_OP_LOCKSTATS,
+    CTL_OP_LOCKSTATS_RESET,
+    CTL_OP_METRICS,
+    CTL_OP_BATCH,
+    CTL_OP_STOP,
+    CTL_OP_FOR_RULE,
+    CTL_OP_FOR_ID_NEXT,
+    CTL_OP_FOR_QUERY_NEXT,
+    CTL_OP_NETEM,
+    CTL_OP_LOAD_STUBS,
+    CTL_OP_AUTOREPLY,
+    CTL_OP_GENERATE,
+    CTL_OP_GENERATE_STOP,
+    CTL_OP_FOR_ROSTER,
+    CTL_OP_MUC_ROOM,
+    CTL_OP_MUC_MESSAGE,
+    CTL_OP_RECORD,
+    CTL_OP_REPLAY,
+    CTL_OP_HISTORY,
+    CTL_OP_HISTORY_WATCH,
+    CTL_OP_HISTORY_STATS,
+    CTL_OP_MARK,
+    CTL_OP_RECEIVED_AFTER,
+    CTL_OP_LAST_RECEIVED_AFTER,
+    CTL_OP_WAIT_FOR_AFTER,
+    CTL_OP_RECEIVED_IN_ORDER
+} ctl_op_t;
+
+typedef enum {
+    CTL_STATUS_OK,
+    CTL_STATUS_FALSE,
+    CTL_STATUS_ERROR
+} ctl_status_t;
+
+void ctlapi_set_listen(int port, const char *path);
+int ctlapi_start(void);
+void ctlapi_stop(void);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * generator.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/stanza.h"
+#include "server/lockstats.h"
+#include "server/generator.h"
+
+// stanzas sent in one pass when there is no rate, so reads still get a turn
+#define GENERATOR_FLOOD_BATCH 64
+
+// the most ticks a pass catches up on after the I/O thread was held up
+#define GENERATOR_MAX_CATCHUP 1000
+
+typedef enum {
+    GEN_PART_TEXT,
+    GEN_PART_SEQ,
+    GEN_PART_RAND
+} gen_part_type_t;
+
+typedef struct gen_part_t {
+    gen_part_type_t type;
+    char *text;
+} GenPart;
+
+// tick k is due at start + k * interval, so pacing never drifts, the clock
+// starts when the I/O thread first runs the generator
+typedef struct generator_t {
+    int id;
+    GList *parts;
+    int burst;
+    int count;
+    int sent;
+    int duration_ms;
+    gint64 start;
+    gint64 end;
+    gint64 interval;
+    guint64 ticks;
+    int owed;
+} Generator;
+
+// guards the running generators, taken by the I/O thread only while any run
+StbbrMutex generator_lock = STBBR_MUTEX_INIT("generator_lock");
+
+static GList *generators = NULL;
+static gint running = 0;
+static int last_id = 0;
+static GString *stanza = NULL;
+
+static GList* _parse_template(const char *template);
+static void _part_free(GenPart *part);
+static void _generator_free(Generator *generator);
+static int _send(Generator *generator, int stanzas, generator_send_func send_func);
+static gboolean _finished(Generator *generator);
+
+// a rate of 0 sends as fast as the connection allows, a duration and count
+// of 0 run until stopped
+int
+generator_start(const char *template, int rate, int burst, int duration_ms, int count)
+{
+    GList *stanzas = stanza_parse_all(template);
+    if (!stanzas) {
+        log_println(STBBR_LOGWARN, "Invalid generator template: %s", template);
+        return 0;
+    }
+    g_list_free_full(stanzas, (GDestroyNotify)stanza_free);
+
+    Generator *generator = malloc(sizeof(Generator));
+    generator->parts = _parse_template(template);
+    generator->burst = MAX(1, burst);
+    generator->count = MAX(0, count);
+    generator->sent = 0;
+    generator->duration_ms = MAX(0, duration_ms);
+    generator->start = 0;
+    generator->end = 0;
+    generator->interval = rate > 0 ? (gint64)generator->burst * 1000000 / rate : 0;
+    generator->ticks = 0;
+    generator->owed = 0;
+
+    lockstats_lock(&generator_lock);
+    generator->id = ++last_id;
+    generators = g_list_append(generators, generator);
+    g_atomic_int_set(&running, g_list_length(generators));
+    lockstats_unlock(&generator_lock);
+
+    log_println(STBBR_LOGINFO, "Generator %d started: %d/s in bursts of %d, for %dms or %d stanzas: %s",
+        generator->id, rate, generator->burst, duration_ms, count, template);
+
+    return generator->id;
+}
+
+void
+generator_stop_all(void)
+{
+    lockstats_lock(&generator_lock);
+    g_list_free_full(generators, (GDestroyNotify)_generator_free);
+    generators = NULL;
+    g_atomic_int_set(&running, 0);
+    lockstats_unlock(&generator_lock);
+}
+
+int
+generator_run(generator_send_func send_func, int max_wait_ms)
+{
+    if (!g_atomic_int_get(&running)) {
+        return max_wait_ms;
+    }
+
+    lockstats_lock(&generator_lock);
+    gint64 now = g_get_monotonic_time();
+    gint64 wait_us = (gint64)max_wait_ms * 1000;
+    GList *curr = generators;
+    while (curr) {
+        Generator *generator = curr->data;
+        GList *next = g_list_next(curr);
+        if (generator->start == 0) {
+            generator->start = now;
+            generator->end = generator->duration_ms > 0 ? now + (gint64)generator->duration_ms * 1000 : 0;
+        }
+
+        if (generator->interval == 0) {
+            // a short batch means the client stopped reading, poll waits for it
+            if (_send(generator, GENERATOR_FLOOD_BATCH, send_func) == GENERATOR_FLOOD_BATCH) {
+                wait_us = 0;
+            }
+        } else {
+            // ticks only fall due once the last burst has gone out
+            if (generator->owed == 0) {
+                int catchup = 0;
+                while (catchup < GENERATOR_MAX_CATCHUP
+                        && generator->start + (gint64)generator->ticks * generator->interval <= now) {
+                    generator->owed += generator->burst;
+                    generator->ticks++;
+                    catchup++;
+                }
+            }
+            generator->owed -= _send(generator, generator->owed, send_func);
+
+            // the client is not reading, the schedule waits for it rather
+            // than catching up in one flood once it does
+            if (generator->owed > 0 && !_finished(generator)) {
+                generator->start = now + generator->interval - (gint64)generator->ticks * generator->interval;
+            }
+            gint64 due = generator->start + (gint64)generator->ticks * generator->interval;
+            wait_us = MIN(wait_us, MAX(0, due - now));
+        }
+
+        if (_finished(generator) || (generator->end > 0 && now >= generator->end)) {
+            log_println(STBBR_LOGINFO, "Generator %d finished, sent %d stanzas", generator->id, generator->sent);
+            _generator_free(generator);
+            generators = g_list_delete_link(generators, curr);
+        }
+        curr = next;
+    }
+    g_atomic_int_set(&running, g_list_length(generators));
+    lockstats_unlock(&generator_lock);
+
+    return (wait_us + 999) / 1000;
+}
+
+// returns how many were sent, fewer once the count is reached or the client
+// cannot take more
+static int
+_send(Generator *generator, int stanzas, generator_send_func send_func)
+{
+    if (!stanza) {
+        stanza = g_string_sized_new(1024);
+    }
+
+    int i;
+    for (i = 0; i < stanzas && !_finished(generator); i++) {
+        g_string_truncate(stanza, 0);
+        GList *curr = generator->parts;
+        while (curr) {
+            GenPart *part = curr->data;
+            switch (part->type) {
+                case GEN_PART_TEXT:
+                    g_string_append(stanza, part->text);
+                    break;
+                case GEN_PART_SEQ:
+                    g_string_append_printf(stanza, "%d", generator->sent + 1);
+                    break;
+                case GEN_PART_RAND:
+                    g_string_append_printf(stanza, "%08x", g_random_int());
+                    break;
+            }
+            curr = g_list_next(curr);
+        }
+
+        if (!send_func(stanza->str)) {
+            break;
+        }
+        generator->sent++;
+    }
+
+    return i;
+}
+
+static gboolean
+_finished(Generator *generator)
+{
+    return generator->count > 0 && generator->sent >= generator->count;
+}
+
+// the template is split once so each stanza is only joined
+static GList*
+_parse_template(const char *template)
+{
+    GList *parts = NULL;
+    const char *text = template;
+    while (*text) {
+        const char *seq = strstr(text, "${seq}");
+        const char *rand = strstr(text, "${rand}");
+        const char *next = seq;
+        gen_part_type_t type = GEN_PART_SEQ;
+        if (!next || (rand && rand < next)) {
+            next = rand;
+            type = GEN_PART_RAND;
+        }
+
+        GenPart *part = malloc(sizeof(GenPart));
+        part->type = GEN_PART_TEXT;
+        if (!next) {
+            part->text = g_strdup(text);
+            parts = g_list_append(parts, part);
+            break;
+        }
+        part->text = g_strndup(text, next - text);
+        parts = g_list_append(parts, part);
+
+        GenPart *placeholder = malloc(sizeof(GenPart));
+        placeholder->type = type;
+        placeholder->text = NULL;
+        parts = g_list_append(parts, placeholder);
+
+        text = next + (type == GEN_PART_SEQ ? strlen("${seq}") : strlen("${rand}"));
+    }
+
+    return parts;
+}
+
+static void
+_part_free(GenPart *part)
+{
+    g_free(part->text);
+    free(part);
+}
+
+static void
+_generator_free(Generator *generator)
+{
+    g_list_free_full(generator->parts, (GDestroyNotify)_part_free);
+    free(generator);
+}
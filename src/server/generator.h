@@ -0,0 +1,37 @@
+/*
+ * generator.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_GENERATOR
+#define __H_GENERATOR
+
+#include <glib.h>
+
+// FALSE when the client cannot take the stream yet, it is offered again later
+typedef gboolean (*generator_send_func)(const char * const stream);
+
+int generator_start(const char *template, int rate, int burst, int duration_ms, int count);
+void generator_stop_all(void);
+
+// called from the I/O thread, returns how long until the next stanza is due
+int generator_run(generator_send_func send_func, int max_wait_ms);
+
+#endif
@@ -32,6 +32,7 @@
 #endif
 
 #include <stdint.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <microhttpd.h>
 #include <glib.h>
@@ -40,28 +41,249 @@
 #include "server/server.h"
 #include "server/prime.h"
 #include "server/verify.h"
+#include "server/rtt.h"
+#include "server/lockstats.h"
+#include "server/batch.h"
+#include "server/stanzas.h"
+#include "server/netem.h"
+#include "server/generator.h"
+#include "server/roster.h"
+#include "server/muc.h"
+#include "server/trace.h"
 
 struct MHD_Daemon *httpdaemmon = NULL;
+static unsigned int threads = 1;
+static char *unix_path = NULL;
+
+// connections waiting for the client to send something
+StbbrMutex suspend_lock = STBBR_MUTEX_INIT("suspend_lock");
+static pthread_cond_t deadline_cond = PTHREAD_COND_INITIALIZER;
+static GList *suspended = NULL;
+static gboolean stopping = FALSE;
+static pthread_t deadline_thread;
 
 #define POSTBUFFERSIZE 2048
+#define STREAM_BLOCK_SIZE 4096
+#define STREAM_MAX_EVENTS 32
 
 typedef enum {
     STBBR_OP_UNKNOWN,
     STBBR_OP_SEND,
     STBBR_OP_FOR,
-    STBBR_OP_VERIFY
+    STBBR_OP_VERIFY,
+    STBBR_OP_RTT,
+    STBBR_OP_METRICS,
+    STBBR_OP_BATCH,
+    STBBR_OP_STREAM,
+    STBBR_OP_WAIT,
+    STBBR_OP_NETEM,
+    STBBR_OP_GENERATE,
+    STBBR_OP_ROSTER,
+    STBBR_OP_MUC,
+    STBBR_OP_MUC_MESSAGE,
+    STBBR_OP_RECORD,
+    STBBR_OP_REPLAY,
+    STBBR_OP_HISTORY,
+    STBBR_OP_HISTORY_WATCH,
+    STBBR_OP_MARK,
+    STBBR_OP_VERIFY_ORDER
 } stbbr_op_t;
 
 typedef struct conn_info_t {
     stbbr_op_t stbbr_op;
     GString *body;
+    XMPPStanza *expected;
+    gint64 deadline;
+    long after;
+    GList *order;
+    int matched;
+    long checked;
 } ConnectionInfo;
 
+typedef struct waiter_t {
+    struct MHD_Connection *conn;
+    gint64 deadline;
+} Waiter;
+
+typedef struct stream_info_t {
+    struct MHD_Connection *conn;
+    long next_seq;
+    GString *pending;
+} StreamInfo;
+
+static void
+_json_escape(GString *out, const char *text)
+{
+    const char *curr;
+    for (curr = text; *curr; curr++) {
+        switch (*curr) {
+            case '"':  g_string_append(out, "\\\""); break;
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            case '\r': g_string_append(out, "\\r"); break;
+            case '\t': g_string_append(out, "\\t"); break;
+            default:
+                if ((unsigned char)*curr < 0x20) {
+                    g_string_append_printf(out, "\\u%04x", *curr);
+                } else {
+                    g_string_append_c(out, *curr);
+                }
+        }
+    }
+}
+
+// must be called holding suspend_lock, a deadline of 0 waits for the next stanza only
+static void
+_suspend(struct MHD_Connection *conn, gint64 deadline)
+{
+    Waiter *waiter = malloc(sizeof(Waiter));
+    waiter->conn = conn;
+    waiter->deadline = deadline;
+
+    MHD_suspend_connection(conn);
+    suspended = g_list_prepend(suspended, waiter);
+    if (deadline > 0) {
+        pthread_cond_signal(&deadline_cond);
+    }
+}
+
+static void
+_stanza_added(void)
+{
+    lockstats_lock(&suspend_lock);
+    GList *curr = suspended;
+    while (curr) {
+        Waiter *waiter = curr->data;
+        MHD_resume_connection(waiter->conn);
+        curr = g_list_next(curr);
+    }
+    g_list_free_full(suspended, free);
+    suspended = NULL;
+    lockstats_unlock(&suspend_lock);
+}
+
+// resumes waiting connections when their deadline passes
+static void*
+_deadline_cb(void *userdata)
+{
+    lockstats_lock(&suspend_lock);
+    while (!stopping) {
+        gint64 now = g_get_monotonic_time();
+        gint64 next = 0;
+
+        GList *curr = suspended;
+        while (curr) {
+            Waiter *waiter = curr->data;
+            GList *next_link = g_list_next(curr);
+            if (waiter->deadline > 0 && waiter->deadline <= now) {
+                MHD_resume_connection(waiter->conn);
+                suspended = g_list_delete_link(suspended, curr);
+                free(waiter);
+            } else if (waiter->deadline > 0 && (next == 0 || waiter->deadline < next)) {
+                next = waiter->deadline;
+            }
+            curr = next_link;
+        }
+
+        lockstats_cond_timedwait(&suspend_lock, &deadline_cond, next == 0 ? -1 : next - now);
+    }
+    lockstats_unlock(&suspend_lock);
+
+    return NULL;
+}
+
+static ssize_t
+_stream_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    StreamInfo *stream = cls;
+
+    if (stream->pending->len == 0) {
+        if (stopping) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+
+        GList *events = stanzas_since(stream->next_seq, STREAM_MAX_EVENTS);
+        if (!events) {
+            // nothing new, suspend until the next stanza is received
+            lockstats_lock(&suspend_lock);
+            if (!stopping && stanzas_last_seq() <= stream->next_seq) {
+                _suspend(stream->conn, 0);
+            }
+            lockstats_unlock(&suspend_lock);
+            return 0;
+        }
+
+        GList *curr = events;
+        while (curr) {
+            StanzaEvent *event = curr->data;
+            g_string_append_printf(stream->pending, "id: %ld\nevent: stanza\ndata: {\"seq\":%ld,\"timestamp\":%" G_GINT64_FORMAT ",\"stanza\":\"",
+                event->seq, event->seq, event->timestamp);
+            _json_escape(stream->pending, event->text);
+            g_string_append(stream->pending, "\"}\n\n");
+            stream->next_seq = event->seq;
+            curr = g_list_next(curr);
+        }
+        g_list_free_full(events, (GDestroyNotify)stanzas_event_free);
+    }
+
+    size_t len = MIN(max, stream->pending->len);
+    memcpy(buf, stream->pending->str, len);
+    g_string_erase(stream->pending, 0, len);
+
+    return len;
+}
+
+static void
+_stream_free(void *cls)
+{
+    StreamInfo *stream = cls;
+    g_string_free(stream->pending, TRUE);
+    free(stream);
+}
+
+static enum MHD_Result
+_start_stream(struct MHD_Connection *conn)
+{
+    const char *since = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "since");
+    if (!since) {
+        since = MHD_lookup_connection_value(conn, MHD_HEADER_KIND, "Last-Event-ID");
+    }
+
+    StreamInfo *stream = malloc(sizeof(StreamInfo));
+    stream->conn = conn;
+    stream->pending = g_string_new("");
+    if (since) {
+        stream->next_seq = strtol(since, NULL, 10);
+    } else {
+        stream->next_seq = stanzas_last_seq();
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, STREAM_BLOCK_SIZE,
+        _stream_reader, stream, _stream_free);
+    if (!response) {
+        _stream_free(stream);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/event-stream");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    int ret = MHD_queue_response(conn, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
 ConnectionInfo*
 create_connection_info(void)
 {
     ConnectionInfo *con_info = malloc(sizeof(ConnectionInfo));
     con_info->body = g_string_new("");
+    con_info->expected = NULL;
+    con_info->deadline = -1;
+    con_info->after = -1;
+    con_info->order = NULL;
+    con_info->matched = 0;
+    con_info->checked = -1;
 
     return con_info;
 }
@@ -73,6 +295,8 @@ destroy_connection_info(ConnectionInfo *con_info)
         g_string_free(con_info->body, TRUE);
         con_info->body = NULL;
     }
+    stanza_free(con_info->expected);
+    g_list_free_full(con_info->order, (GDestroyNotify)stanza_free);
     free(con_info);
 }
 
@@ -96,6 +320,115 @@ send_response(struct MHD_Connection* conn, const char* body, int status_code)
     return ret;
 }
 
+static enum MHD_Result
+_send_seq(struct MHD_Connection *conn, long seq)
+{
+    char body[32];
+    snprintf(body, sizeof(body), "%ld", seq);
+
+    return send_response(conn, body, MHD_HTTP_OK);
+}
+
+// missing or negative marks are -1
+static long
+_after_arg(struct MHD_Connection *conn)
+{
+    const char *after = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "after");
+    if (!after) {
+        return -1;
+    }
+
+    return MAX(-1, strtol(after, NULL, 10));
+}
+
+// checks the history, and if nothing matches suspends the connection until a stanza arrives or the deadline passes
+// with a mark only stanzas after it are checked and the matching seq is returned
+static enum MHD_Result
+_wait_for_match(struct MHD_Connection *conn, ConnectionInfo *con_info, const char *id)
+{
+    const char *what = id ? "WAIT" : con_info->order ? "VERIFY ORDER" : "VERIFY";
+    const char *expected = id ? id : con_info->body->str;
+
+    while (TRUE) {
+        long seq = stanzas_last_seq();
+        long res;
+        if (con_info->order) {
+            // carries on from the stanzas already matched
+            long last = 0;
+            GList *pending = g_list_nth(con_info->order, con_info->matched);
+            con_info->matched += stanzas_find_in_order(pending, con_info->checked, &last);
+            res = con_info->matched == (int)g_list_length(con_info->order) ? last : 0;
+            con_info->checked = MAX(last, seq);
+        } else if (con_info->after >= 0) {
+            if (id) {
+                res = stanzas_find_id(id, con_info->after);
+            } else {
+                res = stanzas_find(con_info->expected, con_info->after);
+            }
+        } else if (id) {
+            res = stanzas_contains_id((char*)id);
+        } else {
+            res = stanzas_verify_any(con_info->expected);
+        }
+
+        if (res) {
+            log_println(STBBR_LOGINFO, "%s SUCCESS: %s", what, expected);
+            if (con_info->after >= 0) {
+                return _send_seq(conn, res);
+            }
+            return send_response(conn, "true", MHD_HTTP_OK);
+        }
+
+        // nothing up to seq matched, a resumed connection only checks what arrived since
+        if (con_info->after >= 0) {
+            con_info->after = MAX(con_info->after, seq);
+        }
+
+        if (con_info->deadline > 0 && g_get_monotonic_time() >= con_info->deadline) {
+            log_println(STBBR_LOGINFO, "%s FAIL: %s", what, expected);
+            return send_response(conn, "false", MHD_HTTP_OK);
+        }
+
+        lockstats_lock(&suspend_lock);
+        if (stopping) {
+            lockstats_unlock(&suspend_lock);
+            return send_response(conn, "false", MHD_HTTP_OK);
+        }
+
+        // check again if a stanza arrived since the check
+        if (stanzas_last_seq() == seq) {
+            _suspend(conn, con_info->deadline);
+            lockstats_unlock(&suspend_lock);
+            return MHD_YES;
+        }
+        lockstats_unlock(&suspend_lock);
+    }
+}
+
+// missing arguments are 0
+static int
+_int_arg(struct MHD_Connection *conn, const char *name)
+{
+    const char *value = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, name);
+    if (!value) {
+        return 0;
+    }
+
+    return strtol(value, NULL, 10);
+}
+
+static gint64
+_deadline(struct MHD_Connection *conn)
+{
+    const char *timeout_ms = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "timeout_ms");
+    if (!timeout_ms) {
+        return 0;
+    }
+
+    // a deadline of at least 1 so that zero timeouts still fail
+    return g_get_monotonic_time() + MAX(1, strtol(timeout_ms, NULL, 10) * 1000);
+}
+
 enum MHD_Result
 connection_cb(void* cls, struct MHD_Connection* conn, const char* url, const char* method, const char* version,
     const char* data, size_t* size, void** con_cls)
@@ -115,6 +448,38 @@ connection_cb(void* cls, struct MHD_Connection* conn, const char* url, const cha
             con_info->stbbr_op = STBBR_OP_FOR;
         } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/verify") == 0) {
             con_info->stbbr_op = STBBR_OP_VERIFY;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/batch") == 0) {
+            con_info->stbbr_op = STBBR_OP_BATCH;
+        } else if (g_strcmp0(method, "GET") == 0 && g_strcmp0(url, "/rtt") == 0) {
+            con_info->stbbr_op = STBBR_OP_RTT;
+        } else if (g_strcmp0(method, "GET") == 0 && g_strcmp0(url, "/metrics") == 0) {
+            con_info->stbbr_op = STBBR_OP_METRICS;
+        } else if (g_strcmp0(method, "GET") == 0 && g_strcmp0(url, "/stream") == 0) {
+            con_info->stbbr_op = STBBR_OP_STREAM;
+        } else if (g_strcmp0(method, "GET") == 0 && g_strcmp0(url, "/wait") == 0) {
+            con_info->stbbr_op = STBBR_OP_WAIT;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/netem") == 0) {
+            con_info->stbbr_op = STBBR_OP_NETEM;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/generate") == 0) {
+            con_info->stbbr_op = STBBR_OP_GENERATE;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/roster") == 0) {
+            con_info->stbbr_op = STBBR_OP_ROSTER;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/muc") == 0) {
+            con_info->stbbr_op = STBBR_OP_MUC;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/muc/message") == 0) {
+            con_info->stbbr_op = STBBR_OP_MUC_MESSAGE;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/record") == 0) {
+            con_info->stbbr_op = STBBR_OP_RECORD;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/replay") == 0) {
+            con_info->stbbr_op = STBBR_OP_REPLAY;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/history") == 0) {
+            con_info->stbbr_op = STBBR_OP_HISTORY;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/history/watch") == 0) {
+            con_info->stbbr_op = STBBR_OP_HISTORY_WATCH;
+        } else if (g_strcmp0(method, "POST") == 0 && g_strcmp0(url, "/verify/order") == 0) {
+            con_info->stbbr_op = STBBR_OP_VERIFY_ORDER;
+        } else if (g_strcmp0(method, "GET") == 0 && g_strcmp0(url, "/mark") == 0) {
+            con_info->stbbr_op = STBBR_OP_MARK;
         } else {
             con_info->stbbr_op = STBBR_OP_UNKNOWN;
             return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
@@ -136,7 +501,19 @@ connection_cb(void* cls, struct MHD_Connection* conn, const char* url, const cha
 
     const char *id = NULL;
     const char *query = NULL;
+    const char *rule = NULL;
+    const char *room = NULL;
+    const char *nick = NULL;
+    const char *path = NULL;
+    gboolean next = FALSE;
     int res = 0;
+    long seq = 0;
+    GString *report = NULL;
+    GList *ops = NULL;
+    stbbr_netem_t conditions;
+    stbbr_roster_t roster;
+    stbbr_history_t history;
+    const char *policy = NULL;
 
     switch (con_info->stbbr_op) {
         case STBBR_OP_SEND:
@@ -146,28 +523,255 @@ connection_cb(void* cls, struct MHD_Connection* conn, const char* url, const cha
         case STBBR_OP_FOR:
             id = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "id");
             query = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "query");
-            if (id && query) {
+            rule = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "rule");
+            if ((id != NULL) + (query != NULL) + (rule != NULL) > 1) {
                 return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
             }
 
+            next = g_strcmp0(MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "next"), "true") == 0;
+
             if (id) {
-                prime_for_id(id, con_info->body->str);
+                if (next) {
+                    prime_for_id_next(id, con_info->body->str);
+                } else {
+                    prime_for_id(id, con_info->body->str);
+                }
                 return send_response(conn, NULL, MHD_HTTP_CREATED);
             }
 
             if (query) {
-                prime_for_query(query, con_info->body->str);
+                if (next) {
+                    prime_for_query_next(query, con_info->body->str);
+                } else {
+                    prime_for_query(query, con_info->body->str);
+                }
+                return send_response(conn, NULL, MHD_HTTP_CREATED);
+            }
+
+            if (rule) {
+                if (!prime_for_rule(rule, con_info->body->str)) {
+                    return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+                }
                 return send_response(conn, NULL, MHD_HTTP_CREATED);
             }
 
             return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
         case STBBR_OP_VERIFY:
+            if (MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "timeout_ms")) {
+                if (!con_info->expected) {
+                    con_info->expected = stanza_parse(con_info->body->str);
+                    con_info->deadline = _deadline(conn);
+                    con_info->after = _after_arg(conn);
+                }
+                if (!con_info->expected) {
+                    return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+                }
+                return _wait_for_match(conn, con_info, NULL);
+            }
+
+            if (MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "after")) {
+                seq = verify_after(con_info->body->str, _after_arg(conn));
+                if (seq) {
+                    return _send_seq(conn, seq);
+                }
+                return send_response(conn, "false", MHD_HTTP_OK);
+            }
+
             res = verify_any(con_info->body->str, TRUE);
             if (res) {
                 return send_response(conn, "true", MHD_HTTP_OK);
             } else {
                 return send_response(conn, "false", MHD_HTTP_OK);
             }
+        case STBBR_OP_BATCH:
+            report = g_string_new("");
+            ops = batch_parse(con_info->body->str, report);
+            if (!ops) {
+                log_println(STBBR_LOGWARN, "Batch rejected: %s", report->str);
+                res = send_response(conn, report->str, MHD_HTTP_BAD_REQUEST);
+                g_string_free(report, TRUE);
+                return res;
+            }
+
+            batch_run(ops, report);
+            batch_free(ops);
+            res = send_response(conn, report->str, MHD_HTTP_OK);
+            g_string_free(report, TRUE);
+
+            return res;
+        case STBBR_OP_WAIT:
+            id = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "id");
+            if (!id) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            if (con_info->deadline == -1) {
+                log_println(STBBR_LOGINFO, "Received wait for stanza with id: %s", id);
+                con_info->deadline = _deadline(conn);
+                con_info->after = _after_arg(conn);
+            }
+            return _wait_for_match(conn, con_info, id);
+        case STBBR_OP_MARK:
+            return _send_seq(conn, stanzas_last_seq());
+        case STBBR_OP_VERIFY_ORDER:
+            if (!con_info->order) {
+                con_info->order = stanza_parse_all(con_info->body->str);
+                con_info->after = _after_arg(conn);
+                con_info->checked = con_info->after;
+                // without a timeout a deadline in the past checks once
+                if (MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "timeout_ms")) {
+                    con_info->deadline = _deadline(conn);
+                } else {
+                    con_info->deadline = 1;
+                }
+            }
+            if (!con_info->order) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            return _wait_for_match(conn, con_info, NULL);
+        case STBBR_OP_STREAM:
+            return _start_stream(conn);
+        case STBBR_OP_NETEM:
+            conditions.delay_ms = _int_arg(conn, "delay_ms");
+            conditions.jitter_ms = _int_arg(conn, "jitter_ms");
+            conditions.jitter_normal = g_strcmp0(MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "jitter"), "normal") == 0;
+            conditions.out_bytes_per_sec = _int_arg(conn, "out_bps");
+            conditions.in_bytes_per_sec = _int_arg(conn, "in_bps");
+            conditions.fragment_bytes = _int_arg(conn, "fragment_bytes");
+            conditions.fragment_gap_ms = _int_arg(conn, "fragment_gap_ms");
+            netem_set(&conditions);
+
+            return send_response(conn, NULL, MHD_HTTP_OK);
+        case STBBR_OP_ROSTER:
+            if (!MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "count")) {
+                roster_set(NULL);
+                return send_response(conn, NULL, MHD_HTTP_OK);
+            }
+            roster.count = _int_arg(conn, "count");
+            roster.groups = _int_arg(conn, "groups");
+            roster.ungrouped_percent = _int_arg(conn, "ungrouped");
+            roster.both_percent = _int_arg(conn, "both");
+            roster.to_percent = _int_arg(conn, "to");
+            roster.from_percent = _int_arg(conn, "from");
+            roster.online_percent = _int_arg(conn, "online");
+            roster.seed = _int_arg(conn, "seed");
+            roster_set(&roster);
+
+            return send_response(conn, NULL, MHD_HTTP_CREATED);
+        case STBBR_OP_MUC:
+            room = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "room");
+            if (!room) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            muc_room(room, _int_arg(conn, "occupants"));
+
+            return send_response(conn, NULL, MHD_HTTP_CREATED);
+        case STBBR_OP_MUC_MESSAGE:
+            room = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "room");
+            nick = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "nick");
+            if (!room || !nick) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            res = muc_message(room, nick, con_info->body->str);
+            if (res == -1) {
+                return send_response(conn, NULL, MHD_HTTP_NOT_FOUND);
+            }
+            report = g_string_new("");
+            g_string_append_printf(report, "%d", res);
+            res = send_response(conn, report->str, MHD_HTTP_OK);
+            g_string_free(report, TRUE);
+
+            return res;
+        case STBBR_OP_RECORD:
+            path = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "path");
+            if (!path) {
+                trace_record_stop();
+                return send_response(conn, NULL, MHD_HTTP_OK);
+            }
+            if (!trace_record(path)) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+
+            return send_response(conn, NULL, MHD_HTTP_CREATED);
+        case STBBR_OP_REPLAY:
+            path = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "path");
+            if (!path) {
+                trace_replay_stop();
+                return send_response(conn, NULL, MHD_HTTP_OK);
+            }
+            if (MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "speed")) {
+                res = trace_replay(path, _int_arg(conn, "speed"));
+            } else {
+                res = trace_replay(path, 1);
+            }
+            if (res == -1) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            report = g_string_new("");
+            g_string_append_printf(report, "%d", res);
+            res = send_response(conn, report->str, MHD_HTTP_CREATED);
+            g_string_free(report, TRUE);
+
+            return res;
+        case STBBR_OP_HISTORY:
+            policy = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "policy");
+            if (!policy || g_strcmp0(policy, "oldest") == 0) {
+                history.policy = STBBR_HISTORY_OLDEST;
+            } else if (g_strcmp0(policy, "watched") == 0) {
+                history.policy = STBBR_HISTORY_WATCHED;
+            } else if (g_strcmp0(policy, "bodies") == 0) {
+                history.policy = STBBR_HISTORY_BODIES;
+            } else {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            history.max_stanzas = _int_arg(conn, "max_stanzas");
+            history.hot_stanzas = _int_arg(conn, "hot_stanzas");
+            if (MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "max_bytes")) {
+                history.max_bytes = strtol(MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "max_bytes"), NULL, 10);
+            } else {
+                history.max_bytes = 0;
+            }
+            stanzas_set_limit(&history);
+
+            return send_response(conn, NULL, MHD_HTTP_OK);
+        case STBBR_OP_HISTORY_WATCH:
+            if (!stanzas_watch(con_info->body->str)) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+
+            return send_response(conn, NULL, MHD_HTTP_CREATED);
+        case STBBR_OP_GENERATE:
+            if (g_strcmp0(MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "stop"), "true") == 0) {
+                generator_stop_all();
+                return send_response(conn, NULL, MHD_HTTP_OK);
+            }
+
+            res = generator_start(con_info->body->str, _int_arg(conn, "rate"), _int_arg(conn, "burst"),
+                _int_arg(conn, "duration_ms"), _int_arg(conn, "count"));
+            if (!res) {
+                return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
+            }
+            report = g_string_new("");
+            g_string_append_printf(report, "%d", res);
+            res = send_response(conn, report->str, MHD_HTTP_CREATED);
+            g_string_free(report, TRUE);
+
+            return res;
+        case STBBR_OP_RTT:
+            report = g_string_new("");
+            rtt_report(report);
+            res = send_response(conn, report->str, MHD_HTTP_OK);
+            g_string_free(report, TRUE);
+
+            return res;
+        case STBBR_OP_METRICS:
+            report = g_string_new("");
+            lockstats_metrics(report);
+            rtt_metrics(report);
+            stanzas_metrics(report);
+            res = send_response(conn, report->str, MHD_HTTP_OK);
+            g_string_free(report, TRUE);
+
+            return res;
         default:
             return send_response(conn, NULL, MHD_HTTP_BAD_REQUEST);
     }
@@ -184,25 +788,81 @@ request_completed(void* cls, struct MHD_Connection* conn, void** con_cls, enum M
     *con_cls = NULL;
 }
 
-int
-httpapi_start(int port)
+void
+httpapi_set_threads(int count)
 {
+    if (count < 1) {
+        threads = 1;
+    } else {
+        threads = count;
+    }
+}
+
+static int
+_start_daemon(int port, int listen_fd)
+{
+    stopping = FALSE;
+    stanzas_set_listener(_stanza_added);
+
+    // epoll where available, connections are kept alive between requests
     httpdaemmon = MHD_start_daemon(
-        MHD_USE_SELECT_INTERNALLY,
+        MHD_USE_AUTO_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME,
         port,
         NULL,
         NULL,
         &connection_cb,
         NULL,
+        MHD_OPTION_THREAD_POOL_SIZE,
+        threads,
+        MHD_OPTION_LISTEN_SOCKET,
+        listen_fd,
         MHD_OPTION_NOTIFY_COMPLETED,
         request_completed,
         NULL, MHD_OPTION_END);
 
     if (!httpdaemmon) {
+        if (listen_fd != -1) {
+            close(listen_fd);
+        }
         return 0;
     }
 
-    log_println(STBBR_LOGINFO, "HTTP daemon started on port: %d", port);
+    if (pthread_create(&deadline_thread, NULL, _deadline_cb, NULL) != 0) {
+        MHD_stop_daemon(httpdaemmon);
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+httpapi_start(int port)
+{
+    if (!_start_daemon(port, -1)) {
+        return 0;
+    }
+
+    log_println(STBBR_LOGINFO, "HTTP daemon started on port: %d, threads: %u", port, threads);
+
+    return 1;
+}
+
+int
+httpapi_start_unix(const char *path)
+{
+    int sock = server_listen_unix(path);
+    if (sock == -1) {
+        return 0;
+    }
+
+    // the daemon owns the socket from here
+    if (!_start_daemon(0, sock)) {
+        unlink(path);
+        return 0;
+    }
+
+    unix_path = strdup(path);
+    log_println(STBBR_LOGINFO, "HTTP daemon started on socket: %s, threads: %u", path, threads);
 
     return 1;
 }
@@ -210,6 +870,20 @@ httpapi_start(int port)
 void
 httpapi_stop(void)
 {
+    // let suspended streams finish before stopping
+    stanzas_set_listener(NULL);
+    lockstats_lock(&suspend_lock);
+    stopping = TRUE;
+    pthread_cond_signal(&deadline_cond);
+    lockstats_unlock(&suspend_lock);
+    pthread_join(deadline_thread, NULL);
+    _stanza_added();
+
     MHD_stop_daemon(httpdaemmon);
+    if (unix_path) {
+        unlink(unix_path);
+        free(unix_path);
+        unix_path = NULL;
+    }
     log_println(STBBR_LOGINFO, "HTTP daemon stopped.");
 }
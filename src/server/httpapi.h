@@ -20,5 +20,7 @@
  *
  */
 
+void httpapi_set_threads(int count);
 int httpapi_start(int port);
+int httpapi_start_unix(const char *path);
 void httpapi_stop(void);
@@ -0,0 +1,242 @@
+/*
+ * lockstats.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "stabber.h"
+#include "server/lockstats.h"
+
+static gboolean enabled = FALSE;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static GList *registry = NULL;
+
+static gint64 _now_ns(void);
+static void _register(StbbrMutex *lock);
+static int _bucket(gint64 hold_ns);
+static GList* _registered_locks(void);
+
+void
+lockstats_enable(gboolean enable)
+{
+    enabled = enable;
+}
+
+void
+lockstats_lock(StbbrMutex *lock)
+{
+    if (!enabled) {
+        pthread_mutex_lock(&lock->mutex);
+        lock->acquired_at = 0;
+        return;
+    }
+
+    if (!lock->registered) {
+        _register(lock);
+    }
+
+    gint64 wait = 0;
+    if (pthread_mutex_trylock(&lock->mutex) == 0) {
+        lock->stats.acquisitions++;
+    } else {
+        gint64 start = _now_ns();
+        pthread_mutex_lock(&lock->mutex);
+        wait = _now_ns() - start;
+        lock->stats.acquisitions++;
+        lock->stats.contended++;
+    }
+
+    lock->stats.wait_total_ms += wait / 1000000.0;
+    if (wait / 1000000.0 > lock->stats.wait_max_ms) {
+        lock->stats.wait_max_ms = wait / 1000000.0;
+    }
+    lock->acquired_at = _now_ns();
+}
+
+void
+lockstats_unlock(StbbrMutex *lock)
+{
+    if (lock->acquired_at != 0) {
+        gint64 hold = _now_ns() - lock->acquired_at;
+        lock->stats.hold_total_ms += hold / 1000000.0;
+        if (hold / 1000000.0 > lock->stats.hold_max_ms) {
+            lock->stats.hold_max_ms = hold / 1000000.0;
+        }
+        lock->stats.hold_hist[_bucket(hold)]++;
+        lock->acquired_at = 0;
+    }
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// time spent waiting on the condition does not count as holding the lock
+int
+lockstats_cond_timedwait(StbbrMutex *lock, pthread_cond_t *cond, gint64 timeout_us)
+{
+    gboolean timed = lock->acquired_at != 0;
+    if (timed) {
+        gint64 hold = _now_ns() - lock->acquired_at;
+        lock->stats.hold_total_ms += hold / 1000000.0;
+        if (hold / 1000000.0 > lock->stats.hold_max_ms) {
+            lock->stats.hold_max_ms = hold / 1000000.0;
+        }
+        lock->stats.hold_hist[_bucket(hold)]++;
+    }
+
+    int res;
+    if (timeout_us < 0) {
+        res = pthread_cond_wait(cond, &lock->mutex);
+    } else {
+        gint64 abs_us = g_get_real_time() + timeout_us;
+        struct timespec abstime;
+        abstime.tv_sec = abs_us / G_USEC_PER_SEC;
+        abstime.tv_nsec = (abs_us % G_USEC_PER_SEC) * 1000;
+        res = pthread_cond_timedwait(cond, &lock->mutex, &abstime);
+    }
+
+    if (timed) {
+        lock->stats.acquisitions++;
+        lock->acquired_at = _now_ns();
+    }
+
+    return res;
+}
+
+int
+lockstats_get(const char *name, stbbr_lockstats_t *stats)
+{
+    memset(stats, 0, sizeof(stbbr_lockstats_t));
+
+    int found = 0;
+    GList *locks = _registered_locks();
+    GList *curr = locks;
+    while (curr) {
+        StbbrMutex *lock = curr->data;
+        if (g_strcmp0(lock->name, name) == 0) {
+            pthread_mutex_lock(&lock->mutex);
+            memcpy(stats, &lock->stats, sizeof(stbbr_lockstats_t));
+            pthread_mutex_unlock(&lock->mutex);
+            found = 1;
+            break;
+        }
+        curr = g_list_next(curr);
+    }
+    g_list_free(locks);
+
+    return found;
+}
+
+void
+lockstats_metrics(GString *metrics)
+{
+    GList *locks = _registered_locks();
+    GList *curr = locks;
+    while (curr) {
+        StbbrMutex *lock = curr->data;
+        stbbr_lockstats_t stats;
+        pthread_mutex_lock(&lock->mutex);
+        memcpy(&stats, &lock->stats, sizeof(stbbr_lockstats_t));
+        pthread_mutex_unlock(&lock->mutex);
+
+        g_string_append_printf(metrics, "stabber_lock_acquisitions_total{lock=\"%s\"} %lu\n", lock->name, stats.acquisitions);
+        g_string_append_printf(metrics, "stabber_lock_contended_total{lock=\"%s\"} %lu\n", lock->name, stats.contended);
+        g_string_append_printf(metrics, "stabber_lock_wait_ms_total{lock=\"%s\"} %.6f\n", lock->name, stats.wait_total_ms);
+        g_string_append_printf(metrics, "stabber_lock_wait_ms_max{lock=\"%s\"} %.6f\n", lock->name, stats.wait_max_ms);
+        g_string_append_printf(metrics, "stabber_lock_hold_ms_max{lock=\"%s\"} %.6f\n", lock->name, stats.hold_max_ms);
+
+        unsigned long cumulative = 0;
+        int i;
+        for (i = 0; i < STBBR_LOCK_BUCKETS - 1; i++) {
+            cumulative += stats.hold_hist[i];
+            g_string_append_printf(metrics, "stabber_lock_hold_us_bucket{lock=\"%s\",le=\"%d\"} %lu\n", lock->name, 1 << i,
+                cumulative);
+        }
+        cumulative += stats.hold_hist[STBBR_LOCK_BUCKETS - 1];
+        g_string_append_printf(metrics, "stabber_lock_hold_us_bucket{lock=\"%s\",le=\"+Inf\"} %lu\n", lock->name, cumulative);
+        g_string_append_printf(metrics, "stabber_lock_hold_us_sum{lock=\"%s\"} %.3f\n", lock->name, stats.hold_total_ms * 1000.0);
+        g_string_append_printf(metrics, "stabber_lock_hold_us_count{lock=\"%s\"} %lu\n", lock->name, cumulative);
+
+        curr = g_list_next(curr);
+    }
+    g_list_free(locks);
+}
+
+void
+lockstats_reset(void)
+{
+    GList *locks = _registered_locks();
+    GList *curr = locks;
+    while (curr) {
+        StbbrMutex *lock = curr->data;
+        pthread_mutex_lock(&lock->mutex);
+        memset(&lock->stats, 0, sizeof(stbbr_lockstats_t));
+        pthread_mutex_unlock(&lock->mutex);
+        curr = g_list_next(curr);
+    }
+    g_list_free(locks);
+}
+
+static void
+_register(StbbrMutex *lock)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (!lock->registered) {
+        registry = g_list_append(registry, lock);
+        lock->registered = TRUE;
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// copy of the registry, so that no lock is taken while holding the registry lock,
+// the registered locks are globals and are never freed
+static GList*
+_registered_locks(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    GList *locks = g_list_copy(registry);
+    pthread_mutex_unlock(&registry_lock);
+
+    return locks;
+}
+
+static int
+_bucket(gint64 hold_ns)
+{
+    gint64 hold_us = hold_ns / 1000;
+    int bucket = 0;
+    while (bucket < STBBR_LOCK_BUCKETS - 1 && hold_us >= (1 << bucket)) {
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static gint64
+_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,50 @@
+/*
+ * lockstats.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_LOCKSTATS
+#define __H_LOCKSTATS
+
+#include <pthread.h>
+#include <glib.h>
+
+#include "stabber.h"
+
+typedef struct stbbr_mutex_t {
+    const char *name;
+    pthread_mutex_t mutex;
+    gboolean registered;
+    gint64 acquired_at;
+    stbbr_lockstats_t stats;
+} StbbrMutex;
+
+#define STBBR_MUTEX_INIT(lockname) { lockname, PTHREAD_MUTEX_INITIALIZER, FALSE, 0 }
+
+void lockstats_enable(gboolean enable);
+void lockstats_lock(StbbrMutex *lock);
+void lockstats_unlock(StbbrMutex *lock);
+int lockstats_cond_timedwait(StbbrMutex *lock, pthread_cond_t *cond, gint64 timeout_us);
+
+int lockstats_get(const char *name, stbbr_lockstats_t *stats);
+void lockstats_metrics(GString *metrics);
+void lockstats_reset(void);
+
+#endif
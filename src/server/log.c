@@ -35,11 +35,12 @@
 #include <glib/gstdio.h>
 
 #include "stabber.h"
+#include "server/lockstats.h"
 
 static FILE *logp;
 static gboolean logready = FALSE;
 static stbbr_log_t minlevel;
-pthread_mutex_t loglock;
+StbbrMutex loglock = STBBR_MUTEX_INIT("loglock");
 
 static gchar* _xdg_get_data_home(void);
 static gchar* _get_main_log_file(void);
@@ -50,7 +51,7 @@ static char* _levelstr(stbbr_log_t loglevel);
 void
 log_init(stbbr_log_t loglevel)
 {
-    pthread_mutex_lock(&loglock);
+    lockstats_lock(&loglock);
     minlevel = loglevel;
     gchar *xdg_data = _xdg_get_data_home();
     GString *log_dir = g_string_new(xdg_data);
@@ -64,7 +65,7 @@ log_init(stbbr_log_t loglevel)
     g_chmod(log_file, S_IRUSR | S_IWUSR);
     free(log_file);
     logready = TRUE;
-    pthread_mutex_unlock(&loglock);
+    lockstats_unlock(&loglock);
 }
 
 void
@@ -74,7 +75,7 @@ log_println(stbbr_log_t loglevel, const char * const msg, ...)
         return;
     }
 
-    pthread_mutex_lock(&loglock);
+    lockstats_lock(&loglock);
     va_list arg;
     va_start(arg, msg);
     GString *fmt_msg = g_string_new(NULL);
@@ -99,18 +100,18 @@ log_println(stbbr_log_t loglevel, const char * const msg, ...)
     g_free(date_fmt);
     g_string_free(fmt_msg, TRUE);
     va_end(arg);
-    pthread_mutex_unlock(&loglock);
+    lockstats_unlock(&loglock);
 }
 
 void
 log_close(void)
 {
-    pthread_mutex_lock(&loglock);
+    lockstats_lock(&loglock);
     if (logready && logp) {
         fclose(logp);
     }
     logready = FALSE;
-    pthread_mutex_unlock(&loglock);
+    lockstats_unlock(&loglock);
 }
 
 static gchar*
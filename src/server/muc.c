@@ -0,0 +1,284 @@
+/*
+ * muc.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/lockstats.h"
+#include "server/server.h"
+#include "server/stanza.h"
+#include "server/muc.h"
+
+#define MUC_USER_NS "http://jabber.org/protocol/muc#user"
+#define MUC_ITEM "<item affiliation=\"member\" role=\"participant\"/>"
+
+typedef enum {
+    MUC_OCCUPANTS,
+    MUC_SELF,
+    MUC_SUBJECT,
+    MUC_DONE
+} muc_phase_t;
+
+// room and nick are escaped for use in attributes
+typedef struct muc_room_t {
+    char *jid;
+    int occupants;
+    char *nick;
+} MucRoom;
+
+// a join takes its own copy of the room, it may be redefined while streaming
+struct muc_join_t {
+    char *jid;
+    char *nick;
+    int occupants;
+    muc_phase_t phase;
+    int next;
+};
+
+// guards the rooms, joins happen on the connection thread and messages
+// are posted from the api
+StbbrMutex muc_lock = STBBR_MUTEX_INIT("muc_lock");
+
+static GHashTable *rooms = NULL;
+
+static void _room_free(MucRoom *room);
+static MucRoom* _room_for(const char *jid, char **resource);
+
+void
+muc_room(const char *room, int occupants)
+{
+    lockstats_lock(&muc_lock);
+    if (!rooms) {
+        rooms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_room_free);
+    }
+
+    MucRoom *newroom = malloc(sizeof(MucRoom));
+    newroom->jid = g_markup_escape_text(room, -1);
+    newroom->occupants = occupants;
+    newroom->nick = NULL;
+    g_hash_table_replace(rooms, g_strdup(room), newroom);
+    lockstats_unlock(&muc_lock);
+
+    log_println(STBBR_LOGINFO, "Received room stub: %s, %d occupants", room, occupants);
+}
+
+// the message is serialised once and the buffer is queued by reference,
+// with no to attribute the same bytes suit every joined occupant, -1 when
+// the room does not exist
+int
+muc_message(const char *room, const char *nick, const char *body)
+{
+    lockstats_lock(&muc_lock);
+    MucRoom *found = rooms ? g_hash_table_lookup(rooms, room) : NULL;
+    if (!found) {
+        lockstats_unlock(&muc_lock);
+        log_println(STBBR_LOGERROR, "No such room: %s", room);
+        return -1;
+    }
+
+    if (!found->nick) {
+        lockstats_unlock(&muc_lock);
+        return 0;
+    }
+
+    char *nick_esc = g_markup_escape_text(nick, -1);
+    char *body_esc = g_markup_escape_text(body, -1);
+    char *message = g_strdup_printf("<message type=\"groupchat\" from=\"%s/%s\"><body>%s</body></message>",
+        found->jid, nick_esc, body_esc);
+    g_free(nick_esc);
+    g_free(body_esc);
+    lockstats_unlock(&muc_lock);
+
+    GBytes *shared = g_bytes_new_take(message, strlen(message) + 1);
+    server_send_bytes(shared);
+    g_bytes_unref(shared);
+
+    return 1;
+}
+
+// presence to room/nick joins, or leaves when unavailable, groupchat
+// messages to a joined room are reflected back from the client's nick
+gboolean
+muc_handle(XMPPStanza *stanza, GString *reply, MucJoin **join)
+{
+    const char *to = stanza_get_attr(stanza, "to");
+    if (!to) {
+        return FALSE;
+    }
+
+    const char *type = stanza_get_attr(stanza, "type");
+    char *resource = NULL;
+
+    lockstats_lock(&muc_lock);
+    MucRoom *room = _room_for(to, &resource);
+    if (!room) {
+        lockstats_unlock(&muc_lock);
+        return FALSE;
+    }
+
+    gboolean handled = FALSE;
+    if (g_strcmp0(stanza->name, "presence") == 0 && resource) {
+        if (g_strcmp0(type, "unavailable") == 0) {
+            char *nick = g_markup_escape_text(resource, -1);
+            g_string_append_printf(reply,
+                "<presence type=\"unavailable\" from=\"%s/%s\"><x xmlns=\"" MUC_USER_NS "\">"
+                "<item affiliation=\"member\" role=\"none\"/><status code=\"110\"/></x></presence>",
+                room->jid, nick);
+            g_free(nick);
+            g_free(room->nick);
+            room->nick = NULL;
+            handled = TRUE;
+        } else if (!type) {
+            g_free(room->nick);
+            room->nick = g_markup_escape_text(resource, -1);
+
+            MucJoin *newjoin = malloc(sizeof(MucJoin));
+            newjoin->jid = g_strdup(room->jid);
+            newjoin->nick = g_strdup(room->nick);
+            newjoin->occupants = room->occupants;
+            newjoin->phase = room->occupants > 0 ? MUC_OCCUPANTS : MUC_SELF;
+            newjoin->next = 0;
+            *join = newjoin;
+            handled = TRUE;
+        }
+    } else if (g_strcmp0(stanza->name, "message") == 0 && g_strcmp0(type, "groupchat") == 0 && room->nick) {
+        g_string_append_printf(reply, "<message type=\"groupchat\" from=\"%s/%s\"", room->jid, room->nick);
+        const char *id = stanza_get_id(stanza);
+        if (id) {
+            char *id_esc = g_markup_escape_text(id, -1);
+            g_string_append_printf(reply, " id=\"%s\"", id_esc);
+            g_free(id_esc);
+        }
+        g_string_append_c(reply, '>');
+        GList *curr = stanza->children;
+        while (curr) {
+            char *child = stanza_to_string(curr->data);
+            g_string_append(reply, child);
+            free(child);
+            curr = g_list_next(curr);
+        }
+        g_string_append(reply, "</message>");
+        handled = TRUE;
+    }
+    lockstats_unlock(&muc_lock);
+
+    g_free(resource);
+
+    return handled;
+}
+
+// appends about a chunk of the join, FALSE once it is complete
+gboolean
+muc_join_fill(MucJoin *join, GString *chunk)
+{
+    while (chunk->len < MUC_CHUNK && join->phase != MUC_DONE) {
+        switch (join->phase) {
+        case MUC_OCCUPANTS:
+            join->next++;
+            g_string_append_printf(chunk,
+                "<presence from=\"%s/occupant%d\"><x xmlns=\"" MUC_USER_NS "\">" MUC_ITEM "</x></presence>",
+                join->jid, join->next);
+            if (join->next == join->occupants) {
+                join->phase = MUC_SELF;
+            }
+            break;
+        case MUC_SELF:
+            g_string_append_printf(chunk,
+                "<presence from=\"%s/%s\"><x xmlns=\"" MUC_USER_NS "\">" MUC_ITEM "<status code=\"110\"/></x></presence>",
+                join->jid, join->nick);
+            join->phase = MUC_SUBJECT;
+            break;
+        case MUC_SUBJECT:
+            g_string_append_printf(chunk, "<message type=\"groupchat\" from=\"%s\"><subject/></message>", join->jid);
+            join->phase = MUC_DONE;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return join->phase != MUC_DONE;
+}
+
+int
+muc_join_count(MucJoin *join)
+{
+    return join->occupants;
+}
+
+void
+muc_join_free(MucJoin *join)
+{
+    if (!join) {
+        return;
+    }
+
+    g_free(join->jid);
+    g_free(join->nick);
+    free(join);
+}
+
+void
+muc_free_all(void)
+{
+    lockstats_lock(&muc_lock);
+    if (rooms) {
+        g_hash_table_destroy(rooms);
+        rooms = NULL;
+    }
+    lockstats_unlock(&muc_lock);
+}
+
+static void
+_room_free(MucRoom *room)
+{
+    if (!room) {
+        return;
+    }
+
+    g_free(room->jid);
+    g_free(room->nick);
+    free(room);
+}
+
+// the room for the bare part of jid, resource is set to what follows it
+static MucRoom*
+_room_for(const char *jid, char **resource)
+{
+    if (!rooms) {
+        return NULL;
+    }
+
+    const char *slash = strchr(jid, '/');
+    char *bare = slash ? g_strndup(jid, slash - jid) : g_strdup(jid);
+    MucRoom *room = g_hash_table_lookup(rooms, bare);
+    g_free(bare);
+
+    if (room && slash && slash[1] != '\0') {
+        *resource = g_strdup(slash + 1);
+    }
+
+    return room;
+}
@@ -0,0 +1,45 @@
+/*
+ * muc.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_MUC
+#define __H_MUC
+
+#include <glib.h>
+
+#include "server/stanza.h"
+
+#define MUC_CHUNK 16384
+
+typedef struct muc_join_t MucJoin;
+
+void muc_room(const char *room, int occupants);
+int muc_message(const char *room, const char *nick, const char *body);
+
+gboolean muc_handle(XMPPStanza *stanza, GString *reply, MucJoin **join);
+
+gboolean muc_join_fill(MucJoin *join, GString *chunk);
+int muc_join_count(MucJoin *join);
+void muc_join_free(MucJoin *join);
+
+void muc_free_all(void);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * netem.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/netem.h"
+
+// delayed output sits in a timer wheel of 1ms ticks, a chunk further out than
+// the wheel goes round waits for its own tick to come up again
+#define NETEM_SLOTS 1024
+#define NETEM_TICK_US 1000
+
+// the longest a drain waits for delayed output once the stream has ended
+#define NETEM_DRAIN_MS 2000
+
+typedef struct netem_chunk_t {
+    char *data;
+    size_t len;
+    size_t off;
+    gint64 tick;
+} NetemChunk;
+
+typedef struct netem_bucket_t {
+    double tokens;
+    gint64 last;
+} NetemBucket;
+
+// set from any thread, read by the I/O thread
+static gint configured = FALSE;
+static gint delay_ms = 0;
+static gint jitter_ms = 0;
+static gint jitter_normal = FALSE;
+static gint out_rate = 0;
+static gint in_rate = 0;
+static gint fragment_bytes = 0;
+static gint fragment_gap_ms = 0;
+
+static GQueue wheel[NETEM_SLOTS];
+static GQueue ready = G_QUEUE_INIT;
+static guint scheduled = 0;
+static size_t queued = 0;
+static gint64 wheel_tick = 0;
+static gint64 last_tick = 0;
+static gint64 next_write = 0;
+static NetemBucket out_bucket = { 0, 0 };
+static NetemBucket in_bucket = { 0, 0 };
+
+static gint64 _delay_us(void);
+static void _advance(gint64 now);
+static int _next_tick_ms(void);
+static void _refill(NetemBucket *bucket, int rate, gint64 now);
+static int _bucket_wait_ms(NetemBucket *bucket, int rate);
+static void _chunk_free(NetemChunk *chunk);
+
+void
+netem_set(stbbr_netem_t *conditions)
+{
+    stbbr_netem_t none;
+    memset(&none, 0, sizeof(none));
+    if (!conditions) {
+        conditions = &none;
+    }
+
+    g_atomic_int_set(&delay_ms, MAX(0, conditions->delay_ms));
+    g_atomic_int_set(&jitter_ms, MAX(0, conditions->jitter_ms));
+    g_atomic_int_set(&jitter_normal, conditions->jitter_normal ? TRUE : FALSE);
+    g_atomic_int_set(&out_rate, MAX(0, conditions->out_bytes_per_sec));
+    g_atomic_int_set(&in_rate, MAX(0, conditions->in_bytes_per_sec));
+    g_atomic_int_set(&fragment_bytes, MAX(0, conditions->fragment_bytes));
+    g_atomic_int_set(&fragment_gap_ms, MAX(0, conditions->fragment_gap_ms));
+    g_atomic_int_set(&configured, conditions->delay_ms > 0 || conditions->jitter_ms > 0
+        || conditions->out_bytes_per_sec > 0 || conditions->in_bytes_per_sec > 0
+        || conditions->fragment_bytes > 0);
+
+    log_println(STBBR_LOGINFO, "Network conditions: delay %dms, jitter %dms %s, out %d B/s, in %d B/s, fragments %d bytes every %dms",
+        conditions->delay_ms, conditions->jitter_ms, conditions->jitter_normal ? "normal" : "uniform",
+        conditions->out_bytes_per_sec, conditions->in_bytes_per_sec,
+        conditions->fragment_bytes, conditions->fragment_gap_ms);
+}
+
+// output already queued keeps going through the wheel after the conditions
+// are cleared, so nothing overtakes it
+int
+netem_active(void)
+{
+    return g_atomic_int_get(&configured) || scheduled > 0 || !g_queue_is_empty(&ready);
+}
+
+// bytes waiting to be written
+size_t
+netem_queued(void)
+{
+    return queued;
+}
+
+void
+netem_send(const char *data, size_t len)
+{
+    NetemChunk *chunk = malloc(sizeof(NetemChunk));
+    chunk->data = malloc(len);
+    memcpy(chunk->data, data, len);
+    chunk->len = len;
+    chunk->off = 0;
+    queued += len;
+
+    // a chunk never goes before one sent earlier, even with less delay
+    gint64 now = g_get_monotonic_time();
+    gint64 tick = (now + _delay_us()) / NETEM_TICK_US;
+    if (tick < last_tick) {
+        tick = last_tick;
+    }
+    last_tick = tick;
+
+    if (scheduled == 0 && tick <= now / NETEM_TICK_US) {
+        g_queue_push_tail(&ready, chunk);
+        return;
+    }
+
+    if (scheduled == 0) {
+        wheel_tick = now / NETEM_TICK_US;
+    }
+    if (tick <= wheel_tick) {
+        tick = wheel_tick + 1;
+    }
+    chunk->tick = tick;
+    g_queue_push_tail(&wheel[tick % NETEM_SLOTS], chunk);
+    scheduled++;
+}
+
+// writes whatever is due and the budget allows, returns how long until there
+// may be more to write
+int
+netem_flush(int sock)
+{
+    if (!netem_active()) {
+        return NETEM_IDLE_MS;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    _advance(now);
+
+    while (!g_queue_is_empty(&ready)) {
+        if (now < next_write) {
+            return MIN(NETEM_IDLE_MS, (next_write - now + 999) / 1000);
+        }
+
+        NetemChunk *chunk = g_queue_peek_head(&ready);
+        size_t len = chunk->len - chunk->off;
+        int fragment = g_atomic_int_get(&fragment_bytes);
+        if (fragment > 0 && len > (size_t)fragment) {
+            len = fragment;
+        }
+
+        int rate = g_atomic_int_get(&out_rate);
+        if (rate > 0) {
+            _refill(&out_bucket, rate, now);
+            if (out_bucket.tokens < 1) {
+                return MIN(NETEM_IDLE_MS, _bucket_wait_ms(&out_bucket, rate));
+            }
+            if (len > (size_t)out_bucket.tokens) {
+                len = out_bucket.tokens;
+            }
+        }
+
+        ssize_t sent = write(sock, chunk->data + chunk->off, len);
+
+        // error
+        if (sent == -1) {
+            // write timeout, try again on the next pass
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                return 1;
+
+            // real error, the rest of the chunk is lost
+            } else {
+                log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+                queued -= chunk->len - chunk->off;
+                _chunk_free(g_queue_pop_head(&ready));
+                continue;
+            }
+        }
+
+        if (rate > 0) {
+            out_bucket.tokens -= sent;
+        }
+        chunk->off += sent;
+        queued -= sent;
+        if (chunk->off == chunk->len) {
+            _chunk_free(g_queue_pop_head(&ready));
+        }
+
+        int gap = g_atomic_int_get(&fragment_gap_ms);
+        if (fragment > 0 && gap > 0) {
+            next_write = now + gap * 1000;
+        }
+    }
+
+    return _next_tick_ms();
+}
+
+// delayed output still goes out after the stream ends, if the client reads it
+void
+netem_drain(int sock)
+{
+    gint64 deadline = g_get_monotonic_time() + NETEM_DRAIN_MS * 1000;
+    while ((scheduled > 0 || !g_queue_is_empty(&ready)) && g_get_monotonic_time() < deadline) {
+        int wait = netem_flush(sock);
+        if (wait > 0) {
+            poll(NULL, 0, wait);
+        }
+    }
+}
+
+// how long until the next byte may be read
+int
+netem_read_wait(void)
+{
+    int rate = g_atomic_int_get(&in_rate);
+    if (rate <= 0) {
+        return 0;
+    }
+
+    _refill(&in_bucket, rate, g_get_monotonic_time());
+    if (in_bucket.tokens >= 1) {
+        return 0;
+    }
+
+    return _bucket_wait_ms(&in_bucket, rate);
+}
+
+void
+netem_read_done(size_t len)
+{
+    if (g_atomic_int_get(&in_rate) > 0) {
+        in_bucket.tokens -= len;
+    }
+}
+
+void
+netem_reset(void)
+{
+    int i;
+    for (i = 0; i < NETEM_SLOTS; i++) {
+        while (!g_queue_is_empty(&wheel[i])) {
+            _chunk_free(g_queue_pop_head(&wheel[i]));
+        }
+    }
+    while (!g_queue_is_empty(&ready)) {
+        _chunk_free(g_queue_pop_head(&ready));
+    }
+    scheduled = 0;
+    queued = 0;
+    wheel_tick = 0;
+    last_tick = 0;
+    next_write = 0;
+    out_bucket.tokens = 0;
+    out_bucket.last = 0;
+    in_bucket.tokens = 0;
+    in_bucket.last = 0;
+}
+
+// the normal distribution is approximated by the sum of twelve uniform
+// samples, jitter is its standard deviation
+static gint64
+_delay_us(void)
+{
+    double delay = g_atomic_int_get(&delay_ms);
+    double jitter = g_atomic_int_get(&jitter_ms);
+    if (jitter > 0 && g_atomic_int_get(&jitter_normal)) {
+        double sum = 0;
+        int i;
+        for (i = 0; i < 12; i++) {
+            sum += g_random_double();
+        }
+        delay += jitter * (sum - 6);
+    } else if (jitter > 0) {
+        delay += g_random_double_range(-jitter, jitter);
+    }
+
+    return delay > 0 ? delay * 1000 : 0;
+}
+
+// visits every tick in order, so chunks become ready in the order they were
+// sent, a slot's head always has its lowest tick
+static void
+_advance(gint64 now)
+{
+    gint64 now_tick = now / NETEM_TICK_US;
+    while (scheduled > 0 && wheel_tick < now_tick) {
+        wheel_tick++;
+        GQueue *slot = &wheel[wheel_tick % NETEM_SLOTS];
+        while (!g_queue_is_empty(slot) && ((NetemChunk *)g_queue_peek_head(slot))->tick <= wheel_tick) {
+            g_queue_push_tail(&ready, g_queue_pop_head(slot));
+            scheduled--;
+        }
+    }
+    if (scheduled == 0) {
+        wheel_tick = now_tick;
+    }
+}
+
+// only looks as far ahead as the I/O thread would sleep anyway
+static int
+_next_tick_ms(void)
+{
+    if (scheduled == 0) {
+        return NETEM_IDLE_MS;
+    }
+
+    int i;
+    for (i = 1; i < NETEM_IDLE_MS; i++) {
+        GQueue *slot = &wheel[(wheel_tick + i) % NETEM_SLOTS];
+        if (!g_queue_is_empty(slot) && ((NetemChunk *)g_queue_peek_head(slot))->tick == wheel_tick + i) {
+            return i;
+        }
+    }
+
+    return NETEM_IDLE_MS;
+}
+
+// a bucket holds at most 50ms worth of bytes, so a quiet spell is not
+// followed by a burst
+static void
+_refill(NetemBucket *bucket, int rate, gint64 now)
+{
+    double burst = MAX(rate / 20.0, 1);
+    if (bucket->last == 0) {
+        bucket->tokens = burst;
+    } else {
+        bucket->tokens = MIN(burst, bucket->tokens + (now - bucket->last) * rate / 1000000.0);
+    }
+    bucket->last = now;
+}
+
+static int
+_bucket_wait_ms(NetemBucket *bucket, int rate)
+{
+    return MAX(1, (int)((1 - bucket->tokens) * 1000 / rate) + 1);
+}
+
+static void
+_chunk_free(NetemChunk *chunk)
+{
+    free(chunk->data);
+    free(chunk);
+}
@@ -0,0 +1,45 @@
+/*
+ * netem.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_NETEM
+#define __H_NETEM
+
+#include <stddef.h>
+
+#include "stabber.h"
+
+// longest the I/O thread waits before checking the send queue again
+#define NETEM_IDLE_MS 5
+
+void netem_set(stbbr_netem_t *conditions);
+
+// the rest are only called from the I/O thread
+int netem_active(void);
+size_t netem_queued(void);
+void netem_send(const char *data, size_t len);
+int netem_flush(int sock);
+void netem_drain(int sock);
+int netem_read_wait(void);
+void netem_read_done(size_t len);
+void netem_reset(void);
+
+#endif
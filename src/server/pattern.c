@@ -0,0 +1,243 @@
+/*
+ * pattern.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include <glib.h>
+
+#include "server/pattern.h"
+
+// fnmatch patterns are indexed by their literal prefix, the characters before
+// the first wildcard, so only patterns on the path of the text are tried
+
+#define PATTERN_SPECIAL "*?[\\"
+
+typedef struct pattern_entry_t {
+    char *pattern;
+    gboolean prefix_only;
+    gpointer value;
+} PatternEntry;
+
+typedef struct trie_node_t {
+    char *keys;
+    struct trie_node_t **children;
+    int count;
+    GPtrArray *entries;
+} TrieNode;
+
+struct pattern_trie_t {
+    gint refs;
+    TrieNode *root;
+};
+
+static TrieNode* _node_new(void);
+static void _node_free(TrieNode *node);
+static TrieNode* _node_child(TrieNode *node, char key, gboolean create);
+static void _node_sort(TrieNode *node);
+static gpointer _node_match(TrieNode *node, const char *text, const char *rest);
+static void _entry_free(PatternEntry *entry);
+
+gboolean
+pattern_is_glob(const char *text)
+{
+    return strpbrk(text, "*?[") != NULL;
+}
+
+PatternTrie*
+pattern_trie_new(GHashTable *patterns)
+{
+    PatternTrie *trie = malloc(sizeof(PatternTrie));
+    trie->refs = 1;
+    trie->root = _node_new();
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, patterns);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *pattern = key;
+        size_t prefix_len = strcspn(pattern, PATTERN_SPECIAL);
+
+        TrieNode *node = trie->root;
+        size_t i;
+        for (i = 0; i < prefix_len; i++) {
+            node = _node_child(node, pattern[i], TRUE);
+        }
+
+        PatternEntry *entry = malloc(sizeof(PatternEntry));
+        entry->pattern = strdup(pattern);
+        entry->prefix_only = pattern[prefix_len] == '*' && pattern[prefix_len + 1] == '\0';
+        entry->value = value;
+        if (!node->entries) {
+            node->entries = g_ptr_array_new_with_free_func((GDestroyNotify)_entry_free);
+        }
+        g_ptr_array_add(node->entries, entry);
+    }
+
+    _node_sort(trie->root);
+
+    return trie;
+}
+
+PatternTrie*
+pattern_trie_ref(PatternTrie *trie)
+{
+    if (trie) {
+        g_atomic_int_inc(&trie->refs);
+    }
+
+    return trie;
+}
+
+void
+pattern_trie_unref(PatternTrie *trie)
+{
+    if (trie && g_atomic_int_dec_and_test(&trie->refs)) {
+        _node_free(trie->root);
+        free(trie);
+    }
+}
+
+// the pattern with the longest literal prefix wins, then the longest pattern
+gpointer
+pattern_trie_match(PatternTrie *trie, const char *text)
+{
+    if (!trie) {
+        return NULL;
+    }
+
+    return _node_match(trie->root, text, text);
+}
+
+static TrieNode*
+_node_new(void)
+{
+    TrieNode *node = malloc(sizeof(TrieNode));
+    node->keys = NULL;
+    node->children = NULL;
+    node->count = 0;
+    node->entries = NULL;
+
+    return node;
+}
+
+static void
+_node_free(TrieNode *node)
+{
+    int i;
+    for (i = 0; i < node->count; i++) {
+        _node_free(node->children[i]);
+    }
+    free(node->keys);
+    free(node->children);
+    if (node->entries) {
+        g_ptr_array_free(node->entries, TRUE);
+    }
+    free(node);
+}
+
+static TrieNode*
+_node_child(TrieNode *node, char key, gboolean create)
+{
+    int i;
+    for (i = 0; i < node->count; i++) {
+        if (node->keys[i] == key) {
+            return node->children[i];
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    node->keys = realloc(node->keys, node->count + 1);
+    node->children = realloc(node->children, (node->count + 1) * sizeof(TrieNode *));
+    node->keys[node->count] = key;
+    node->children[node->count] = _node_new();
+
+    return node->children[node->count++];
+}
+
+static gint
+_cmp_entries(gconstpointer a, gconstpointer b)
+{
+    const PatternEntry *entry_a = *(PatternEntry * const *)a;
+    const PatternEntry *entry_b = *(PatternEntry * const *)b;
+
+    size_t len_a = strlen(entry_a->pattern);
+    size_t len_b = strlen(entry_b->pattern);
+    if (len_a != len_b) {
+        return len_a > len_b ? -1 : 1;
+    }
+
+    return strcmp(entry_a->pattern, entry_b->pattern);
+}
+
+static void
+_node_sort(TrieNode *node)
+{
+    if (node->entries) {
+        g_ptr_array_sort(node->entries, _cmp_entries);
+    }
+
+    int i;
+    for (i = 0; i < node->count; i++) {
+        _node_sort(node->children[i]);
+    }
+}
+
+static gpointer
+_node_match(TrieNode *node, const char *text, const char *rest)
+{
+    // deeper nodes have longer literal prefixes, try them first
+    if (*rest) {
+        TrieNode *child = _node_child(node, *rest, FALSE);
+        if (child) {
+            gpointer value = _node_match(child, text, rest + 1);
+            if (value) {
+                return value;
+            }
+        }
+    }
+
+    if (!node->entries) {
+        return NULL;
+    }
+
+    guint i;
+    for (i = 0; i < node->entries->len; i++) {
+        PatternEntry *entry = g_ptr_array_index(node->entries, i);
+        if (entry->prefix_only || fnmatch(entry->pattern, text, 0) == 0) {
+            return entry->value;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+_entry_free(PatternEntry *entry)
+{
+    free(entry->pattern);
+    free(entry);
+}
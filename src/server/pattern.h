@@ -0,0 +1,37 @@
+/*
+ * pattern.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_PATTERN
+#define __H_PATTERN
+
+#include <glib.h>
+
+typedef struct pattern_trie_t PatternTrie;
+
+gboolean pattern_is_glob(const char *text);
+
+PatternTrie* pattern_trie_new(GHashTable *patterns);
+PatternTrie* pattern_trie_ref(PatternTrie *trie);
+void pattern_trie_unref(PatternTrie *trie);
+gpointer pattern_trie_match(PatternTrie *trie, const char *text);
+
+#endif
@@ -21,89 +21,703 @@
  */
 
 #include <stdlib.h>
+#include <sched.h>
 #include <glib.h>
 
 #include <string.h>
 
+#include "server/prime.h"
 #include "server/stanza.h"
 #include "server/stanzas.h"
 #include "server/log.h"
+#include "server/lockstats.h"
+#include "server/pattern.h"
+#include "server/rule.h"
 
-static char *required_passwd = NULL;
-static GHashTable *idstubs = NULL;
-static GHashTable *querystubs = NULL;
+#define PRIME_ID_MARK "\x01"
+
+// stubs are published as immutable snapshots, a writer copies the current
+// snapshot, changes the copy and swaps it in, lookups take no lock, the
+// tables are shared by reference and only the ones a writer changes are copied
+typedef struct prime_snapshot_t {
+    char *passwd;
+    GHashTable *idstubs;
+    GHashTable *querystubs;
+    GHashTable *patternstubs;
+    PatternTrie *patterns;
+    GHashTable *rulestubs;
+    RuleIndex *rules;
+} PrimeSnapshot;
+
+// serialises stubs primed concurrently from the C API and HTTP threads
+StbbrMutex prime_lock = STBBR_MUTEX_INIT("prime_lock");
+
+static PrimeSnapshot *current = NULL;
+
+// readers count themselves against the epoch they entered in, a writer flips
+// the epoch after publishing and waits for the old one to drain
+static gint epoch = 0;
+static gint readers[2] = { 0, 0 };
+
+static PrimeSnapshot* _snapshot_new(const char *passwd);
+static PrimeSnapshot* _snapshot_copy(PrimeSnapshot *snapshot);
+static void _own(GHashTable **table);
+static void _own_for(PrimeSnapshot *snapshot, StubDef *stub);
+static void _snapshot_free(PrimeSnapshot *snapshot);
+static void _publish(PrimeSnapshot *snapshot);
+static int _reader_enter(PrimeSnapshot **snapshot);
+static void _reader_exit(int reader_epoch);
+static PrimeReply* _reply_new(const char *stream, gboolean with_id, GBytes *source);
+static PrimeReply* _reply_copy(PrimeReply *reply);
+static void _reply_free(PrimeReply *reply);
+static PrimeStub* _stub_new(PrimeReply *reply);
+static PrimeStub* _stub_append(PrimeStub *stub, PrimeReply *reply);
+static int _prime_id(const char *id, char *stream, gboolean append);
+static int _prime_query(const char *query, char *stream, gboolean append);
+static PrimeStub* _lookup(const char *key, gboolean query);
+static void _insert_id(PrimeSnapshot *snapshot, const char *id, PrimeStub *stub);
+static void _insert_rule(PrimeSnapshot *snapshot, char *rule, PrimeStub *stub);
+static void _compile(PrimeSnapshot *snapshot);
+static char* _rule_key(const char *rule);
+static GList* _rule_keys(GList *stubs);
 
 void
 prime_init(void)
 {
-    required_passwd = strdup("password");
-    idstubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
-    querystubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)stanza_free);
+    lockstats_lock(&prime_lock);
+    _publish(_snapshot_new("password"));
+    lockstats_unlock(&prime_lock);
 }
 
 void
 prime_free_all(void)
 {
-    free(required_passwd);
-    required_passwd = NULL;
+    lockstats_lock(&prime_lock);
+    _publish(NULL);
+    lockstats_unlock(&prime_lock);
+}
+
+void
+prime_required_passwd(char *password)
+{
+    log_println(STBBR_LOGDEBUG, "Received auth password: %s", password);
 
-    if (idstubs) {
-        g_hash_table_destroy(idstubs);
+    lockstats_lock(&prime_lock);
+    if (current) {
+        PrimeSnapshot *snapshot = _snapshot_copy(current);
+        free(snapshot->passwd);
+        snapshot->passwd = strdup(password);
+        _publish(snapshot);
     }
-    idstubs = NULL;
+    lockstats_unlock(&prime_lock);
+}
+
+int
+prime_check_passwd(const char *password)
+{
+    PrimeSnapshot *snapshot;
+    int reader_epoch = _reader_enter(&snapshot);
+    int result = snapshot && g_strcmp0(snapshot->passwd, password) == 0;
+    _reader_exit(reader_epoch);
+
+    return result;
+}
+
+int
+prime_for_id(const char *id, char *stream)
+{
+    return _prime_id(id, stream, FALSE);
+}
+
+int
+prime_for_id_next(const char *id, char *stream)
+{
+    return _prime_id(id, stream, TRUE);
+}
 
-    if (querystubs) {
-        g_hash_table_destroy(querystubs);
+PrimeStub*
+prime_get_for_id(const char *id)
+{
+    return _lookup(id, FALSE);
+}
+
+int
+prime_for_query(const char *query, char *stream)
+{
+    return _prime_query(query, stream, FALSE);
+}
+
+int
+prime_for_query_next(const char *query, char *stream)
+{
+    return _prime_query(query, stream, TRUE);
+}
+
+PrimeStub*
+prime_get_for_query(const char *query)
+{
+    return _lookup(query, TRUE);
+}
+
+int
+prime_for_rule(const char *rule, char *stream)
+{
+    log_println(STBBR_LOGDEBUG, "Received stub for rule: %s, stanza: %s", rule, stream);
+    char *key = _rule_key(rule);
+    if (!key) {
+        log_println(STBBR_LOGWARN, "Invalid rule: %s", rule);
+        return 0;
     }
-    querystubs = NULL;
+    PrimeStub *stub = _stub_new(_reply_new(stream, TRUE, NULL));
+
+    lockstats_lock(&prime_lock);
+    if (current) {
+        PrimeSnapshot *snapshot = _snapshot_copy(current);
+        _own(&snapshot->rulestubs);
+        _insert_rule(snapshot, key, stub);
+        _compile(snapshot);
+        _publish(snapshot);
+    } else {
+        free(key);
+        prime_stub_unref(stub);
+    }
+    lockstats_unlock(&prime_lock);
+
+    return 1;
+}
+
+PrimeStub*
+prime_get_for_rule(XMPPStanza *stanza)
+{
+    PrimeSnapshot *snapshot;
+    int reader_epoch = _reader_enter(&snapshot);
+
+    PrimeStub *stub = snapshot ? rule_index_match(snapshot->rules, stanza) : NULL;
+    if (stub) {
+        g_atomic_int_inc(&stub->refs);
+    }
+    _reader_exit(reader_epoch);
+
+    return stub;
+}
+
+int
+prime_rule_valid(const char *rule)
+{
+    char *key = _rule_key(rule);
+    if (!key) {
+        return 0;
+    }
+    free(key);
+
+    return 1;
 }
 
 void
-prime_required_passwd(char *password)
+prime_for_all(GList *stubs)
 {
-    log_println(STBBR_LOGDEBUG, "Received auth password: %s", password);
+    prime_update(NULL, stubs);
+}
 
-    free(required_passwd);
-    required_passwd = strdup(password);
+// removed stubs only need their keys, they go before the new ones are added
+void
+prime_update(GList *removed, GList *stubs)
+{
+    // stanzas and rules are parsed before taking the lock
+    GList *prepared = NULL;
+    GList *rule_keys = NULL;
+    GList *curr = stubs;
+    while (curr) {
+        StubDef *stub = curr->data;
+        if (stub->query) {
+            log_println(STBBR_LOGDEBUG, "Received stub for query: %s, stanza: %s", stub->query, stub->stream);
+            prepared = g_list_append(prepared, _reply_new(stub->stream, TRUE, NULL));
+        } else if (stub->rule) {
+            log_println(STBBR_LOGDEBUG, "Received stub for rule: %s, stanza: %s", stub->rule, stub->stream);
+            prepared = g_list_append(prepared, _reply_new(stub->stream, TRUE, NULL));
+        } else {
+            log_println(STBBR_LOGDEBUG, "Received stub for id: %s, stanza: %s", stub->id, stub->stream);
+            prepared = g_list_append(prepared, _reply_new(stub->stream, FALSE, stub->source));
+        }
+        curr = g_list_next(curr);
+    }
+    GList *removed_keys = _rule_keys(removed);
+    rule_keys = _rule_keys(stubs);
+
+    // one snapshot for the whole set, the client sees all of it or none
+    lockstats_lock(&prime_lock);
+    PrimeSnapshot *snapshot = current ? _snapshot_copy(current) : NULL;
+
+    GList *curr_key = removed_keys;
+    curr = removed;
+    while (snapshot && curr) {
+        StubDef *stub = curr->data;
+        _own_for(snapshot, stub);
+        if (stub->query) {
+            g_hash_table_remove(snapshot->querystubs, stub->query);
+        } else if (stub->rule) {
+            if (curr_key->data && g_hash_table_remove(snapshot->rulestubs, curr_key->data)) {
+                rule_index_unref(snapshot->rules);
+                snapshot->rules = NULL;
+            }
+            curr_key = g_list_next(curr_key);
+        } else if (pattern_is_glob(stub->id)) {
+            if (g_hash_table_remove(snapshot->patternstubs, stub->id)) {
+                pattern_trie_unref(snapshot->patterns);
+                snapshot->patterns = NULL;
+            }
+        } else {
+            g_hash_table_remove(snapshot->idstubs, stub->id);
+        }
+        curr = g_list_next(curr);
+    }
+
+    GList *curr_prepared = prepared;
+    curr_key = rule_keys;
+    curr = stubs;
+    while (curr) {
+        StubDef *stub = curr->data;
+        PrimeReply *reply = curr_prepared->data;
+        if (snapshot) {
+            _own_for(snapshot, stub);
+        }
+        if (!snapshot) {
+            _reply_free(reply);
+        } else if (stub->query) {
+            PrimeStub *existing = stub->next ? g_hash_table_lookup(snapshot->querystubs, stub->query) : NULL;
+            PrimeStub *prepared_stub = existing ? _stub_append(existing, reply) : _stub_new(reply);
+            g_hash_table_insert(snapshot->querystubs, strdup(stub->query), prepared_stub);
+        } else if (stub->rule && curr_key->data) {
+            PrimeStub *existing = stub->next ? g_hash_table_lookup(snapshot->rulestubs, curr_key->data) : NULL;
+            _insert_rule(snapshot, curr_key->data, existing ? _stub_append(existing, reply) : _stub_new(reply));
+            curr_key->data = NULL;
+        } else if (stub->rule) {
+            _reply_free(reply);
+        } else {
+            GHashTable *ids = pattern_is_glob(stub->id) ? snapshot->patternstubs : snapshot->idstubs;
+            PrimeStub *existing = stub->next ? g_hash_table_lookup(ids, stub->id) : NULL;
+            _insert_id(snapshot, stub->id, existing ? _stub_append(existing, reply) : _stub_new(reply));
+        }
+        if (stub->rule) {
+            curr_key = g_list_next(curr_key);
+        }
+        curr_prepared = g_list_next(curr_prepared);
+        curr = g_list_next(curr);
+    }
+    if (snapshot) {
+        _compile(snapshot);
+        _publish(snapshot);
+    }
+    lockstats_unlock(&prime_lock);
+
+    g_list_free(prepared);
+    g_list_free_full(removed_keys, free);
+    g_list_free_full(rule_keys, free);
 }
 
-char*
-prime_get_passwd(void)
+// each call takes the next reply, the last one repeats
+PrimeReply*
+prime_stub_next(PrimeStub *stub)
 {
-    return required_passwd;
+    guint last = stub->replies->len - 1;
+    guint call = g_atomic_int_get(&stub->calls);
+    if (call < last) {
+        call = g_atomic_int_add(&stub->calls, 1);
+    }
+    if (call > last) {
+        call = last;
+    }
+
+    return g_ptr_array_index(stub->replies, call);
 }
 
 void
-prime_for_id(const char *id, char *stream)
+prime_stub_unref(PrimeStub *stub)
 {
-    if (!idstubs) {
+    if (!stub) {
         return;
     }
 
+    if (g_atomic_int_dec_and_test(&stub->refs)) {
+        g_ptr_array_free(stub->replies, TRUE);
+        free(stub);
+    }
+}
+
+static int
+_prime_id(const char *id, char *stream, gboolean append)
+{
     log_println(STBBR_LOGDEBUG, "Received stub for id: %s, stanza: %s", id, stream);
-    g_hash_table_insert(idstubs, strdup(id), strdup(stream));
+    PrimeReply *reply = _reply_new(stream, FALSE, NULL);
+
+    lockstats_lock(&prime_lock);
+    if (current) {
+        PrimeSnapshot *snapshot = _snapshot_copy(current);
+        _own(pattern_is_glob(id) ? &snapshot->patternstubs : &snapshot->idstubs);
+        GHashTable *stubs = pattern_is_glob(id) ? snapshot->patternstubs : snapshot->idstubs;
+        PrimeStub *existing = append ? g_hash_table_lookup(stubs, id) : NULL;
+        _insert_id(snapshot, id, existing ? _stub_append(existing, reply) : _stub_new(reply));
+        _compile(snapshot);
+        _publish(snapshot);
+    } else {
+        _reply_free(reply);
+    }
+    lockstats_unlock(&prime_lock);
+
+    return 1;
 }
 
-char*
-prime_get_for_id(const char *id)
+static int
+_prime_query(const char *query, char *stream, gboolean append)
 {
-    return g_hash_table_lookup(idstubs, id);
+    log_println(STBBR_LOGDEBUG, "Received stub for query: %s, stanza: %s", query, stream);
+    PrimeReply *reply = _reply_new(stream, TRUE, NULL);
+
+    lockstats_lock(&prime_lock);
+    if (current) {
+        PrimeSnapshot *snapshot = _snapshot_copy(current);
+        _own(&snapshot->querystubs);
+        PrimeStub *existing = append ? g_hash_table_lookup(snapshot->querystubs, query) : NULL;
+        PrimeStub *stub = existing ? _stub_append(existing, reply) : _stub_new(reply);
+        g_hash_table_insert(snapshot->querystubs, strdup(query), stub);
+        _publish(snapshot);
+    } else {
+        _reply_free(reply);
+    }
+    lockstats_unlock(&prime_lock);
+
+    return 1;
 }
 
-void
-prime_for_query(const char *query, char *stream)
+// with_id splits the reply around the id of its first stanza so a hit only
+// joins three strings, id stubs are sent exactly as primed, straight from the
+// file contents when there are some
+static PrimeReply*
+_reply_new(const char *stream, gboolean with_id, GBytes *source)
 {
-    if (!querystubs) {
+    PrimeReply *reply = malloc(sizeof(PrimeReply));
+    reply->prefix = NULL;
+    reply->suffix = NULL;
+    reply->source = NULL;
+
+    if (!with_id && source) {
+        reply->text = (char *)stream;
+        reply->source = g_bytes_ref(source);
+        return reply;
+    }
+
+    if (!with_id) {
+        reply->text = g_strdup(stream);
+        return reply;
+    }
+
+    GList *stanzas = stanza_parse_all(stream);
+    GString *text = g_string_new("");
+    GString *rest = g_string_new("");
+    GList *curr = stanzas;
+    while (curr) {
+        char *stanza_str = stanza_to_string(curr->data);
+        g_string_append(text, stanza_str);
+        if (curr != stanzas) {
+            g_string_append(rest, stanza_str);
+        }
+        free(stanza_str);
+        curr = g_list_next(curr);
+    }
+
+    // the mark is not valid XML, so cannot appear anywhere else in the stanza
+    if (stanzas) {
+        char *first = stanza_to_string_with_id(stanzas->data, PRIME_ID_MARK);
+        char *mark = strstr(first, PRIME_ID_MARK);
+        reply->prefix = g_strndup(first, mark - first);
+        reply->suffix = g_strconcat(mark + strlen(PRIME_ID_MARK), rest->str, NULL);
+        free(first);
+    }
+
+    reply->text = g_string_free(text, FALSE);
+    g_string_free(rest, TRUE);
+    g_list_free_full(stanzas, (GDestroyNotify)stanza_free);
+
+    return reply;
+}
+
+static PrimeReply*
+_reply_copy(PrimeReply *reply)
+{
+    PrimeReply *copy = malloc(sizeof(PrimeReply));
+    if (reply->source) {
+        copy->text = reply->text;
+        copy->source = g_bytes_ref(reply->source);
+    } else {
+        copy->text = g_strdup(reply->text);
+        copy->source = NULL;
+    }
+    copy->prefix = g_strdup(reply->prefix);
+    copy->suffix = g_strdup(reply->suffix);
+
+    return copy;
+}
+
+static void
+_reply_free(PrimeReply *reply)
+{
+    if (reply->source) {
+        g_bytes_unref(reply->source);
+    } else {
+        g_free(reply->text);
+    }
+    g_free(reply->prefix);
+    g_free(reply->suffix);
+    free(reply);
+}
+
+static PrimeStub*
+_stub_new(PrimeReply *reply)
+{
+    PrimeStub *stub = malloc(sizeof(PrimeStub));
+    stub->refs = 1;
+    stub->calls = 0;
+    stub->replies = g_ptr_array_new_with_free_func((GDestroyNotify)_reply_free);
+    g_ptr_array_add(stub->replies, reply);
+
+    return stub;
+}
+
+// published stubs never change, the copy starts its sequence again
+static PrimeStub*
+_stub_append(PrimeStub *stub, PrimeReply *reply)
+{
+    PrimeStub *copy = malloc(sizeof(PrimeStub));
+    copy->refs = 1;
+    copy->calls = 0;
+    copy->replies = g_ptr_array_new_with_free_func((GDestroyNotify)_reply_free);
+
+    guint i;
+    for (i = 0; i < stub->replies->len; i++) {
+        g_ptr_array_add(copy->replies, _reply_copy(g_ptr_array_index(stub->replies, i)));
+    }
+    g_ptr_array_add(copy->replies, reply);
+
+    return copy;
+}
+
+static PrimeStub*
+_lookup(const char *key, gboolean query)
+{
+    PrimeSnapshot *snapshot;
+    int reader_epoch = _reader_enter(&snapshot);
+
+    PrimeStub *stub = NULL;
+    if (snapshot) {
+        stub = g_hash_table_lookup(query ? snapshot->querystubs : snapshot->idstubs, key);
+
+        // an exact id always wins over a pattern
+        if (!stub && !query) {
+            stub = pattern_trie_match(snapshot->patterns, key);
+        }
+    }
+    if (stub) {
+        g_atomic_int_inc(&stub->refs);
+    }
+    _reader_exit(reader_epoch);
+
+    return stub;
+}
+
+static PrimeSnapshot*
+_snapshot_new(const char *passwd)
+{
+    PrimeSnapshot *snapshot = malloc(sizeof(PrimeSnapshot));
+    snapshot->passwd = strdup(passwd);
+    snapshot->idstubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)prime_stub_unref);
+    snapshot->querystubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)prime_stub_unref);
+    snapshot->patternstubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)prime_stub_unref);
+    snapshot->patterns = NULL;
+    snapshot->rulestubs = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)prime_stub_unref);
+    snapshot->rules = NULL;
+
+    return snapshot;
+}
+
+// patterns are kept apart from exact ids, the trie is rebuilt when they change
+static void
+_insert_id(PrimeSnapshot *snapshot, const char *id, PrimeStub *stub)
+{
+    if (pattern_is_glob(id)) {
+        g_hash_table_insert(snapshot->patternstubs, strdup(id), stub);
+        pattern_trie_unref(snapshot->patterns);
+        snapshot->patterns = NULL;
+    } else {
+        g_hash_table_insert(snapshot->idstubs, strdup(id), stub);
+    }
+}
+
+// takes the key
+static void
+_insert_rule(PrimeSnapshot *snapshot, char *rule, PrimeStub *stub)
+{
+    g_hash_table_insert(snapshot->rulestubs, rule, stub);
+    rule_index_unref(snapshot->rules);
+    snapshot->rules = NULL;
+}
+
+static void
+_compile(PrimeSnapshot *snapshot)
+{
+    if (!snapshot->patterns && g_hash_table_size(snapshot->patternstubs) > 0) {
+        snapshot->patterns = pattern_trie_new(snapshot->patternstubs);
+    }
+    if (!snapshot->rules && g_hash_table_size(snapshot->rulestubs) > 0) {
+        snapshot->rules = rule_index_new(snapshot->rulestubs);
+    }
+}
+
+// rules are keyed by their serialised form, so layout does not matter
+static char*
+_rule_key(const char *rule)
+{
+    char *text = strdup(rule);
+    XMPPStanza *stanza = stanza_parse(text);
+    free(text);
+    if (!stanza) {
+        return NULL;
+    }
+
+    char *key = stanza_to_string(stanza);
+    stanza_free(stanza);
+
+    return key;
+}
+
+// one key per rule stub, NULL where the rule is invalid
+static GList*
+_rule_keys(GList *stubs)
+{
+    GList *keys = NULL;
+    GList *curr = stubs;
+    while (curr) {
+        StubDef *stub = curr->data;
+        if (stub->rule) {
+            char *key = _rule_key(stub->rule);
+            if (!key) {
+                log_println(STBBR_LOGWARN, "Invalid rule: %s", stub->rule);
+            }
+            keys = g_list_append(keys, key);
+        }
+        curr = g_list_next(curr);
+    }
+
+    return keys;
+}
+
+// the copy shares every table with the original, a writer calls _own on
+// each table before changing it
+static PrimeSnapshot*
+_snapshot_copy(PrimeSnapshot *snapshot)
+{
+    PrimeSnapshot *copy = malloc(sizeof(PrimeSnapshot));
+    copy->passwd = strdup(snapshot->passwd);
+    copy->idstubs = g_hash_table_ref(snapshot->idstubs);
+    copy->querystubs = g_hash_table_ref(snapshot->querystubs);
+    copy->patternstubs = g_hash_table_ref(snapshot->patternstubs);
+    copy->patterns = pattern_trie_ref(snapshot->patterns);
+    copy->rulestubs = g_hash_table_ref(snapshot->rulestubs);
+    copy->rules = rule_index_ref(snapshot->rules);
+
+    return copy;
+}
+
+// replaces a shared table with a copy of its own, the copy shares every stub
+static void
+_own(GHashTable **table)
+{
+    GHashTable *copy = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)prime_stub_unref);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, *table);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_atomic_int_inc(&((PrimeStub *)value)->refs);
+        g_hash_table_insert(copy, strdup(key), value);
+    }
+
+    g_hash_table_unref(*table);
+    *table = copy;
+}
+
+// must be called holding prime_lock, copies the table the stub goes in
+// unless this snapshot already has its own
+static void
+_own_for(PrimeSnapshot *snapshot, StubDef *stub)
+{
+    if (stub->query) {
+        if (snapshot->querystubs == current->querystubs) {
+            _own(&snapshot->querystubs);
+        }
+    } else if (stub->rule) {
+        if (snapshot->rulestubs == current->rulestubs) {
+            _own(&snapshot->rulestubs);
+        }
+    } else if (pattern_is_glob(stub->id)) {
+        if (snapshot->patternstubs == current->patternstubs) {
+            _own(&snapshot->patternstubs);
+        }
+    } else if (snapshot->idstubs == current->idstubs) {
+        _own(&snapshot->idstubs);
+    }
+}
+
+static void
+_snapshot_free(PrimeSnapshot *snapshot)
+{
+    if (!snapshot) {
         return;
     }
 
-    log_println(STBBR_LOGDEBUG, "Received stub for query: %s, stanza: %s", query, stream);
-    XMPPStanza *stanza = stanza_parse(stream);
-    g_hash_table_insert(querystubs, strdup(query), stanza);
+    free(snapshot->passwd);
+    g_hash_table_unref(snapshot->idstubs);
+    g_hash_table_unref(snapshot->querystubs);
+    pattern_trie_unref(snapshot->patterns);
+    g_hash_table_unref(snapshot->patternstubs);
+    rule_index_unref(snapshot->rules);
+    g_hash_table_unref(snapshot->rulestubs);
+    free(snapshot);
 }
 
-XMPPStanza*
-prime_get_for_query(const char *query)
+// must be called holding prime_lock
+static void
+_publish(PrimeSnapshot *snapshot)
+{
+    PrimeSnapshot *old = current;
+    g_atomic_pointer_set(&current, snapshot);
+
+    // readers in the new epoch can only see the new snapshot
+    int old_epoch = g_atomic_int_get(&epoch);
+    g_atomic_int_set(&epoch, 1 - old_epoch);
+    while (g_atomic_int_get(&readers[old_epoch]) > 0) {
+        sched_yield();
+    }
+
+    _snapshot_free(old);
+}
+
+static int
+_reader_enter(PrimeSnapshot **snapshot)
+{
+    while (TRUE) {
+        int reader_epoch = g_atomic_int_get(&epoch);
+        g_atomic_int_inc(&readers[reader_epoch]);
+        if (g_atomic_int_get(&epoch) == reader_epoch) {
+            *snapshot = g_atomic_pointer_get(&current);
+            return reader_epoch;
+        }
+
+        // a writer flipped the epoch in between
+        g_atomic_int_add(&readers[reader_epoch], -1);
+    }
+}
+
+static void
+_reader_exit(int reader_epoch)
 {
-    return g_hash_table_lookup(querystubs, query);
+    g_atomic_int_add(&readers[reader_epoch], -1);
 }
@@ -23,18 +23,57 @@
 #ifndef __H_PRIME
 #define __H_PRIME
 
+#include <glib.h>
+
 #include "server/stanza.h"
 
+typedef struct stub_def_t {
+    char *id;
+    char *query;
+    char *rule;
+    char *stream;
+    int next;
+    GBytes *source;
+} StubDef;
+
+// text is the whole reply, prefix and suffix surround the request's id when
+// the first stanza takes it, both are NULL for id stubs, text points into
+// source when the stub was loaded from a file
+typedef struct prime_reply_t {
+    char *text;
+    char *prefix;
+    char *suffix;
+    GBytes *source;
+} PrimeReply;
+
+// shared between snapshots, a reference is released with prime_stub_unref
+typedef struct prime_stub_t {
+    gint refs;
+    gint calls;
+    GPtrArray *replies;
+} PrimeStub;
+
 void prime_init(void);
 void prime_free_all(void);
 
 void prime_required_passwd(char *password);
-char* prime_get_passwd(void);
+int prime_check_passwd(const char *password);
 
 int prime_for_id(const char *id, char *stream);
-char* prime_get_for_id(const char *id);
+int prime_for_id_next(const char *id, char *stream);
+PrimeStub* prime_get_for_id(const char *id);
 
 int prime_for_query(const char *query, char *stream);
-XMPPStanza* prime_get_for_query(const char *query);
+int prime_for_query_next(const char *query, char *stream);
+PrimeStub* prime_get_for_query(const char *query);
+
+int prime_for_rule(const char *rule, char *stream);
+PrimeStub* prime_get_for_rule(XMPPStanza *stanza);
+int prime_rule_valid(const char *rule);
+
+void prime_for_all(GList *stubs);
+void prime_update(GList *removed, GList *stubs);
+PrimeReply* prime_stub_next(PrimeStub *stub);
+void prime_stub_unref(PrimeStub *stub);
 
 #endif
@@ -0,0 +1,193 @@
+/*
+ * roster.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/lockstats.h"
+#include "server/roster.h"
+
+typedef enum {
+    ROSTER_ITEMS,
+    ROSTER_PRESENCES,
+    ROSTER_DONE
+} roster_phase_t;
+
+// the same seed gives the same contacts in both passes, so the presences
+// match the items without keeping either
+struct roster_stream_t {
+    stbbr_roster_t roster;
+    char *id;
+    roster_phase_t phase;
+    int next;
+    GRand *rand;
+};
+
+typedef struct roster_contact_t {
+    const char *subscription;
+    int group;
+    gboolean online;
+} RosterContact;
+
+// guards the roster definition, a stream takes its own copy
+StbbrMutex roster_lock = STBBR_MUTEX_INIT("roster_lock");
+
+static stbbr_roster_t *current = NULL;
+
+static void _contact(RosterStream *stream, RosterContact *contact);
+
+void
+roster_set(stbbr_roster_t *roster)
+{
+    lockstats_lock(&roster_lock);
+    free(current);
+    current = NULL;
+    if (roster) {
+        current = malloc(sizeof(stbbr_roster_t));
+        memcpy(current, roster, sizeof(stbbr_roster_t));
+        log_println(STBBR_LOGINFO, "Received roster stub: %d contacts, %d groups, seed %u",
+            roster->count, roster->groups, roster->seed);
+    }
+    lockstats_unlock(&roster_lock);
+}
+
+// NULL when no roster is defined
+RosterStream*
+roster_stream_new(const char *id)
+{
+    lockstats_lock(&roster_lock);
+    if (!current) {
+        lockstats_unlock(&roster_lock);
+        return NULL;
+    }
+
+    RosterStream *stream = malloc(sizeof(RosterStream));
+    memcpy(&stream->roster, current, sizeof(stbbr_roster_t));
+    lockstats_unlock(&roster_lock);
+
+    // escaped once, the id was unescaped when it was read
+    stream->id = id ? g_markup_escape_text(id, -1) : NULL;
+    stream->phase = ROSTER_ITEMS;
+    stream->next = 0;
+    stream->rand = g_rand_new_with_seed(stream->roster.seed);
+
+    return stream;
+}
+
+// appends about a chunk of the document, FALSE once it is complete
+gboolean
+roster_stream_fill(RosterStream *stream, GString *chunk)
+{
+    RosterContact contact;
+
+    while (chunk->len < ROSTER_CHUNK && stream->phase != ROSTER_DONE) {
+        if (stream->phase == ROSTER_ITEMS && stream->next == 0) {
+            g_string_append(chunk, "<iq type=\"result\"");
+            if (stream->id) {
+                g_string_append_printf(chunk, " id=\"%s\"", stream->id);
+            }
+            g_string_append(chunk, "><query xmlns=\"jabber:iq:roster\">");
+        }
+
+        if (stream->next == stream->roster.count) {
+            if (stream->phase == ROSTER_ITEMS) {
+                g_string_append(chunk, "</query></iq>");
+                g_rand_free(stream->rand);
+                stream->rand = g_rand_new_with_seed(stream->roster.seed);
+                stream->phase = ROSTER_PRESENCES;
+            } else {
+                stream->phase = ROSTER_DONE;
+            }
+            stream->next = 0;
+            continue;
+        }
+
+        _contact(stream, &contact);
+        stream->next++;
+
+        if (stream->phase == ROSTER_ITEMS) {
+            g_string_append_printf(chunk,
+                "<item jid=\"contact%d@localhost\" name=\"Contact %d\" subscription=\"%s\"",
+                stream->next, stream->next, contact.subscription);
+            if (contact.group == -1) {
+                g_string_append(chunk, "/>");
+            } else {
+                g_string_append_printf(chunk, "><group>Group %d</group></item>", contact.group + 1);
+            }
+        } else if (contact.online) {
+            g_string_append_printf(chunk, "<presence from=\"contact%d@localhost/stabber\"/>", stream->next);
+        }
+    }
+
+    return stream->phase != ROSTER_DONE;
+}
+
+int
+roster_stream_count(RosterStream *stream)
+{
+    return stream->roster.count;
+}
+
+void
+roster_stream_free(RosterStream *stream)
+{
+    if (!stream) {
+        return;
+    }
+
+    g_free(stream->id);
+    g_rand_free(stream->rand);
+    free(stream);
+}
+
+// a contact takes the same random numbers in both passes, only contacts the
+// account is subscribed to send presence
+static void
+_contact(RosterStream *stream, RosterContact *contact)
+{
+    stbbr_roster_t *roster = &stream->roster;
+    int subscription = g_rand_int_range(stream->rand, 0, 100);
+    int group = g_rand_int_range(stream->rand, 0, 100);
+    int online = g_rand_int_range(stream->rand, 0, 100);
+
+    if (subscription < roster->both_percent) {
+        contact->subscription = "both";
+    } else if (subscription < roster->both_percent + roster->to_percent) {
+        contact->subscription = "to";
+    } else if (subscription < roster->both_percent + roster->to_percent + roster->from_percent) {
+        contact->subscription = "from";
+    } else {
+        contact->subscription = "none";
+    }
+
+    if (roster->groups <= 0 || group < roster->ungrouped_percent) {
+        contact->group = -1;
+    } else {
+        contact->group = g_rand_int_range(stream->rand, 0, roster->groups);
+    }
+
+    contact->online = online < roster->online_percent
+        && (g_strcmp0(contact->subscription, "both") == 0 || g_strcmp0(contact->subscription, "to") == 0);
+}
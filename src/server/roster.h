@@ -0,0 +1,41 @@
+/*
+ * roster.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_ROSTER
+#define __H_ROSTER
+
+#include <glib.h>
+
+#include "stabber.h"
+
+#define ROSTER_CHUNK 16384
+
+typedef struct roster_stream_t RosterStream;
+
+void roster_set(stbbr_roster_t *roster);
+
+RosterStream* roster_stream_new(const char *id);
+gboolean roster_stream_fill(RosterStream *stream, GString *chunk);
+int roster_stream_count(RosterStream *stream);
+void roster_stream_free(RosterStream *stream);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * rtt.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "stabber.h"
+#include "server/stanza.h"
+#include "server/log.h"
+#include "server/lockstats.h"
+
+#define RTT_NO_NS "none"
+
+// IQs the client never answers are dropped once there are too many waiting,
+// or when they have waited longer than a client could take to reply
+#define RTT_MAX_PENDING 4096
+#define RTT_PENDING_TTL (60 * G_USEC_PER_SEC)
+
+// percentiles are taken over the newest replies only, so a long run keeps a
+// fixed amount per namespace, count, mean, min and max cover every reply
+#define RTT_MAX_SAMPLES 1024
+
+typedef struct rtt_samples_t {
+    gint64 recent[RTT_MAX_SAMPLES];
+    int next;
+    int count;
+    gint64 total;
+    gint64 min;
+    gint64 max;
+} RttSamples;
+
+typedef struct pending_iq_t {
+    char *id;
+    char *ns;
+    gint64 sent;
+} PendingIQ;
+
+StbbrMutex rtt_lock = STBBR_MUTEX_INIT("rtt_lock");
+
+// ids map to their link in the queue, which is oldest first
+static GHashTable *pending = NULL;
+static GQueue pending_order = G_QUEUE_INIT;
+static long expired = 0;
+static GHashTable *samples = NULL;
+
+static const char* _scan_tag(const char *tag, const char **names, char **values, int count);
+static gboolean _iq_fields(const char *stream, char **id, char **type, char **ns);
+static void _pending_remove(GList *link);
+static void _pending_expire(gint64 now);
+static void _pending_free(PendingIQ *iq);
+static void _samples_add(RttSamples *arr, gint64 rtt);
+static void _ensure_tables(void);
+static int _compare_gint64(gconstpointer a, gconstpointer b);
+static void _fill_stats(RttSamples *arr, stbbr_rtt_t *stats);
+
+void
+rtt_sent(const char *stream)
+{
+    if (!g_str_has_prefix(stream, "<iq")) {
+        return;
+    }
+
+    char *id = NULL;
+    char *type = NULL;
+    char *ns = NULL;
+    if (!_iq_fields(stream, &id, &type, &ns)) {
+        // entities in the values need a full parse to compare with replies
+        XMPPStanza *stanza = stanza_parse((char*)stream);
+        if (!stanza) {
+            return;
+        }
+        id = g_strdup(stanza_get_id(stanza));
+        type = g_strdup(stanza_get_attr(stanza, "type"));
+        if (stanza->children) {
+            ns = g_strdup(stanza_get_attr(stanza->children->data, "xmlns"));
+        }
+        stanza_free(stanza);
+    }
+
+    if (!id || (g_strcmp0(type, "get") != 0 && g_strcmp0(type, "set") != 0)) {
+        g_free(id);
+        g_free(type);
+        g_free(ns);
+        return;
+    }
+
+    PendingIQ *iq = malloc(sizeof(PendingIQ));
+    iq->id = strdup(id);
+    iq->ns = strdup(ns ? ns : RTT_NO_NS);
+    iq->sent = g_get_monotonic_time();
+    g_free(id);
+    g_free(type);
+    g_free(ns);
+
+    lockstats_lock(&rtt_lock);
+    _ensure_tables();
+    GList *previous = g_hash_table_lookup(pending, iq->id);
+    if (previous) {
+        _pending_remove(previous);
+    }
+    _pending_expire(iq->sent);
+    g_queue_push_tail(&pending_order, iq);
+    g_hash_table_insert(pending, iq->id, pending_order.tail);
+    lockstats_unlock(&rtt_lock);
+}
+
+void
+rtt_received(XMPPStanza *stanza)
+{
+    if (g_strcmp0(stanza->name, "iq") != 0) {
+        return;
+    }
+
+    const char *type = stanza_get_attr(stanza, "type");
+    if (g_strcmp0(type, "result") != 0 && g_strcmp0(type, "error") != 0) {
+        return;
+    }
+
+    const char *id = stanza_get_id(stanza);
+    if (!id) {
+        return;
+    }
+
+    lockstats_lock(&rtt_lock);
+    if (!pending) {
+        lockstats_unlock(&rtt_lock);
+        return;
+    }
+
+    GList *link = g_hash_table_lookup(pending, id);
+    if (!link) {
+        lockstats_unlock(&rtt_lock);
+        return;
+    }
+
+    PendingIQ *iq = link->data;
+
+    gint64 rtt = g_get_monotonic_time() - iq->sent;
+    RttSamples *arr = g_hash_table_lookup(samples, iq->ns);
+    if (!arr) {
+        arr = calloc(1, sizeof(RttSamples));
+        g_hash_table_insert(samples, strdup(iq->ns), arr);
+    }
+    _samples_add(arr, rtt);
+
+    log_println(STBBR_LOGDEBUG, "RTT for id: %s, ns: %s, %.3f ms", id, iq->ns, rtt / 1000.0);
+    _pending_remove(link);
+    lockstats_unlock(&rtt_lock);
+}
+
+int
+rtt_stats(const char *ns, stbbr_rtt_t *stats)
+{
+    memset(stats, 0, sizeof(stbbr_rtt_t));
+
+    lockstats_lock(&rtt_lock);
+    if (!samples) {
+        lockstats_unlock(&rtt_lock);
+        return 0;
+    }
+
+    RttSamples *arr = g_hash_table_lookup(samples, ns ? ns : RTT_NO_NS);
+    if (!arr || arr->count == 0) {
+        lockstats_unlock(&rtt_lock);
+        return 0;
+    }
+
+    _fill_stats(arr, stats);
+    lockstats_unlock(&rtt_lock);
+
+    return 1;
+}
+
+void
+rtt_report(GString *report)
+{
+    lockstats_lock(&rtt_lock);
+    if (!samples) {
+        lockstats_unlock(&rtt_lock);
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, samples);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        stbbr_rtt_t stats;
+        _fill_stats(value, &stats);
+        g_string_append_printf(report, "%s count=%d min=%.3f mean=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+            (char*)key, stats.count, stats.min, stats.mean, stats.p50, stats.p90, stats.p99, stats.max);
+    }
+    lockstats_unlock(&rtt_lock);
+}
+
+void
+rtt_metrics(GString *metrics)
+{
+    lockstats_lock(&rtt_lock);
+    g_string_append_printf(metrics, "stabber_client_rtt_pending %u\n", pending_order.length);
+    g_string_append_printf(metrics, "stabber_client_rtt_expired_total %ld\n", expired);
+    if (!samples) {
+        lockstats_unlock(&rtt_lock);
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, samples);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        stbbr_rtt_t stats;
+        _fill_stats(value, &stats);
+        g_string_append_printf(metrics, "stabber_client_rtt_ms{ns=\"%s\",quantile=\"0.5\"} %.3f\n", (char*)key, stats.p50);
+        g_string_append_printf(metrics, "stabber_client_rtt_ms{ns=\"%s\",quantile=\"0.9\"} %.3f\n", (char*)key, stats.p90);
+        g_string_append_printf(metrics, "stabber_client_rtt_ms{ns=\"%s\",quantile=\"0.99\"} %.3f\n", (char*)key, stats.p99);
+        g_string_append_printf(metrics, "stabber_client_rtt_ms_sum{ns=\"%s\"} %.3f\n", (char*)key, stats.mean * stats.count);
+        g_string_append_printf(metrics, "stabber_client_rtt_ms_count{ns=\"%s\"} %d\n", (char*)key, stats.count);
+    }
+    lockstats_unlock(&rtt_lock);
+}
+
+void
+rtt_reset(void)
+{
+    lockstats_lock(&rtt_lock);
+    if (pending) {
+        g_hash_table_destroy(pending);
+    }
+    pending = NULL;
+    g_list_free_full(pending_order.head, (GDestroyNotify)_pending_free);
+    g_queue_init(&pending_order);
+    expired = 0;
+
+    if (samples) {
+        g_hash_table_destroy(samples);
+    }
+    samples = NULL;
+    lockstats_unlock(&rtt_lock);
+}
+
+static void
+_ensure_tables(void)
+{
+    if (!pending) {
+        pending = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    if (!samples) {
+        samples = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    }
+}
+
+// the oldest sample is overwritten once the ring is full
+static void
+_samples_add(RttSamples *arr, gint64 rtt)
+{
+    arr->recent[arr->next] = rtt;
+    arr->next = (arr->next + 1) % RTT_MAX_SAMPLES;
+    if (arr->count == 0 || rtt < arr->min) {
+        arr->min = rtt;
+    }
+    if (arr->count == 0 || rtt > arr->max) {
+        arr->max = rtt;
+    }
+    arr->total += rtt;
+    arr->count++;
+}
+
+static void
+_fill_stats(RttSamples *arr, stbbr_rtt_t *stats)
+{
+    gint64 sorted[RTT_MAX_SAMPLES];
+    int len = MIN(arr->count, RTT_MAX_SAMPLES);
+    memcpy(sorted, arr->recent, len * sizeof(gint64));
+    qsort(sorted, len, sizeof(gint64), _compare_gint64);
+
+    stats->count = arr->count;
+    stats->min = arr->min / 1000.0;
+    stats->max = arr->max / 1000.0;
+    stats->mean = (arr->total / (double)arr->count) / 1000.0;
+    stats->p50 = sorted[(len - 1) * 50 / 100] / 1000.0;
+    stats->p90 = sorted[(len - 1) * 90 / 100] / 1000.0;
+    stats->p99 = sorted[(len - 1) * 99 / 100] / 1000.0;
+}
+
+static int
+_compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 first = *(const gint64*)a;
+    gint64 second = *(const gint64*)b;
+
+    if (first < second) {
+        return -1;
+    } else if (first > second) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+// reads the attributes of the start tag, the values asked for are copied
+// out, returns what follows the tag or NULL when it is not a plain start tag
+static const char*
+_scan_tag(const char *tag, const char **names, char **values, int count)
+{
+    const char *curr = tag + 1;
+    while (*curr && !g_ascii_isspace(*curr) && *curr != '>' && *curr != '/') {
+        curr++;
+    }
+
+    while (TRUE) {
+        while (g_ascii_isspace(*curr)) {
+            curr++;
+        }
+        if (*curr == '>') {
+            return curr + 1;
+        }
+        if (*curr == '/' && curr[1] == '>') {
+            return curr + 2;
+        }
+
+        const char *name = curr;
+        while (*curr && *curr != '=' && !g_ascii_isspace(*curr)) {
+            curr++;
+        }
+        size_t name_len = curr - name;
+        while (g_ascii_isspace(*curr)) {
+            curr++;
+        }
+        if (name_len == 0 || *curr != '=') {
+            return NULL;
+        }
+        curr++;
+        while (g_ascii_isspace(*curr)) {
+            curr++;
+        }
+        if (*curr != '"' && *curr != '\'') {
+            return NULL;
+        }
+        const char *value = curr + 1;
+        const char *end = strchr(value, *curr);
+        if (!end) {
+            return NULL;
+        }
+
+        int i;
+        for (i = 0; i < count; i++) {
+            if (strlen(names[i]) == name_len && strncmp(names[i], name, name_len) == 0) {
+                g_free(values[i]);
+                values[i] = g_strndup(value, end - value);
+            }
+        }
+        curr = end + 1;
+    }
+}
+
+// the id, type and payload namespace without building a tree, FALSE when
+// the tags cannot be read this way or a value holds an entity
+static gboolean
+_iq_fields(const char *stream, char **id, char **type, char **ns)
+{
+    const char *iq_names[] = { "id", "type" };
+    char *iq_values[] = { NULL, NULL };
+    const char *rest = _scan_tag(stream, iq_names, iq_values, 2);
+
+    char *ns_value = NULL;
+    if (rest && rest[-2] != '/') {
+        while (g_ascii_isspace(*rest)) {
+            rest++;
+        }
+        if (rest[0] == '<' && rest[1] != '/' && rest[1] != '!' && rest[1] != '?') {
+            const char *ns_names[] = { "xmlns" };
+            if (!_scan_tag(rest, ns_names, &ns_value, 1)) {
+                rest = NULL;
+            }
+        }
+    }
+
+    if (!rest || (iq_values[0] && strchr(iq_values[0], '&')) || (ns_value && strchr(ns_value, '&'))) {
+        g_free(iq_values[0]);
+        g_free(iq_values[1]);
+        g_free(ns_value);
+        return FALSE;
+    }
+
+    *id = iq_values[0];
+    *type = iq_values[1];
+    *ns = ns_value;
+    return TRUE;
+}
+
+// must be called holding rtt_lock
+static void
+_pending_remove(GList *link)
+{
+    PendingIQ *iq = link->data;
+    g_hash_table_remove(pending, iq->id);
+    g_queue_delete_link(&pending_order, link);
+    _pending_free(iq);
+}
+
+// must be called holding rtt_lock, leaves room for one more
+static void
+_pending_expire(gint64 now)
+{
+    while (pending_order.head) {
+        PendingIQ *oldest = pending_order.head->data;
+        if (pending_order.length < RTT_MAX_PENDING && now - oldest->sent < RTT_PENDING_TTL) {
+            break;
+        }
+        log_println(STBBR_LOGDEBUG, "RTT no reply for id: %s, ns: %s", oldest->id, oldest->ns);
+        _pending_remove(pending_order.head);
+        expired++;
+    }
+}
+
+static void
+_pending_free(PendingIQ *iq)
+{
+    if (!iq) {
+        return;
+    }
+
+    free(iq->id);
+    free(iq->ns);
+    free(iq);
+}
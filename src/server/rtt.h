@@ -0,0 +1,39 @@
+/*
+ * rtt.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_RTT
+#define __H_RTT
+
+#include <glib.h>
+
+#include "stabber.h"
+#include "server/stanza.h"
+
+void rtt_sent(const char *stream);
+void rtt_received(XMPPStanza *stanza);
+
+int rtt_stats(const char *ns, stbbr_rtt_t *stats);
+void rtt_report(GString *report);
+void rtt_metrics(GString *metrics);
+void rtt_reset(void);
+
+#endif
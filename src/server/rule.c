@@ -0,0 +1,273 @@
+/*
+ * rule.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include <glib.h>
+
+#include "server/rule.h"
+#include "server/stanza.h"
+#include "server/log.h"
+
+// a rule is a stanza template, a received stanza matches when it has the
+// template's name, every attribute in the template (values may use wildcards),
+// the same text content if any, and a matching child for every template child
+
+typedef struct rule_entry_t {
+    char *text;
+    XMPPStanza *rule;
+    int weight;
+    gpointer value;
+} RuleEntry;
+
+// rules for one element name, by type, those without a literal type apart
+typedef struct rule_node_t {
+    GHashTable *bytype;
+    GPtrArray *anytype;
+} RuleNode;
+
+struct rule_index_t {
+    gint refs;
+    GHashTable *byname;
+};
+
+static gboolean _matches(XMPPStanza *rule, XMPPStanza *stanza);
+static int _weight(XMPPStanza *rule);
+static gint _cmp_entries(gconstpointer a, gconstpointer b);
+static GPtrArray* _entries_new(void);
+static void _entry_free(RuleEntry *entry);
+static void _node_free(RuleNode *node);
+static void _sort_type(gpointer key, gpointer value, gpointer userdata);
+
+RuleIndex*
+rule_index_new(GHashTable *rules)
+{
+    RuleIndex *index = malloc(sizeof(RuleIndex));
+    index->refs = 1;
+    index->byname = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)_node_free);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, rules);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        XMPPStanza *rule = stanza_parse(key);
+        if (!rule) {
+            log_println(STBBR_LOGWARN, "Invalid rule ignored: %s", (char *)key);
+            continue;
+        }
+
+        RuleEntry *entry = malloc(sizeof(RuleEntry));
+        entry->text = strdup(key);
+        entry->rule = rule;
+        entry->weight = _weight(rule);
+        entry->value = value;
+
+        RuleNode *node = g_hash_table_lookup(index->byname, rule->name);
+        if (!node) {
+            node = malloc(sizeof(RuleNode));
+            node->bytype = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)g_ptr_array_unref);
+            node->anytype = _entries_new();
+            g_hash_table_insert(index->byname, strdup(rule->name), node);
+        }
+
+        const char *type = stanza_get_attr(rule, "type");
+        if (!type || strpbrk(type, "*?[")) {
+            g_ptr_array_add(node->anytype, entry);
+        } else {
+            GPtrArray *entries = g_hash_table_lookup(node->bytype, type);
+            if (!entries) {
+                entries = _entries_new();
+                g_hash_table_insert(node->bytype, strdup(type), entries);
+            }
+            g_ptr_array_add(entries, entry);
+        }
+    }
+
+    g_hash_table_iter_init(&iter, index->byname);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        RuleNode *node = value;
+        g_ptr_array_sort(node->anytype, _cmp_entries);
+        g_hash_table_foreach(node->bytype, _sort_type, NULL);
+    }
+
+    return index;
+}
+
+RuleIndex*
+rule_index_ref(RuleIndex *index)
+{
+    if (index) {
+        g_atomic_int_inc(&index->refs);
+    }
+
+    return index;
+}
+
+void
+rule_index_unref(RuleIndex *index)
+{
+    if (index && g_atomic_int_dec_and_test(&index->refs)) {
+        g_hash_table_destroy(index->byname);
+        free(index);
+    }
+}
+
+// the most specific matching rule wins
+gpointer
+rule_index_match(RuleIndex *index, XMPPStanza *stanza)
+{
+    if (!index) {
+        return NULL;
+    }
+
+    RuleNode *node = g_hash_table_lookup(index->byname, stanza->name);
+    if (!node) {
+        return NULL;
+    }
+
+    const char *type = stanza_get_attr(stanza, "type");
+    GPtrArray *typed = type ? g_hash_table_lookup(node->bytype, type) : NULL;
+    GPtrArray *untyped = node->anytype;
+
+    // both lists are most specific first, merge them
+    guint i = 0;
+    guint j = 0;
+    while ((typed && i < typed->len) || j < untyped->len) {
+        RuleEntry *entry = NULL;
+        if (!typed || i == typed->len) {
+            entry = g_ptr_array_index(untyped, j++);
+        } else if (j == untyped->len) {
+            entry = g_ptr_array_index(typed, i++);
+        } else if (_cmp_entries(&typed->pdata[i], &untyped->pdata[j]) <= 0) {
+            entry = g_ptr_array_index(typed, i++);
+        } else {
+            entry = g_ptr_array_index(untyped, j++);
+        }
+
+        if (_matches(entry->rule, stanza)) {
+            return entry->value;
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean
+_matches(XMPPStanza *rule, XMPPStanza *stanza)
+{
+    if (g_strcmp0(rule->name, stanza->name) != 0) {
+        return FALSE;
+    }
+
+    GList *curr = rule->attrs;
+    while (curr) {
+        XMPPAttr *attr = curr->data;
+        const char *value = stanza_get_attr(stanza, attr->name);
+        if (!value || fnmatch(attr->value, value, 0) != 0) {
+            return FALSE;
+        }
+        curr = g_list_next(curr);
+    }
+
+    if (rule->content) {
+        if (!stanza->content || g_strcmp0(rule->content->str, stanza->content->str) != 0) {
+            return FALSE;
+        }
+    }
+
+    curr = rule->children;
+    while (curr) {
+        gboolean found = FALSE;
+        GList *curr_child = stanza->children;
+        while (curr_child && !found) {
+            found = _matches(curr->data, curr_child->data);
+            curr_child = g_list_next(curr_child);
+        }
+        if (!found) {
+            return FALSE;
+        }
+        curr = g_list_next(curr);
+    }
+
+    return TRUE;
+}
+
+// one for each attribute, child and text the rule requires
+static int
+_weight(XMPPStanza *rule)
+{
+    int weight = g_list_length(rule->attrs);
+    if (rule->content) {
+        weight++;
+    }
+
+    GList *curr = rule->children;
+    while (curr) {
+        weight += 1 + _weight(curr->data);
+        curr = g_list_next(curr);
+    }
+
+    return weight;
+}
+
+static gint
+_cmp_entries(gconstpointer a, gconstpointer b)
+{
+    const RuleEntry *entry_a = *(RuleEntry * const *)a;
+    const RuleEntry *entry_b = *(RuleEntry * const *)b;
+
+    if (entry_a->weight != entry_b->weight) {
+        return entry_a->weight > entry_b->weight ? -1 : 1;
+    }
+
+    return strcmp(entry_a->text, entry_b->text);
+}
+
+static GPtrArray*
+_entries_new(void)
+{
+    return g_ptr_array_new_with_free_func((GDestroyNotify)_entry_free);
+}
+
+static void
+_entry_free(RuleEntry *entry)
+{
+    free(entry->text);
+    stanza_free(entry->rule);
+    free(entry);
+}
+
+static void
+_node_free(RuleNode *node)
+{
+    g_hash_table_destroy(node->bytype);
+    g_ptr_array_unref(node->anytype);
+    free(node);
+}
+
+static void
+_sort_type(gpointer key, gpointer value, gpointer userdata)
+{
+    g_ptr_array_sort(value, _cmp_entries);
+}
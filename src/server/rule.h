@@ -0,0 +1,37 @@
+/*
+ * rule.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_RULE
+#define __H_RULE
+
+#include <glib.h>
+
+#include "server/stanza.h"
+
+typedef struct rule_index_t RuleIndex;
+
+RuleIndex* rule_index_new(GHashTable *rules);
+RuleIndex* rule_index_ref(RuleIndex *index);
+void rule_index_unref(RuleIndex *index);
+gpointer rule_index_match(RuleIndex *index, XMPPStanza *stanza);
+
+#endif
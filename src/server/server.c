@@ -29,6 +29,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #ifdef PLATFORM_OSX
 #include <pthread.h>
 #else
@@ -43,6 +48,16 @@
 #include "server/verify.h"
 #include "server/server.h"
 #include "server/httpapi.h"
+#include "server/ctlapi.h"
+#include "server/stubfile.h"
+#include "server/autoreply.h"
+#include "server/netem.h"
+#include "server/generator.h"
+#include "server/roster.h"
+#include "server/muc.h"
+#include "server/trace.h"
+#include "server/rtt.h"
+#include "server/lockstats.h"
 #include "server/log.h"
 
 #define XML_START "<?xml version=\"1.0\"?>"
@@ -52,7 +67,7 @@
 
 #define STREAM_END "</stream:stream>"
 
-pthread_mutex_t send_queue_lock;
+StbbrMutex send_queue_lock = STBBR_MUTEX_INIT("send_queue_lock");
 
 static GList *send_queue;
 static XMPPClient *client;
@@ -60,38 +75,45 @@ static int listen_socket;
 static pthread_t server_thread;
 static gboolean kill_recv = FALSE;
 static gboolean httpapi_run = FALSE;
+static char *unix_path = NULL;
+static char *http_unix_path = NULL;
+
+typedef gboolean (*stream_fill_func)(void *source, GString *chunk);
+
+// a streamed reply owns the connection until it is written, anything else
+// sent meanwhile is held back so it cannot land inside it
+static void *out_source = NULL;
+static stream_fill_func out_fill = NULL;
+static GDestroyNotify out_free = NULL;
+static char *out_name = NULL;
+static GString *out_chunk = NULL;
+static size_t out_written = 0;
+static int out_trace = 0;
+static GQueue held = G_QUEUE_INIT;
+static gboolean want_write = FALSE;
+
+// what the client has not yet taken of the last generated or replayed stanza
+static GString *paced_out = NULL;
+static size_t paced_written = 0;
 
 static void _shutdown(void);
 static void* _start_server_cb(void* userdata);
+static void _write_reply(PrimeStub *stub, const char *id);
+static void _write_parts(struct iovec *parts, int count);
+static void _write_stream(const char * const stream);
+static gboolean _write_paced(const char * const stream);
+static gboolean _paced_flush(void);
+static void _paced_drain(void);
+static void _stream_start(void *source, stream_fill_func fill, GDestroyNotify free_func, char *name);
+static int _stream_run(void);
+static void _stream_done(void);
+static gboolean _muc_handle(XMPPStanza *stanza);
 
 void
 write_stream(const char * const stream)
 {
-    int to_send = strlen(stream);
-    char *marker = (char*)stream;
-
-    while (to_send > 0) {
-        int sent = write(client->sock, marker, to_send);
-
-        // error
-        if (sent == -1) {
-            // write timeout, try again
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                errno = 0;
-                continue;
-
-            // real error
-            } else {
-                log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
-                return;
-            }
-        }
-
-        to_send -= sent;
-        marker += sent;
-    }
-
-    log_println(STBBR_LOGINFO, "SENT: %s", stream);
+    trace_sent(stream, strlen(stream));
+    _write_stream(stream);
 }
 
 int
@@ -104,21 +126,38 @@ read_stream(void)
     errno = 0;
     while (TRUE) {
         if (kill_recv) {
+            netem_drain(client->sock);
             _shutdown();
             return 0;
         }
 
+        want_write = FALSE;
+
         // send anything from queue
-        pthread_mutex_lock(&send_queue_lock);
+        lockstats_lock(&send_queue_lock);
         GList *curr_send = send_queue;
         while (curr_send) {
-            write_stream(curr_send->data);
+            const char *stream = g_bytes_get_data(curr_send->data, NULL);
+            rtt_sent(stream);
+            write_stream(stream);
             curr_send = g_list_next(curr_send);
         }
 
-        g_list_free_full(send_queue, free);
+        g_list_free_full(send_queue, (GDestroyNotify)g_bytes_unref);
         send_queue = NULL;
-        pthread_mutex_unlock(&send_queue_lock);
+        lockstats_unlock(&send_queue_lock);
+
+        // generated traffic and delayed output go out in between reads, and
+        // wait while the client is not reading
+        int wait_ms = generator_run(_write_paced, NETEM_IDLE_MS);
+        wait_ms = MIN(wait_ms, trace_replay_run(_write_paced, wait_ms));
+        wait_ms = MIN(wait_ms, _stream_run());
+        wait_ms = MIN(wait_ms, netem_flush(client->sock));
+        int read_wait_ms = netem_read_wait();
+        if (read_wait_ms > 0) {
+            poll(NULL, 0, MIN(wait_ms, read_wait_ms));
+            continue;
+        }
 
         int read_size = recv(client->sock, buf, 1, 0);
 
@@ -131,10 +170,14 @@ read_stream(void)
 
         // error
         if (read_size == -1) {
-            // got nothing, sleep and try again
+            // got nothing, wait for input or more output and try again
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 errno = 0;
-                usleep(1000 * 5);
+                struct pollfd pfd;
+                pfd.fd = client->sock;
+                pfd.events = want_write ? POLLIN | POLLOUT : POLLIN;
+                pfd.revents = 0;
+                poll(&pfd, 1, wait_ms);
                 continue;
 
             // real error
@@ -146,6 +189,7 @@ read_stream(void)
         }
 
         // success, feed parser with byte
+        netem_read_done(read_size);
         parser_feed(buf, 1);
         g_string_append_len(stream, buf, read_size);
         if (g_str_has_suffix(stream->str, STREAM_END)) {
@@ -202,8 +246,7 @@ auth_callback(XMPPStanza *stanza)
         client->password = strdup(password->content->str);
         client->resource = strdup(resource->content->str);
 
-        char *expected_password = prime_get_passwd();
-        if (g_strcmp0(client->password, expected_password) != 0) {
+        if (!prime_check_passwd(client->password)) {
             GString *authfail = g_string_new("<iq id=\"");
             g_string_append(authfail, id);
             g_string_append(authfail, "\" type=\"error\"/>");
@@ -221,45 +264,118 @@ auth_callback(XMPPStanza *stanza)
     }
 }
 
-void
+int
 id_callback(const char *id)
 {
-    char *stream = prime_get_for_id(id);
-    if (!stream) {
-        return;
+    PrimeStub *stub = prime_get_for_id(id);
+    if (!stub) {
+        return 0;
     }
 
     log_println(STBBR_LOGINFO, "--> ID callback fired for '%s'", id);
-    write_stream(stream);
+    _write_reply(stub, NULL);
+    prime_stub_unref(stub);
+
+    return 1;
 }
 
-void
+int
 query_callback(const char *query, const char *id)
 {
-    XMPPStanza *stanza = prime_get_for_query(query);
-    if (!stanza) {
-        return;
+    PrimeStub *stub = prime_get_for_query(query);
+    if (!stub && g_strcmp0(query, "jabber:iq:roster") == 0 && !out_source) {
+        RosterStream *roster = roster_stream_new(id);
+        if (!roster) {
+            return 0;
+        }
+        log_println(STBBR_LOGINFO, "--> ROSTER callback fired, streaming %d contacts", roster_stream_count(roster));
+        _stream_start(roster, (stream_fill_func)roster_stream_fill, (GDestroyNotify)roster_stream_free,
+            g_strdup_printf("roster of %d contacts", roster_stream_count(roster)));
+        return 1;
+    }
+    if (!stub) {
+        return 0;
     }
 
     log_println(STBBR_LOGINFO, "--> QUERY callback fired for '%s'", query);
-    stanza_set_id(stanza, id);
-    char *stream = stanza_to_string(stanza);
-    write_stream(stream);
-    free(stream);
+    _write_reply(stub, id);
+    prime_stub_unref(stub);
+
+    return 1;
 }
 
-void
+int
+rule_callback(XMPPStanza *stanza)
+{
+    PrimeStub *stub = prime_get_for_rule(stanza);
+    if (!stub) {
+        if (_muc_handle(stanza)) {
+            return 1;
+        }
+
+        // stock server requests are answered only when nothing was primed
+        AutoReply reply;
+        if (!autoreply_match(stanza, &reply)) {
+            return 0;
+        }
+        log_println(STBBR_LOGINFO, "--> AUTO reply for <%s>", ((XMPPStanza *)stanza->children->data)->name);
+        _write_parts(reply.parts, reply.count);
+        return 1;
+    }
+
+    log_println(STBBR_LOGINFO, "--> RULE callback fired for <%s>", stanza->name);
+    _write_reply(stub, stanza_get_id(stanza));
+    prime_stub_unref(stub);
+
+    return 1;
+}
+
+// waits give up once the server is stopping, before its state is freed
+gboolean
+server_stopping(void)
+{
+    return kill_recv;
+}
+
+// 0 when the server stopped first
+int
 server_wait_for(char *id)
 {
     log_println(STBBR_LOGINFO, "Received wait for stanza with id: %s", id);
-    while (TRUE) {
+    while (!kill_recv) {
         int res = stanzas_contains_id(id);
         if (res) {
             log_println(STBBR_LOGINFO, "WAIT complete for id: %s", id);
-            return;
+            return 1;
         }
         usleep(1000 * 5);
     }
+
+    log_println(STBBR_LOGINFO, "WAIT stopped for id: %s", id);
+    return 0;
+}
+
+// the seq of the oldest stanza after the mark with a matching id, or 0 when
+// the server stopped first, a retry only looks at what arrived since the
+// previous try
+long
+server_wait_for_after(char *id, long after)
+{
+    log_println(STBBR_LOGINFO, "Received wait for stanza with id: %s after %ld", id, after);
+    long checked = after;
+    while (!kill_recv) {
+        long seq = stanzas_last_seq();
+        long res = stanzas_find_id(id, checked);
+        if (res) {
+            log_println(STBBR_LOGINFO, "WAIT complete for id: %s", id);
+            return res;
+        }
+        checked = MAX(checked, seq);
+        usleep(1000 * 5);
+    }
+
+    log_println(STBBR_LOGINFO, "WAIT stopped for id: %s", id);
+    return 0;
 }
 
 int
@@ -271,53 +387,24 @@ server_run(stbbr_log_t loglevel, int port, int httpport)
     prctl(PR_SET_NAME, "main");
 #endif
 
-    pthread_mutex_lock(&send_queue_lock);
+    lockstats_lock(&send_queue_lock);
     send_queue = NULL;
-    pthread_mutex_unlock(&send_queue_lock);
+    lockstats_unlock(&send_queue_lock);
 
     kill_recv = FALSE;
     client = NULL;
     verify_set_timeout(10);
 
     log_init(loglevel);
-    log_println(STBBR_LOGINFO, "Starting on port: %d...", port);
-
-    // create listen socket
-    errno = 0;
-    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (listen_socket == -1) {
-        log_println(STBBR_LOGERROR, "Could not create socket: %s", strerror(errno));
-        _shutdown();
-        return -1;
-    }
-
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-
-    int reuse = 1;
-    int ret = setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    if (ret == -1) {
-        log_println(STBBR_LOGERROR, "Set socket options failed: %s", strerror(errno));
-        _shutdown();
-        return -1;
-    }
-
-    // bind socket to port
-    errno = 0;
-    ret = bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    if (ret == -1) {
-        log_println(STBBR_LOGERROR, "Bind failed: %s", strerror(errno));
-        _shutdown();
-        return -1;
+    if (unix_path) {
+        log_println(STBBR_LOGINFO, "Starting on socket: %s...", unix_path);
+        listen_socket = server_listen_unix(unix_path);
+    } else {
+        log_println(STBBR_LOGINFO, "Starting on port: %d...", port);
+        listen_socket = server_listen_tcp(port);
     }
 
-    // set socket to listen mode
-    errno = 0;
-    ret = listen(listen_socket, 5);
-    if (ret == -1) {
-        log_println(STBBR_LOGERROR, "Listen failed: %s", strerror(errno));
+    if (listen_socket == -1) {
         _shutdown();
         return -1;
     }
@@ -332,7 +419,14 @@ server_run(stbbr_log_t loglevel, int port, int httpport)
     }
 
     // start http server
-    if (httpport > 0) {
+    if (http_unix_path) {
+        res = httpapi_start_unix(http_unix_path);
+        if (!res) {
+            _shutdown();
+            return -1;
+        }
+        httpapi_run = TRUE;
+    } else if (httpport > 0) {
         res = httpapi_start(httpport);
         if (!res) {
             _shutdown();
@@ -341,17 +435,92 @@ server_run(stbbr_log_t loglevel, int port, int httpport)
         httpapi_run = TRUE;
     }
 
+    // start control api when a port or socket is set
+    res = ctlapi_start();
+    if (!res) {
+        _shutdown();
+        return -1;
+    }
+
     return 0;
 }
 
+void
+server_set_unix_sockets(const char *path, const char *httppath)
+{
+    free(unix_path);
+    unix_path = path ? strdup(path) : NULL;
+
+    free(http_unix_path);
+    http_unix_path = httppath ? strdup(httppath) : NULL;
+}
+
+int
+server_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_println(STBBR_LOGERROR, "Socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    errno = 0;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        log_println(STBBR_LOGERROR, "Could not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // remove a socket left by a previous run, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log_println(STBBR_LOGERROR, "Not a socket, will not replace: %s", path);
+            close(sock);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    errno = 0;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_println(STBBR_LOGERROR, "Bind failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    errno = 0;
+    if (listen(sock, 5) == -1) {
+        log_println(STBBR_LOGERROR, "Listen failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
 void
 server_send(char *stream)
 {
     log_println(STBBR_LOGDEBUG, "Received send: %s", stream);
 
-    pthread_mutex_lock(&send_queue_lock);
-    send_queue = g_list_append(send_queue, strdup(stream));
-    pthread_mutex_unlock(&send_queue_lock);
+    lockstats_lock(&send_queue_lock);
+    send_queue = g_list_append(send_queue, g_bytes_new(stream, strlen(stream) + 1));
+    lockstats_unlock(&send_queue_lock);
+}
+
+// queues a reference, bytes must hold a NUL terminated stream
+void
+server_send_bytes(GBytes *bytes)
+{
+    log_println(STBBR_LOGDEBUG, "Received send: %s", (const char *)g_bytes_get_data(bytes, NULL));
+
+    lockstats_lock(&send_queue_lock);
+    send_queue = g_list_append(send_queue, g_bytes_ref(bytes));
+    lockstats_unlock(&send_queue_lock);
 }
 
 void
@@ -366,6 +535,51 @@ server_stop(void)
     pthread_join(server_thread, NULL);
 }
 
+int
+server_listen_tcp(int port)
+{
+    // create listen socket
+    errno = 0;
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sock == -1) {
+        log_println(STBBR_LOGERROR, "Could not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    int reuse = 1;
+    int ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (ret == -1) {
+        log_println(STBBR_LOGERROR, "Set socket options failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // bind socket to port
+    errno = 0;
+    ret = bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret == -1) {
+        log_println(STBBR_LOGERROR, "Bind failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // set socket to listen mode
+    errno = 0;
+    ret = listen(sock, 5);
+    if (ret == -1) {
+        log_println(STBBR_LOGERROR, "Listen failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
 static void*
 _start_server_cb(void* userdata)
 {
@@ -375,7 +589,7 @@ _start_server_cb(void* userdata)
     prctl(PR_SET_NAME, "stbr");
 #endif
 
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
 
     // listen socket non blocking
     int res = fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL, 0) | O_NONBLOCK);
@@ -387,10 +601,15 @@ _start_server_cb(void* userdata)
     log_println(STBBR_LOGINFO, "Waiting for incoming connection...");
 
     // wait for connection
-    int c = sizeof(struct sockaddr_in);
+    int c = sizeof(struct sockaddr_storage);
     int client_socket;
     errno = 0;
     while ((client_socket = accept(listen_socket, (struct sockaddr *)&client_addr, (socklen_t*)&c)) == -1) {
+        // stopped before a client connected
+        if (kill_recv) {
+            _shutdown();
+            return NULL;
+        }
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             log_println(STBBR_LOGERROR, "Accept failed: %s", strerror(errno));
             return NULL;
@@ -406,14 +625,344 @@ _start_server_cb(void* userdata)
         return NULL;
     }
 
-    client = xmppclient_new(client_addr, client_socket);
-    parser_init(stream_start_callback, auth_callback, id_callback, query_callback);
+    if (client_addr.ss_family == AF_UNIX) {
+        client = xmppclient_new_unix(unix_path, client_socket);
+    } else {
+        client = xmppclient_new(*(struct sockaddr_in *)&client_addr, client_socket);
+    }
+    parser_init(stream_start_callback, auth_callback, id_callback, query_callback, rule_callback);
 
     read_stream();
 
     return NULL;
 }
 
+#define STREAM_CHUNK_SIZE 32768
+
+// chunks per pass, so reads still get a turn
+#define STREAM_CHUNKS_PER_PASS 4
+
+// takes the source and name
+static void
+_stream_start(void *source, stream_fill_func fill, GDestroyNotify free_func, char *name)
+{
+    out_source = source;
+    out_fill = fill;
+    out_free = free_func;
+    out_name = name;
+    if (!out_chunk) {
+        out_chunk = g_string_sized_new(STREAM_CHUNK_SIZE);
+    }
+    g_string_truncate(out_chunk, 0);
+    out_written = 0;
+    out_trace = trace_current();
+}
+
+// the source makes the next chunk only once the client has taken the last
+static int
+_stream_run(void)
+{
+    if (!out_source) {
+        return NETEM_IDLE_MS;
+    }
+    if (!_paced_flush()) {
+        return NETEM_IDLE_MS;
+    }
+
+    int chunks = 0;
+    while (chunks < STREAM_CHUNKS_PER_PASS) {
+        if (out_written == out_chunk->len) {
+            g_string_truncate(out_chunk, 0);
+            out_written = 0;
+            gboolean more = out_fill(out_source, out_chunk);
+            trace_sent_for(out_trace, out_chunk->str, out_chunk->len);
+            if (out_chunk->len == 0 && !more) {
+                _stream_done();
+                return 0;
+            }
+            chunks++;
+        }
+
+        // the emulated link takes a chunk once it has sent the last one
+        if (netem_active()) {
+            if (netem_queued() > 0) {
+                return 1;
+            }
+            netem_send(out_chunk->str, out_chunk->len);
+            out_written = out_chunk->len;
+            continue;
+        }
+
+        ssize_t written = write(client->sock, out_chunk->str + out_written, out_chunk->len - out_written);
+        if (written == -1) {
+            // client not reading, wait until it can take more
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                want_write = TRUE;
+                return NETEM_IDLE_MS;
+            }
+            log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+            _stream_done();
+            return 0;
+        }
+        out_written += written;
+    }
+
+    return 0;
+}
+
+// releases what was sent while the stream was being written
+static void
+_stream_done(void)
+{
+    log_println(STBBR_LOGINFO, "SENT: %s", out_name);
+    out_free(out_source);
+    out_source = NULL;
+    g_free(out_name);
+    out_name = NULL;
+
+    while (!g_queue_is_empty(&held)) {
+        char *stream = g_queue_pop_head(&held);
+        _write_stream(stream);
+        free(stream);
+    }
+}
+
+// a join is streamed like a roster, anything else is a single reply
+static gboolean
+_muc_handle(XMPPStanza *stanza)
+{
+    GString *reply = g_string_new("");
+    MucJoin *join = NULL;
+    if (!muc_handle(stanza, reply, &join)) {
+        g_string_free(reply, TRUE);
+        return FALSE;
+    }
+
+    if (join) {
+        if (out_source) {
+            log_println(STBBR_LOGERROR, "Join ignored, a stream is already being sent");
+            muc_join_free(join);
+        } else {
+            log_println(STBBR_LOGINFO, "--> MUC join, streaming %d occupants", muc_join_count(join));
+            _stream_start(join, (stream_fill_func)muc_join_fill, (GDestroyNotify)muc_join_free,
+                g_strdup_printf("room join with %d occupants", muc_join_count(join)));
+        }
+    } else {
+        log_println(STBBR_LOGINFO, "--> MUC reply for <%s>", stanza->name);
+        write_stream(reply->str);
+    }
+    g_string_free(reply, TRUE);
+
+    return TRUE;
+}
+
+// all stanzas of the reply go out in one write
+static void
+_write_reply(PrimeStub *stub, const char *id)
+{
+    PrimeReply *reply = prime_stub_next(stub);
+    if (!id || !reply->prefix) {
+        write_stream(reply->text);
+        return;
+    }
+
+    // the id was unescaped when it was read
+    char *escaped = strpbrk(id, "&<>\"") ? g_markup_escape_text(id, -1) : NULL;
+
+    struct iovec parts[3];
+    parts[0].iov_base = reply->prefix;
+    parts[0].iov_len = strlen(reply->prefix);
+    parts[1].iov_base = escaped ? escaped : (char *)id;
+    parts[1].iov_len = strlen(parts[1].iov_base);
+    parts[2].iov_base = reply->suffix;
+    parts[2].iov_len = strlen(reply->suffix);
+    _write_parts(parts, 3);
+    g_free(escaped);
+}
+
+// held stanzas were traced when they were first written
+static void
+_write_stream(const char * const stream)
+{
+    int to_send = strlen(stream);
+    if (out_source) {
+        g_queue_push_tail(&held, strdup(stream));
+        return;
+    }
+    _paced_drain();
+    if (netem_active()) {
+        netem_send(stream, to_send);
+        log_println(STBBR_LOGINFO, "SENT: %s", stream);
+        return;
+    }
+    char *marker = (char*)stream;
+
+    while (to_send > 0) {
+        int sent = write(client->sock, marker, to_send);
+
+        // error
+        if (sent == -1) {
+            // write timeout, try again
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                continue;
+
+            // real error
+            } else {
+                log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+                return;
+            }
+        }
+
+        to_send -= sent;
+        marker += sent;
+    }
+
+    log_println(STBBR_LOGINFO, "SENT: %s", stream);
+}
+
+// the parts go out as one stream without being joined first, parts is used up
+static void
+_write_parts(struct iovec *parts, int count)
+{
+    GString *sent = g_string_new("");
+    size_t to_send = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        to_send += parts[i].iov_len;
+        g_string_append_len(sent, parts[i].iov_base, parts[i].iov_len);
+    }
+    trace_sent(sent->str, sent->len);
+
+    if (out_source) {
+        g_queue_push_tail(&held, g_string_free(sent, FALSE));
+        return;
+    }
+    _paced_drain();
+    if (netem_active()) {
+        netem_send(sent->str, sent->len);
+        log_println(STBBR_LOGINFO, "SENT: %s", sent->str);
+        g_string_free(sent, TRUE);
+        return;
+    }
+
+    while (to_send > 0) {
+        ssize_t written = writev(client->sock, parts, count);
+
+        // error
+        if (written == -1) {
+            // write timeout, try again
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                continue;
+
+            // real error
+            } else {
+                log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+                g_string_free(sent, TRUE);
+                return;
+            }
+        }
+
+        // a short write can stop part way through a part
+        to_send -= written;
+        while (count > 0 && (size_t)written >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = (char *)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+
+    log_println(STBBR_LOGINFO, "SENT: %s", sent->str);
+    g_string_free(sent, TRUE);
+}
+
+// never waits on the client, what it does not take now is kept and the
+// next stanza is refused until it has gone
+static gboolean
+_write_paced(const char * const stream)
+{
+    if (out_source || !_paced_flush()) {
+        return FALSE;
+    }
+
+    size_t len = strlen(stream);
+    if (netem_active()) {
+        trace_sent(stream, len);
+        netem_send(stream, len);
+        log_println(STBBR_LOGINFO, "SENT: %s", stream);
+        return TRUE;
+    }
+
+    ssize_t written = write(client->sock, stream, len);
+    if (written == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            want_write = TRUE;
+            return FALSE;
+        }
+        log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+        return TRUE;
+    }
+
+    trace_sent(stream, len);
+    if ((size_t)written < len) {
+        if (!paced_out) {
+            paced_out = g_string_sized_new(1024);
+        }
+        g_string_append_len(paced_out, stream + written, len - written);
+        want_write = TRUE;
+    }
+    log_println(STBBR_LOGINFO, "SENT: %s", stream);
+
+    return TRUE;
+}
+
+// TRUE once the client has taken the rest of the last paced stanza
+static gboolean
+_paced_flush(void)
+{
+    if (!paced_out || paced_out->len == 0) {
+        return TRUE;
+    }
+
+    while (paced_written < paced_out->len) {
+        ssize_t written = write(client->sock, paced_out->str + paced_written, paced_out->len - paced_written);
+        if (written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                want_write = TRUE;
+                return FALSE;
+            }
+            log_println(STBBR_LOGERROR, "Error sending on connection: %s", strerror(errno));
+            break;
+        }
+        paced_written += written;
+    }
+
+    g_string_truncate(paced_out, 0);
+    paced_written = 0;
+    return TRUE;
+}
+
+// anything written whole must not land inside a paced stanza
+static void
+_paced_drain(void)
+{
+    while (!_paced_flush()) {
+        struct pollfd pfd;
+        pfd.fd = client->sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, NETEM_IDLE_MS);
+    }
+}
+
 static void
 _shutdown(void)
 {
@@ -422,6 +971,28 @@ _shutdown(void)
     if (httpapi_run) {
         httpapi_stop();
     }
+    ctlapi_stop();
+    stubfile_stop();
+    generator_stop_all();
+    netem_reset();
+    muc_free_all();
+    trace_record_stop();
+    trace_replay_stop();
+
+    if (out_source) {
+        out_free(out_source);
+        out_source = NULL;
+        g_free(out_name);
+        out_name = NULL;
+    }
+    while (!g_queue_is_empty(&held)) {
+        free(g_queue_pop_head(&held));
+    }
+    if (paced_out) {
+        g_string_free(paced_out, TRUE);
+        paced_out = NULL;
+        paced_written = 0;
+    }
 
     xmppclient_end_session(client);
     client = NULL;
@@ -431,14 +1002,18 @@ _shutdown(void)
     shutdown(listen_socket, 2);
     while (recv(listen_socket, NULL, 1, 0) > 0) {}
     close(listen_socket);
+    if (unix_path && listen_socket != -1) {
+        unlink(unix_path);
+    }
 
     prime_free_all();
     stanzas_free_all();
+    rtt_reset();
 
-    pthread_mutex_lock(&send_queue_lock);
-    g_list_free_full(send_queue, free);
+    lockstats_lock(&send_queue_lock);
+    g_list_free_full(send_queue, (GDestroyNotify)g_bytes_unref);
     send_queue = NULL;
-    pthread_mutex_unlock(&send_queue_lock);
+    lockstats_unlock(&send_queue_lock);
 
     log_println(STBBR_LOGINFO, "");
     log_println(STBBR_LOGINFO, "");
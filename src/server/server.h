@@ -23,13 +23,22 @@
 #ifndef __H_SERVER
 #define __H_SERVER
 
+#include <glib.h>
+
 #include "stabber.h"
 
 int server_run(stbbr_log_t loglevel, int port, int httpport);
 void server_stop(void);
 
-void server_wait_for(char *id);
+void server_set_unix_sockets(const char *path, const char *httppath);
+int server_listen_tcp(int port);
+int server_listen_unix(const char *path);
+
+gboolean server_stopping(void);
+int server_wait_for(char *id);
+long server_wait_for_after(char *id, long after);
 
 void server_send(char *stream);
+void server_send_bytes(GBytes *bytes);
 
 #endif
@@ -36,6 +36,8 @@ static void _start_element(void *data, const char *element, const char **attribu
 static void _end_element(void *data, const char *element);
 static void _handle_data(void *data, const char *content, int length);
 static void _attrs_free(XMPPAttr *attr);
+static void _append_stanza(GString *stanza_str, XMPPStanza *stanza, const char *id);
+static void _append_escaped(GString *stanza_str, const char *text, gboolean attr);
 
 XMPPStanza*
 stanza_new(const char *name, const char **attributes)
@@ -59,48 +61,14 @@ stanza_new(const char *name, const char **attributes)
 char*
 stanza_to_string(XMPPStanza *stanza)
 {
-    GString *stanza_str = g_string_new("<");
-
-    g_string_append(stanza_str, stanza->name);
-
-    if (stanza->attrs) {
-        GList *curr = stanza->attrs;
-        while (curr) {
-            XMPPAttr *attr = curr->data;
-            g_string_append(stanza_str, " ");
-            g_string_append(stanza_str, attr->name);
-            g_string_append(stanza_str, "=\"");
-            g_string_append(stanza_str, attr->value);
-            g_string_append(stanza_str, "\"");
-
-            curr = g_list_next(curr);
-        }
-    }
-
-    if (stanza->content) {
-        g_string_append(stanza_str, ">");
-        g_string_append(stanza_str, stanza->content->str);
-        g_string_append(stanza_str, "</");
-        g_string_append(stanza_str, stanza->name);
-        g_string_append(stanza_str, ">");
-    } else if (stanza->children) {
-        g_string_append(stanza_str, ">");
-
-        GList *curr = stanza->children;
-        while (curr) {
-            XMPPStanza *child = curr->data;
-            char *child_str = stanza_to_string(child);
-            g_string_append(stanza_str, child_str);
-            free(child_str);
-            curr = g_list_next(curr);
-        }
+    return stanza_to_string_with_id(stanza, NULL);
+}
 
-        g_string_append(stanza_str, "</");
-        g_string_append(stanza_str, stanza->name);
-        g_string_append(stanza_str, ">");
-    } else {
-        g_string_append(stanza_str, "/>");
-    }
+char*
+stanza_to_string_with_id(XMPPStanza *stanza, const char *id)
+{
+    GString *stanza_str = g_string_new("");
+    _append_stanza(stanza_str, stanza, id);
 
     char *result = stanza_str->str;
     g_string_free(stanza_str, FALSE);
@@ -292,7 +260,34 @@ stanza_parse(char *stanza_text)
     XML_Parse(parser, stanza_text, strlen(stanza_text), 0);
     XML_ParserFree(parser);
 
-    return state->curr_stanza;
+    XMPPStanza *stanza = state->curr_stanza;
+    free(state);
+
+    return stanza;
+}
+
+// each top level element in the text, in order
+GList*
+stanza_parse_all(const char *stanza_text)
+{
+    char *wrapped = g_strconcat("<stbbr>", stanza_text, "</stbbr>", NULL);
+    XMPPStanza *wrapper = stanza_parse(wrapped);
+    g_free(wrapped);
+    if (!wrapper) {
+        return NULL;
+    }
+
+    GList *stanzas = wrapper->children;
+    wrapper->children = NULL;
+    stanza_free(wrapper);
+
+    GList *curr = stanzas;
+    while (curr) {
+        ((XMPPStanza *)curr->data)->parent = NULL;
+        curr = g_list_next(curr);
+    }
+
+    return stanzas;
 }
 
 static void
@@ -348,3 +343,87 @@ _attrs_free(XMPPAttr *attr)
     free(attr->value);
     free(attr);
 }
+
+// id replaces the id attribute of the top level element, or is added after the others
+static void
+_append_stanza(GString *stanza_str, XMPPStanza *stanza, const char *id)
+{
+    g_string_append_c(stanza_str, '<');
+    g_string_append(stanza_str, stanza->name);
+
+    gboolean id_written = FALSE;
+    GList *curr = stanza->attrs;
+    while (curr) {
+        XMPPAttr *attr = curr->data;
+        const char *value = attr->value;
+        if (id && g_strcmp0(attr->name, "id") == 0) {
+            value = id;
+            id_written = TRUE;
+        }
+        g_string_append_c(stanza_str, ' ');
+        g_string_append(stanza_str, attr->name);
+        g_string_append(stanza_str, "=\"");
+        _append_escaped(stanza_str, value, TRUE);
+        g_string_append_c(stanza_str, '"');
+
+        curr = g_list_next(curr);
+    }
+
+    if (id && !id_written) {
+        g_string_append(stanza_str, " id=\"");
+        _append_escaped(stanza_str, id, TRUE);
+        g_string_append_c(stanza_str, '"');
+    }
+
+    // text between children is kept as one, so it is written before them
+    if (stanza->content || stanza->children) {
+        g_string_append_c(stanza_str, '>');
+        if (stanza->content) {
+            _append_escaped(stanza_str, stanza->content->str, FALSE);
+        }
+
+        curr = stanza->children;
+        while (curr) {
+            _append_stanza(stanza_str, curr->data, NULL);
+            curr = g_list_next(curr);
+        }
+
+        g_string_append(stanza_str, "</");
+        g_string_append(stanza_str, stanza->name);
+        g_string_append_c(stanza_str, '>');
+    } else {
+        g_string_append(stanza_str, "/>");
+    }
+}
+
+// what the parser unescaped is escaped again, whitespace in attributes as
+// references so it is not normalised to spaces when read back
+static void
+_append_escaped(GString *stanza_str, const char *text, gboolean attr)
+{
+    const char *special = attr ? "&<>\"\n\r\t" : "&<>\r";
+    const char *pos = text;
+    const char *next;
+    while ((next = strpbrk(pos, special))) {
+        g_string_append_len(stanza_str, pos, next - pos);
+        switch (*next) {
+            case '&':
+                g_string_append(stanza_str, "&amp;");
+                break;
+            case '<':
+                g_string_append(stanza_str, "&lt;");
+                break;
+            case '>':
+                g_string_append(stanza_str, "&gt;");
+                break;
+            case '"':
+                g_string_append(stanza_str, "&quot;");
+                break;
+            default:
+                g_string_append_printf(stanza_str, "&#%d;", *next);
+                break;
+        }
+        pos = next + 1;
+    }
+    g_string_append(stanza_str, pos);
+}
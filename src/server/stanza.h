@@ -40,7 +40,9 @@ typedef struct xmpp_stanza_t {
 
 XMPPStanza* stanza_new(const char *name, const char **attributes);
 XMPPStanza* stanza_parse(char *stanza_text);
+GList* stanza_parse_all(const char *stanza_text);
 char* stanza_to_string(XMPPStanza *stanza);
+char* stanza_to_string_with_id(XMPPStanza *stanza, const char *id);
 void stanza_add_child(XMPPStanza *parent, XMPPStanza *child);
 XMPPStanza* stanza_get_child_by_ns(XMPPStanza *stanza, char *ns);
 XMPPStanza* stanza_get_child_by_name(XMPPStanza *stanza, char *name);
@@ -27,87 +27,351 @@
 #include <fnmatch.h>
 
 #include "server/stanza.h"
+#include "server/stanzas.h"
 #include "server/log.h"
+#include "server/lockstats.h"
+#include "server/rule.h"
+#include "server/coldstore.h"
 
-pthread_mutex_t stanzas_lock;
-static GList *stanzas;
+typedef struct stanza_entry_t {
+    long seq;
+    gint64 timestamp;
+    size_t bytes;
+    XMPPStanza *stanza;
+    char *text;
+} StanzaEntry;
+
+StbbrMutex stanzas_lock = STBBR_MUTEX_INIT("stanzas_lock");
+static GQueue stanzas = G_QUEUE_INIT;
+static long last_seq = 0;
+static stanzas_listener_func listener = NULL;
+
+// the history is unbounded unless a limit is set, bytes are an estimate of
+// the memory the parsed stanzas hold
+static stbbr_history_t limit = { 0, 0, STBBR_HISTORY_OLDEST, 0 };
+static size_t history_bytes = 0;
+static long evicted = 0;
+static long bodies_dropped = 0;
+
+// watched stanzas are evicted only once no other stanza is left, the scan
+// is the last entry already passed over, NULL to start from the oldest
+static GHashTable *watches = NULL;
+static RuleIndex *watch_index = NULL;
+static GList *scan = NULL;
+
+// older stanzas are serialised into compressed blocks once there are more
+// than the hot window, oldest block first
+static GQueue cold = G_QUEUE_INIT;
+static int cold_count = 0;
+static size_t cold_bytes = 0;
+
+typedef struct cold_search_t {
+    XMPPStanza *stanza;
+    const char *id;
+    long seq;
+    int max;
+    int count;
+    GList *events;
+    long match;
+} ColdSearch;
+
+typedef struct cold_order_t {
+    GList *next;
+    long last;
+    int count;
+} ColdOrder;
 
 static int _xmpp_attr_equal(XMPPAttr *attr1, XMPPAttr *attr2);
 static int _stanzas_equal(XMPPStanza *first, XMPPStanza *second);
+static void _entry_free(StanzaEntry *entry);
+static size_t _stanza_size(XMPPStanza *stanza);
+static gboolean _over_limit(void);
+static void _enforce_limit(void);
+static void _evict(GList *link);
+static GList* _next_unwatched(void);
+static GList* _next_with_body(void);
+static void _unlink(GList *link);
+static GList* _first_after(long seq);
+static void _evict_oldest(void);
+static void _freeze(void);
+static gboolean _cold_id_cb(long seq, gint64 timestamp, const char *text, void *userdata);
+static gboolean _cold_match_cb(long seq, gint64 timestamp, const char *text, void *userdata);
+static gboolean _cold_since_cb(long seq, gint64 timestamp, const char *text, void *userdata);
+static gboolean _cold_order_cb(long seq, gint64 timestamp, const char *text, void *userdata);
 
 int
 stanzas_contains_id(char *id)
 {
-    pthread_mutex_lock(&stanzas_lock);
-    GList *curr = stanzas;
+    lockstats_lock(&stanzas_lock);
+    GList *curr = stanzas.head;
     while (curr) {
-        XMPPStanza *stanza = curr->data;
+        XMPPStanza *stanza = ((StanzaEntry *)curr->data)->stanza;
         GList *curr_attr = stanza->attrs;
         while (curr_attr) {
             XMPPAttr *attr = curr_attr->data;
             if (g_strcmp0(attr->name, "id") == 0 && fnmatch(id, attr->value, 0) == 0) {
-                pthread_mutex_unlock(&stanzas_lock);
+                lockstats_unlock(&stanzas_lock);
                 return 1;
             }
             curr_attr = g_list_next(curr_attr);
         }
         curr = g_list_next(curr);
     }
-    pthread_mutex_unlock(&stanzas_lock);
 
-    return 0;
+    ColdSearch search = { NULL, id, 0, 0, 0, NULL, 0 };
+    curr = cold.tail;
+    while (curr && !search.match) {
+        if (coldstore_block_may_contain_id(curr->data, id)) {
+            coldstore_block_foreach(curr->data, _cold_id_cb, &search);
+        }
+        curr = g_list_previous(curr);
+    }
+    lockstats_unlock(&stanzas_lock);
+
+    return search.match ? 1 : 0;
+}
+
+// text is the stanza as it was received, when it is not known the stanza
+// is serialised
+void
+stanzas_add(XMPPStanza *stanza, const char *text, size_t len)
+{
+    StanzaEntry *entry = malloc(sizeof(StanzaEntry));
+    entry->timestamp = g_get_real_time();
+    entry->stanza = stanza;
+    entry->text = text ? g_strndup(text, len) : stanza_to_string(stanza);
+    entry->bytes = sizeof(StanzaEntry) + sizeof(GList) + _stanza_size(stanza) + strlen(entry->text) + 1;
+
+    lockstats_lock(&stanzas_lock);
+    entry->seq = ++last_seq;
+    g_queue_push_tail(&stanzas, entry);
+    history_bytes += entry->bytes;
+    _freeze();
+    _enforce_limit();
+    stanzas_listener_func notify = listener;
+    lockstats_unlock(&stanzas_lock);
+
+    if (notify) {
+        notify();
+    }
 }
 
 void
-stanzas_add(XMPPStanza *stanza)
+stanzas_set_listener(stanzas_listener_func func)
+{
+    lockstats_lock(&stanzas_lock);
+    listener = func;
+    lockstats_unlock(&stanzas_lock);
+}
+
+long
+stanzas_last_seq(void)
+{
+    lockstats_lock(&stanzas_lock);
+    long seq = last_seq;
+    lockstats_unlock(&stanzas_lock);
+
+    return seq;
+}
+
+GList*
+stanzas_since(long seq, int max)
+{
+    lockstats_lock(&stanzas_lock);
+
+    // older stanzas come out of cold storage first
+    ColdSearch search = { NULL, NULL, seq, max, 0, NULL, 0 };
+    GList *curr_block = cold.head;
+    while (curr_block && search.count < max) {
+        if (coldstore_block_last_seq(curr_block->data) > seq) {
+            coldstore_block_foreach(curr_block->data, _cold_since_cb, &search);
+        }
+        curr_block = g_list_next(curr_block);
+    }
+    GList *events = search.events;
+
+    GList *curr = _first_after(seq);
+    int count = search.count;
+    while (curr && count < max) {
+        StanzaEntry *entry = curr->data;
+        StanzaEvent *event = malloc(sizeof(StanzaEvent));
+        event->seq = entry->seq;
+        event->timestamp = entry->timestamp;
+        event->text = strdup(entry->text);
+        events = g_list_prepend(events, event);
+        count++;
+        curr = g_list_next(curr);
+    }
+
+    lockstats_unlock(&stanzas_lock);
+
+    return g_list_reverse(events);
+}
+
+void
+stanzas_event_free(StanzaEvent *event)
+{
+    if (!event) {
+        return;
+    }
+
+    free(event->text);
+    free(event);
+}
+
+// the oldest stanza after seq that equals the template, so the cost depends
+// only on what arrived since, 0 if there is none
+long
+stanzas_find(XMPPStanza *stanza, long after)
+{
+    lockstats_lock(&stanzas_lock);
+    ColdSearch search = { stanza, NULL, after, 0, 0, NULL, 0 };
+    GList *curr = cold.head;
+    while (curr && !search.match) {
+        if (coldstore_block_last_seq(curr->data) > after && coldstore_block_may_match(curr->data, stanza)) {
+            coldstore_block_foreach(curr->data, _cold_match_cb, &search);
+        }
+        curr = g_list_next(curr);
+    }
+
+    curr = search.match ? NULL : _first_after(after);
+    while (curr) {
+        StanzaEntry *entry = curr->data;
+        if (_stanzas_equal(stanza, entry->stanza) == 0) {
+            search.match = entry->seq;
+            break;
+        }
+        curr = g_list_next(curr);
+    }
+    lockstats_unlock(&stanzas_lock);
+
+    return search.match;
+}
+
+long
+stanzas_find_id(const char *id, long after)
+{
+    lockstats_lock(&stanzas_lock);
+    ColdSearch search = { NULL, id, after, 0, 0, NULL, 0 };
+    GList *curr = cold.head;
+    while (curr && !search.match) {
+        if (coldstore_block_last_seq(curr->data) > after && coldstore_block_may_contain_id(curr->data, id)) {
+            coldstore_block_foreach(curr->data, _cold_id_cb, &search);
+        }
+        curr = g_list_next(curr);
+    }
+
+    curr = search.match ? NULL : _first_after(after);
+    while (curr) {
+        StanzaEntry *entry = curr->data;
+        const char *entry_id = stanza_get_id(entry->stanza);
+        if (entry_id && fnmatch(id, entry_id, 0) == 0) {
+            search.match = entry->seq;
+            break;
+        }
+        curr = g_list_next(curr);
+    }
+    lockstats_unlock(&stanzas_lock);
+
+    return search.match;
+}
+
+// the last stanza, when it arrived after seq and equals the template
+long
+stanzas_find_last(XMPPStanza *stanza, long after)
 {
-    pthread_mutex_lock(&stanzas_lock);
-    stanzas = g_list_append(stanzas, stanza);
-    pthread_mutex_unlock(&stanzas_lock);
+    lockstats_lock(&stanzas_lock);
+    StanzaEntry *last = stanzas.tail ? stanzas.tail->data : NULL;
+    long match = 0;
+    if (last && last->seq > after && _stanzas_equal(stanza, last->stanza) == 0) {
+        match = last->seq;
+    }
+    lockstats_unlock(&stanzas_lock);
+
+    return match;
 }
 
+// matches the templates as a subsequence of the stanzas after seq in one
+// forward pass, other stanzas may come between them, returns how many
+// matched and sets last to the seq of the last match
 int
-stanzas_verify_any(XMPPStanza *stanza)
+stanzas_find_in_order(GList *templates, long after, long *last)
 {
-    pthread_mutex_lock(&stanzas_lock);
-    if (!stanzas) {
-        pthread_mutex_unlock(&stanzas_lock);
-        return 0;
+    ColdOrder order = { templates, after, 0 };
+
+    lockstats_lock(&stanzas_lock);
+    GList *curr = cold.head;
+    while (curr && order.next) {
+        // a block that cannot hold the next template cannot move the match on
+        if (coldstore_block_last_seq(curr->data) > order.last && coldstore_block_may_match(curr->data, order.next->data)) {
+            coldstore_block_foreach(curr->data, _cold_order_cb, &order);
+        }
+        curr = g_list_next(curr);
+    }
+
+    curr = order.next ? _first_after(order.last) : NULL;
+    while (curr && order.next) {
+        StanzaEntry *entry = curr->data;
+        if (_stanzas_equal(order.next->data, entry->stanza) == 0) {
+            order.next = g_list_next(order.next);
+            order.last = entry->seq;
+            order.count++;
+        }
+        curr = g_list_next(curr);
     }
+    lockstats_unlock(&stanzas_lock);
+
+    *last = order.last;
+    return order.count;
+}
+
+int
+stanzas_equal(XMPPStanza *first, XMPPStanza *second)
+{
+    return _stanzas_equal(first, second);
+}
 
-    GList *curr = g_list_last(stanzas);
+int
+stanzas_verify_any(XMPPStanza *stanza)
+{
+    lockstats_lock(&stanzas_lock);
+    GList *curr = stanzas.tail;
     while (curr) {
-        XMPPStanza *curr_stanza = curr->data;
+        XMPPStanza *curr_stanza = ((StanzaEntry *)curr->data)->stanza;
         if (_stanzas_equal(stanza, curr_stanza) == 0) {
-            pthread_mutex_unlock(&stanzas_lock);
+            lockstats_unlock(&stanzas_lock);
             return 1;
         }
 
         curr = g_list_previous(curr);
     }
 
-    pthread_mutex_unlock(&stanzas_lock);
-    return 0;
+    ColdSearch search = { stanza, NULL, 0, 0, 0, NULL, 0 };
+    curr = cold.tail;
+    while (curr && !search.match) {
+        if (coldstore_block_may_match(curr->data, stanza)) {
+            coldstore_block_foreach(curr->data, _cold_match_cb, &search);
+        }
+        curr = g_list_previous(curr);
+    }
+
+    lockstats_unlock(&stanzas_lock);
+    return search.match ? 1 : 0;
 }
 
 int
 stanzas_verify_last(XMPPStanza *stanza)
 {
-    pthread_mutex_lock(&stanzas_lock);
-    if (!stanzas) {
-        pthread_mutex_unlock(&stanzas_lock);
-        return 0;
-    }
-
-    GList *last = g_list_last(stanzas);
+    lockstats_lock(&stanzas_lock);
+    GList *last = stanzas.tail;
     if (!last) {
-        pthread_mutex_unlock(&stanzas_lock);
+        lockstats_unlock(&stanzas_lock);
         return 0;
     }
 
-    XMPPStanza *last_stanza = (XMPPStanza *)last->data;
+    XMPPStanza *last_stanza = ((StanzaEntry *)last->data)->stanza;
     int res = _stanzas_equal(stanza, last_stanza);
-    pthread_mutex_unlock(&stanzas_lock);
+    lockstats_unlock(&stanzas_lock);
     if (res == 0) {
         return 1;
     } else {
@@ -115,13 +379,368 @@ stanzas_verify_last(XMPPStanza *stanza)
     }
 }
 
+// NULL removes the limit, a lower limit applies straight away
+void
+stanzas_set_limit(stbbr_history_t *history)
+{
+    lockstats_lock(&stanzas_lock);
+    if (history) {
+        memcpy(&limit, history, sizeof(stbbr_history_t));
+    } else {
+        memset(&limit, 0, sizeof(stbbr_history_t));
+    }
+    scan = NULL;
+    _enforce_limit();
+    lockstats_unlock(&stanzas_lock);
+}
+
+// a template as for rules, 0 if it is not a valid element
+int
+stanzas_watch(const char *pattern)
+{
+    XMPPStanza *stanza = stanza_parse((char *)pattern);
+    if (!stanza) {
+        return 0;
+    }
+    char *key = stanza_to_string(stanza);
+    stanza_free(stanza);
+
+    lockstats_lock(&stanzas_lock);
+    if (!watches) {
+        watches = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    }
+    g_hash_table_replace(watches, key, GINT_TO_POINTER(1));
+    rule_index_unref(watch_index);
+    watch_index = rule_index_new(watches);
+    scan = NULL;
+    lockstats_unlock(&stanzas_lock);
+
+    return 1;
+}
+
+void
+stanzas_stats(stbbr_history_stats_t *stats)
+{
+    lockstats_lock(&stanzas_lock);
+    stats->stanzas = stanzas.length + cold_count;
+    stats->bytes = history_bytes + cold_bytes;
+    stats->evicted = evicted;
+    stats->bodies_dropped = bodies_dropped;
+    stats->cold_stanzas = cold_count;
+    stats->cold_bytes = cold_bytes;
+    lockstats_unlock(&stanzas_lock);
+}
+
+void
+stanzas_metrics(GString *metrics)
+{
+    stbbr_history_stats_t stats;
+    stanzas_stats(&stats);
+
+    g_string_append_printf(metrics, "stabber_history_stanzas %d\n", stats.stanzas);
+    g_string_append_printf(metrics, "stabber_history_bytes %ld\n", stats.bytes);
+    g_string_append_printf(metrics, "stabber_history_evicted_total %ld\n", stats.evicted);
+    g_string_append_printf(metrics, "stabber_history_bodies_dropped_total %ld\n", stats.bodies_dropped);
+    g_string_append_printf(metrics, "stabber_history_cold_stanzas %d\n", stats.cold_stanzas);
+    g_string_append_printf(metrics, "stabber_history_cold_bytes %ld\n", stats.cold_bytes);
+}
+
 void
 stanzas_free_all(void)
 {
-    pthread_mutex_lock(&stanzas_lock);
-    g_list_free_full(stanzas, (GDestroyNotify)stanza_free);
-    stanzas = NULL;
-    pthread_mutex_unlock(&stanzas_lock);
+    lockstats_lock(&stanzas_lock);
+    g_list_free_full(stanzas.head, (GDestroyNotify)_entry_free);
+    g_queue_init(&stanzas);
+    g_list_free_full(cold.head, (GDestroyNotify)coldstore_block_free);
+    g_queue_init(&cold);
+    cold_count = 0;
+    cold_bytes = 0;
+    history_bytes = 0;
+    evicted = 0;
+    bodies_dropped = 0;
+    scan = NULL;
+    memset(&limit, 0, sizeof(stbbr_history_t));
+    if (watches) {
+        g_hash_table_destroy(watches);
+        watches = NULL;
+    }
+    rule_index_unref(watch_index);
+    watch_index = NULL;
+    lockstats_unlock(&stanzas_lock);
+}
+
+static void
+_entry_free(StanzaEntry *entry)
+{
+    if (!entry) {
+        return;
+    }
+
+    stanza_free(entry->stanza);
+    g_free(entry->text);
+    free(entry);
+}
+
+// roughly what the parsed tree holds on the heap
+static size_t
+_stanza_size(XMPPStanza *stanza)
+{
+    size_t size = sizeof(XMPPStanza) + strlen(stanza->name) + 1;
+    if (stanza->content) {
+        size += sizeof(GString) + stanza->content->allocated_len;
+    }
+
+    GList *curr = stanza->attrs;
+    while (curr) {
+        XMPPAttr *attr = curr->data;
+        size += sizeof(GList) + sizeof(XMPPAttr) + strlen(attr->name) + strlen(attr->value) + 2;
+        curr = g_list_next(curr);
+    }
+
+    curr = stanza->children;
+    while (curr) {
+        size += sizeof(GList) + _stanza_size(curr->data);
+        curr = g_list_next(curr);
+    }
+
+    return size;
+}
+
+static gboolean
+_over_limit(void)
+{
+    if (limit.max_stanzas > 0 && (int)stanzas.length + cold_count > limit.max_stanzas) {
+        return TRUE;
+    }
+    if (limit.max_bytes > 0 && history_bytes + cold_bytes > (size_t)limit.max_bytes) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// the policy picks what goes first, the oldest stanzas go when it has
+// nothing left to give up, the newest stanza is always kept
+static void
+_enforce_limit(void)
+{
+    while (_over_limit() && (stanzas.length > 1 || cold.length > 0)) {
+        GList *link = NULL;
+        if (limit.policy == STBBR_HISTORY_WATCHED) {
+            link = _next_unwatched();
+            if (link) {
+                _evict(link);
+                continue;
+            }
+        } else if (limit.policy == STBBR_HISTORY_BODIES && limit.max_bytes > 0
+                && history_bytes + cold_bytes > (size_t)limit.max_bytes) {
+            link = _next_with_body();
+            if (link) {
+                StanzaEntry *entry = link->data;
+                XMPPStanza *body = NULL;
+                while ((body = stanza_get_child_by_name(entry->stanza, "body"))) {
+                    entry->stanza->children = g_list_remove(entry->stanza->children, body);
+                    stanza_free(body);
+                }
+                // the received text still holds the bodies
+                g_free(entry->text);
+                entry->text = stanza_to_string(entry->stanza);
+                size_t bytes = sizeof(StanzaEntry) + sizeof(GList) + _stanza_size(entry->stanza) + strlen(entry->text) + 1;
+                history_bytes -= entry->bytes - bytes;
+                entry->bytes = bytes;
+                bodies_dropped++;
+                continue;
+            }
+        }
+        _evict_oldest();
+    }
+}
+
+static void
+_evict(GList *link)
+{
+    evicted++;
+    _unlink(link);
+}
+
+// cold stanzas go a block at a time
+static void
+_evict_oldest(void)
+{
+    ColdBlock *block = g_queue_pop_head(&cold);
+    if (!block) {
+        _evict(stanzas.head);
+        return;
+    }
+
+    evicted += coldstore_block_count(block);
+    cold_count -= coldstore_block_count(block);
+    cold_bytes -= coldstore_block_bytes(block);
+    coldstore_block_free(block);
+}
+
+static void
+_unlink(GList *link)
+{
+    if (link == scan) {
+        scan = g_list_previous(scan);
+    }
+
+    StanzaEntry *entry = link->data;
+    history_bytes -= entry->bytes;
+    g_queue_delete_link(&stanzas, link);
+    _entry_free(entry);
+}
+
+// walks back from the newest, NULL when nothing in the hot window is newer
+static GList*
+_first_after(long seq)
+{
+    GList *curr = stanzas.tail;
+    GList *first = NULL;
+    while (curr && ((StanzaEntry *)curr->data)->seq > seq) {
+        first = curr;
+        curr = g_list_previous(curr);
+    }
+
+    return first;
+}
+
+// a block's worth of the oldest stanzas is moved out of the hot window
+static void
+_freeze(void)
+{
+    if (limit.hot_stanzas <= 0 || (int)stanzas.length < limit.hot_stanzas + COLD_BLOCK_STANZAS) {
+        return;
+    }
+
+    ColdBlock *block = coldstore_block_new();
+    int i;
+    for (i = 0; i < COLD_BLOCK_STANZAS; i++) {
+        StanzaEntry *entry = stanzas.head->data;
+        coldstore_block_add(block, entry->seq, entry->timestamp, entry->stanza, entry->text);
+        _unlink(stanzas.head);
+    }
+    coldstore_block_seal(block);
+
+    g_queue_push_tail(&cold, block);
+    cold_count += coldstore_block_count(block);
+    cold_bytes += coldstore_block_bytes(block);
+}
+
+// only stanzas after search->seq are compared
+static gboolean
+_cold_id_cb(long seq, gint64 timestamp, const char *text, void *userdata)
+{
+    ColdSearch *search = userdata;
+    if (seq <= search->seq) {
+        return TRUE;
+    }
+    XMPPStanza *stanza = stanza_parse((char *)text);
+    if (!stanza) {
+        return TRUE;
+    }
+
+    const char *id = stanza_get_id(stanza);
+    if (id && fnmatch(search->id, id, 0) == 0) {
+        search->match = seq;
+    }
+    stanza_free(stanza);
+
+    return !search->match;
+}
+
+static gboolean
+_cold_match_cb(long seq, gint64 timestamp, const char *text, void *userdata)
+{
+    ColdSearch *search = userdata;
+    if (seq <= search->seq) {
+        return TRUE;
+    }
+    XMPPStanza *stanza = stanza_parse((char *)text);
+    if (!stanza) {
+        return TRUE;
+    }
+
+    if (_stanzas_equal(search->stanza, stanza) == 0) {
+        search->match = seq;
+    }
+    stanza_free(stanza);
+
+    return !search->match;
+}
+
+static gboolean
+_cold_since_cb(long seq, gint64 timestamp, const char *text, void *userdata)
+{
+    ColdSearch *search = userdata;
+    if (seq <= search->seq) {
+        return TRUE;
+    }
+
+    StanzaEvent *event = malloc(sizeof(StanzaEvent));
+    event->seq = seq;
+    event->timestamp = timestamp;
+    event->text = strdup(text);
+    search->events = g_list_prepend(search->events, event);
+    search->count++;
+
+    return search->count < search->max;
+}
+
+static gboolean
+_cold_order_cb(long seq, gint64 timestamp, const char *text, void *userdata)
+{
+    ColdOrder *order = userdata;
+    if (seq <= order->last) {
+        return TRUE;
+    }
+    XMPPStanza *stanza = stanza_parse((char *)text);
+    if (!stanza) {
+        return TRUE;
+    }
+
+    if (_stanzas_equal(order->next->data, stanza) == 0) {
+        order->next = g_list_next(order->next);
+        order->last = seq;
+        order->count++;
+    }
+    stanza_free(stanza);
+
+    return order->next != NULL;
+}
+
+// the newest stanza is never returned
+static GList*
+_next_unwatched(void)
+{
+    GList *curr = scan ? g_list_next(scan) : stanzas.head;
+    while (curr && curr != stanzas.tail) {
+        if (!rule_index_match(watch_index, ((StanzaEntry *)curr->data)->stanza)) {
+            return curr;
+        }
+        scan = curr;
+        curr = g_list_next(curr);
+    }
+
+    return NULL;
+}
+
+// the oldest message still holding a body, the newest stanza is never returned
+static GList*
+_next_with_body(void)
+{
+    GList *curr = scan ? g_list_next(scan) : stanzas.head;
+    while (curr && curr != stanzas.tail) {
+        XMPPStanza *stanza = ((StanzaEntry *)curr->data)->stanza;
+        scan = curr;
+        if (g_strcmp0(stanza->name, "message") == 0 && stanza_get_child_by_name(stanza, "body")) {
+            return curr;
+        }
+        curr = g_list_next(curr);
+    }
+
+    return NULL;
 }
 
 static int
@@ -25,15 +25,40 @@
 
 #include <glib.h>
 
+#include "stabber.h"
 #include "server/stanza.h"
 
-void stanzas_add(XMPPStanza *stanza);
+typedef struct stanza_event_t {
+    long seq;
+    gint64 timestamp;
+    char *text;
+} StanzaEvent;
 
+typedef void (*stanzas_listener_func)(void);
+
+void stanzas_add(XMPPStanza *stanza, const char *text, size_t len);
+void stanzas_set_listener(stanzas_listener_func func);
+
+long stanzas_last_seq(void);
+GList* stanzas_since(long seq, int max);
+void stanzas_event_free(StanzaEvent *event);
+
+int stanzas_equal(XMPPStanza *first, XMPPStanza *second);
 int stanzas_verify_any(XMPPStanza *stanza);
 int stanzas_verify_last(XMPPStanza *stanza);
 
 int stanzas_contains_id(char *id);
 
+long stanzas_find(XMPPStanza *stanza, long after);
+long stanzas_find_id(const char *id, long after);
+long stanzas_find_last(XMPPStanza *stanza, long after);
+int stanzas_find_in_order(GList *templates, long after, long *last);
+
+void stanzas_set_limit(stbbr_history_t *history);
+int stanzas_watch(const char *pattern);
+void stanzas_stats(stbbr_history_stats_t *stats);
+void stanzas_metrics(GString *metrics);
+
 void stanzas_free_all(void);
 
 #endif
@@ -29,6 +29,8 @@
 #include "server/stanza.h"
 #include "server/stanzas.h"
 #include "server/log.h"
+#include "server/rtt.h"
+#include "server/trace.h"
 
 static int depth = 0;
 static int do_reset = 0;
@@ -37,17 +39,22 @@ static XML_Parser parser;
 static XMPPStanza *curr_stanza;
 static GString *curr_string = NULL;
 
+// where the top level element starts in curr_string, and where its start tag ends
+static XML_Index stanza_start = 0;
+static XML_Index stanza_tag_end = 0;
+
 static stream_start_func stream_start_cb = NULL;
 static auth_func auth_cb = NULL;
 static id_func id_cb = NULL;
 static query_func query_cb = NULL;
+static rule_func rule_cb = NULL;
 
 static void _start_element(void *data, const char *element, const char **attributes);
 static void _end_element(void *data, const char *element);
 static void _handle_data(void *data, const char *content, int length);
 
 void
-parser_init(stream_start_func startcb, auth_func authcb, id_func idcb, query_func querycb)
+parser_init(stream_start_func startcb, auth_func authcb, id_func idcb, query_func querycb, rule_func rulecb)
 {
     if (curr_string) {
         g_string_free(curr_string, TRUE);
@@ -58,6 +65,7 @@ parser_init(stream_start_func startcb, auth_func authcb, id_func idcb, query_fun
     auth_cb = authcb;
     id_cb = idcb;
     query_cb = querycb;
+    rule_cb = rulecb;
 
     parser = XML_ParserCreate(NULL);
     XML_SetElementHandler(parser, _start_element, _end_element);
@@ -89,7 +97,7 @@ parser_reset(void)
     }
 
     parser_close();
-    parser_init(stream_start_cb, auth_cb, id_cb, query_cb);
+    parser_init(stream_start_cb, auth_cb, id_cb, query_cb, rule_cb);
     do_reset = 0;
 }
 
@@ -98,7 +106,9 @@ _start_element(void *data, const char *element, const char **attributes)
 {
     if (g_strcmp0(element, "stream:stream") == 0) {
         log_println(STBBR_LOGINFO, "RECV: %s", curr_string->str);
+        trace_recv(curr_string->str, curr_string->len);
         stream_start_cb();
+        trace_recv_done();
         do_reset = 1;
         return;
     }
@@ -108,6 +118,8 @@ _start_element(void *data, const char *element, const char **attributes)
     if (depth == 0) {
         curr_stanza = stanza;
         curr_stanza->parent = NULL;
+        stanza_start = XML_GetCurrentByteIndex(parser);
+        stanza_tag_end = stanza_start + XML_GetCurrentByteCount(parser);
     } else {
         stanza->parent = curr_stanza;
         curr_stanza = stanza;
@@ -127,19 +139,39 @@ _end_element(void *data, const char *element)
     }
 
     log_println(STBBR_LOGINFO, "RECV: %s", curr_string->str);
-    stanzas_add(curr_stanza);
+    trace_recv(curr_string->str, curr_string->len);
+
+    // the history keeps the bytes as received, the end of an empty element
+    // tag is reported with no bytes of its own
+    XML_Index stanza_end = XML_GetCurrentByteIndex(parser) + XML_GetCurrentByteCount(parser);
+    if (XML_GetCurrentByteCount(parser) == 0) {
+        stanza_end = stanza_tag_end;
+    }
+    if (stanza_start >= 0 && stanza_start < stanza_end && stanza_end <= (XML_Index)curr_string->len) {
+        stanzas_add(curr_stanza, curr_string->str + stanza_start, stanza_end - stanza_start);
+    } else {
+        stanzas_add(curr_stanza, NULL, 0);
+    }
+    rtt_received(curr_stanza);
     if (stanza_get_child_by_ns(curr_stanza, "jabber:iq:auth")) {
         auth_cb(curr_stanza);
     } else {
+        int handled = 0;
         const char *id = stanza_get_id(curr_stanza);
-        if (id) {
-            id_cb(id);
+        if (id && id_cb(id)) {
+            handled = 1;
         }
         const char *query = stanza_get_query_request(curr_stanza);
-        if (query) {
-            query_cb(query, id);
+        if (query && query_cb(query, id)) {
+            handled = 1;
+        }
+
+        // rules only answer what no id or query stub did
+        if (!handled) {
+            rule_cb(curr_stanza);
         }
     }
+    trace_recv_done();
 
     do_reset = 1;
 }
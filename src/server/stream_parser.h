@@ -27,10 +27,11 @@
 
 typedef void (*stream_start_func)(void);
 typedef void (*auth_func)(XMPPStanza *stanza);
-typedef void (*id_func)(const char *id);
-typedef void (*query_func)(const char *query, const char *id);
+typedef int (*id_func)(const char *id);
+typedef int (*query_func)(const char *query, const char *id);
+typedef int (*rule_func)(XMPPStanza *stanza);
 
-void parser_init(stream_start_func startcb, auth_func authcb, id_func idcb, query_func querycb);
+void parser_init(stream_start_func startcb, auth_func authcb, id_func idcb, query_func querycb, rule_func rulecb);
 int parser_feed(char *chunk, int len);
 void parser_close(void);
 void parser_reset(void);
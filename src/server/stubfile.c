@@ -0,0 +1,472 @@
+/*
+ * stubfile.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef PLATFORM_NIX
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#endif
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/prime.h"
+#include "server/lockstats.h"
+#include "server/stubfile.h"
+
+// guards the stubs each loaded file defined, a changed file replaces its own
+// stubs and leaves the rest of the prime tables alone
+StbbrMutex stubfile_lock = STBBR_MUTEX_INIT("stubfile_lock");
+
+static GHashTable *loaded = NULL;
+static char *stubs_dir = NULL;
+static char *stubs_file = NULL;
+
+#ifdef PLATFORM_NIX
+static int inotify_fd = -1;
+static pthread_t watch_thread;
+static gboolean watching = FALSE;
+#endif
+
+static int _reload(GList *paths);
+static GBytes* _parse(const char *path, GList **stubs);
+static int _header(char *line, char *line_end, StubDef *stub);
+static gboolean _blank(const char *text);
+static GList* _keys(GList *stubs);
+static void _key_free(StubDef *key);
+static void _keys_free(GList *keys);
+static gboolean _skip(const char *name);
+#ifdef PLATFORM_NIX
+static void _watch_start(void);
+static void _watch_stop(void);
+static void* _watch_cb(void *userdata);
+#endif
+
+int
+stubfile_load(const char *path)
+{
+    GList *paths = NULL;
+    char *dir = NULL;
+    char *file = NULL;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir *gdir = g_dir_open(path, 0, NULL);
+        if (!gdir) {
+            log_println(STBBR_LOGERROR, "Could not open stub directory: %s", path);
+            return -1;
+        }
+        const char *name;
+        while ((name = g_dir_read_name(gdir))) {
+            if (!_skip(name)) {
+                paths = g_list_prepend(paths, g_build_filename(path, name, NULL));
+            }
+        }
+        g_dir_close(gdir);
+        paths = g_list_sort(paths, (GCompareFunc)g_strcmp0);
+        dir = g_strdup(path);
+    } else if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        // keyed as the watcher builds the path of a changed file
+        dir = g_path_get_dirname(path);
+        file = g_path_get_basename(path);
+        paths = g_list_append(paths, g_build_filename(dir, file, NULL));
+    } else {
+        log_println(STBBR_LOGERROR, "No stub file or directory: %s", path);
+        return -1;
+    }
+
+#ifdef PLATFORM_NIX
+    _watch_stop();
+#endif
+
+    lockstats_lock(&stubfile_lock);
+    if (!loaded) {
+        loaded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_keys_free);
+    }
+    g_free(stubs_dir);
+    stubs_dir = dir;
+    g_free(stubs_file);
+    stubs_file = file;
+    int count = _reload(paths);
+    lockstats_unlock(&stubfile_lock);
+
+    g_list_free_full(paths, g_free);
+
+#ifdef PLATFORM_NIX
+    _watch_start();
+#endif
+
+    return count;
+}
+
+void
+stubfile_stop(void)
+{
+#ifdef PLATFORM_NIX
+    _watch_stop();
+#endif
+
+    lockstats_lock(&stubfile_lock);
+    if (loaded) {
+        g_hash_table_destroy(loaded);
+        loaded = NULL;
+    }
+    g_free(stubs_dir);
+    stubs_dir = NULL;
+    g_free(stubs_file);
+    stubs_file = NULL;
+    lockstats_unlock(&stubfile_lock);
+}
+
+// must be called holding stubfile_lock, the stubs a file defined before are
+// removed in the same snapshot its new ones are added, a missing file only
+// removes them
+static int
+_reload(GList *paths)
+{
+    GList *removed = NULL;
+    GList *stubs = NULL;
+    GList *sources = NULL;
+    GHashTable *updated = g_hash_table_new(g_str_hash, g_str_equal);
+
+    GList *curr = paths;
+    while (curr) {
+        const char *path = curr->data;
+        removed = g_list_concat(removed, g_list_copy(g_hash_table_lookup(loaded, path)));
+
+        GList *file_stubs = NULL;
+        GBytes *source = _parse(path, &file_stubs);
+        if (source) {
+            sources = g_list_prepend(sources, source);
+            log_println(STBBR_LOGINFO, "Loaded %d stubs from %s", g_list_length(file_stubs), path);
+        } else {
+            log_println(STBBR_LOGINFO, "Unloaded stubs from %s", path);
+        }
+        g_hash_table_insert(updated, (gpointer)path, _keys(file_stubs));
+        stubs = g_list_concat(stubs, file_stubs);
+
+        curr = g_list_next(curr);
+    }
+
+    prime_update(removed, stubs);
+    int count = g_list_length(stubs);
+
+    // the old keys go only once the snapshot no longer needs them
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, updated);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (value) {
+            g_hash_table_replace(loaded, g_strdup(key), value);
+        } else {
+            g_hash_table_remove(loaded, key);
+        }
+    }
+    g_hash_table_destroy(updated);
+
+    // replies hold their own references to the file contents
+    g_list_free_full(sources, (GDestroyNotify)g_bytes_unref);
+    g_list_free_full(stubs, free);
+    g_list_free(removed);
+
+    return count;
+}
+
+// the file is read into memory and each header and stanza is cut into a
+// string in place, id stubs are replied to straight from that copy, a mapping
+// would fault if the file was rewritten in place while stubs point into it
+static GBytes*
+_parse(const char *path, GList **stubs)
+{
+    if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        return NULL;
+    }
+
+    GError *error = NULL;
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        log_println(STBBR_LOGERROR, "Could not load stub file %s: %s", path, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    // the contents end with a NUL that the length does not count
+    GBytes *source = g_bytes_new_take(contents, length + 1);
+    char *end = contents + length;
+    GList *found = NULL;
+    StubDef *last = NULL;
+    char *line = contents;
+    while (contents && line < end) {
+        char *line_end = memchr(line, '\n', end - line);
+        if (!line_end) {
+            break;
+        }
+
+        StubDef *stub = malloc(sizeof(StubDef));
+        stub->id = NULL;
+        stub->query = NULL;
+        stub->rule = NULL;
+        stub->next = 0;
+        stub->source = source;
+        if (*line == '@' && _header(line, line_end, stub)) {
+            // the newline before a header ends the previous stub's stanzas
+            if (line > contents) {
+                line[-1] = '\0';
+            }
+            stub->stream = line_end + 1;
+            found = g_list_prepend(found, stub);
+            last = stub;
+        } else {
+            free(stub);
+        }
+
+        line = line_end + 1;
+    }
+
+    // a file without a final newline already ends its last stanza
+    if (last && last->stream < end && end[-1] == '\n') {
+        end[-1] = '\0';
+    }
+
+    // a key seen earlier in the file adds to its sequence
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    found = g_list_reverse(found);
+    GList *curr = found;
+    while (curr) {
+        StubDef *stub = curr->data;
+        if (_blank(stub->stream)) {
+            log_println(STBBR_LOGWARN, "Skipping empty stub in %s: %s", path,
+                stub->id ? stub->id : stub->query ? stub->query : stub->rule);
+            free(stub);
+        } else {
+            char *key = g_strconcat(stub->id ? "i" : stub->query ? "q" : "r",
+                stub->id ? stub->id : stub->query ? stub->query : stub->rule, NULL);
+            if (g_hash_table_contains(seen, key)) {
+                stub->next = 1;
+                g_free(key);
+            } else {
+                g_hash_table_add(seen, key);
+            }
+            *stubs = g_list_append(*stubs, stub);
+        }
+        curr = g_list_next(curr);
+    }
+    g_hash_table_destroy(seen);
+    g_list_free(found);
+
+    return source;
+}
+
+// line_end is the line's newline, the key is terminated in place
+static int
+_header(char *line, char *line_end, StubDef *stub)
+{
+    char *key;
+    char **field;
+    if (strncmp(line, "@id ", 4) == 0) {
+        key = line + 4;
+        field = &stub->id;
+    } else if (strncmp(line, "@query ", 7) == 0) {
+        key = line + 7;
+        field = &stub->query;
+    } else if (strncmp(line, "@rule ", 6) == 0) {
+        key = line + 6;
+        field = &stub->rule;
+    } else {
+        return 0;
+    }
+
+    while (key < line_end && (*key == ' ' || *key == '\t')) {
+        key++;
+    }
+    char *key_end = line_end;
+    while (key_end > key && (key_end[-1] == ' ' || key_end[-1] == '\t' || key_end[-1] == '\r')) {
+        key_end--;
+    }
+    if (key_end == key) {
+        return 0;
+    }
+
+    *key_end = '\0';
+    *field = key;
+
+    return 1;
+}
+
+static gboolean
+_blank(const char *text)
+{
+    while (*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') {
+        text++;
+    }
+
+    return *text == '\0';
+}
+
+// only the keys are kept, the stanzas may be gone by the next reload
+static GList*
+_keys(GList *stubs)
+{
+    GList *keys = NULL;
+    GList *curr = stubs;
+    while (curr) {
+        StubDef *stub = curr->data;
+        if (!stub->next) {
+            StubDef *key = malloc(sizeof(StubDef));
+            key->id = g_strdup(stub->id);
+            key->query = g_strdup(stub->query);
+            key->rule = g_strdup(stub->rule);
+            key->stream = NULL;
+            key->next = 0;
+            key->source = NULL;
+            keys = g_list_prepend(keys, key);
+        }
+        curr = g_list_next(curr);
+    }
+
+    return g_list_reverse(keys);
+}
+
+static void
+_key_free(StubDef *key)
+{
+    g_free(key->id);
+    g_free(key->query);
+    g_free(key->rule);
+    free(key);
+}
+
+static void
+_keys_free(GList *keys)
+{
+    g_list_free_full(keys, (GDestroyNotify)_key_free);
+}
+
+// hidden files, editor swap and backup files
+static gboolean
+_skip(const char *name)
+{
+    return name[0] == '.' || name[0] == '#' || g_str_has_suffix(name, "~");
+}
+
+#ifdef PLATFORM_NIX
+// editors often save by renaming over the file, so its directory is watched
+static void
+_watch_start(void)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        log_println(STBBR_LOGWARN, "Could not watch %s, stubs will not reload", stubs_dir);
+        return;
+    }
+
+    if (inotify_add_watch(inotify_fd, stubs_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+        log_println(STBBR_LOGWARN, "Could not watch %s, stubs will not reload", stubs_dir);
+        close(inotify_fd);
+        inotify_fd = -1;
+        return;
+    }
+
+    watching = TRUE;
+    if (pthread_create(&watch_thread, NULL, _watch_cb, NULL) != 0) {
+        watching = FALSE;
+        close(inotify_fd);
+        inotify_fd = -1;
+        return;
+    }
+
+    log_println(STBBR_LOGINFO, "Watching %s for stub changes", stubs_dir);
+}
+
+static void
+_watch_stop(void)
+{
+    if (!watching) {
+        return;
+    }
+
+    watching = FALSE;
+    pthread_join(watch_thread, NULL);
+    close(inotify_fd);
+    inotify_fd = -1;
+}
+
+static void*
+_watch_cb(void *userdata)
+{
+    prctl(PR_SET_NAME, "stubs");
+
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    pfd.fd = inotify_fd;
+    pfd.events = POLLIN;
+
+    while (watching) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        // a file changed several times in one read is reloaded once
+        GList *paths = NULL;
+        char *ptr = buf;
+        while (ptr < buf + len) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->len == 0 || _skip(event->name)) {
+                continue;
+            }
+            if (stubs_file && g_strcmp0(event->name, stubs_file) != 0) {
+                continue;
+            }
+
+            char *path = g_build_filename(stubs_dir, event->name, NULL);
+            if (g_list_find_custom(paths, path, (GCompareFunc)g_strcmp0)) {
+                g_free(path);
+            } else {
+                paths = g_list_append(paths, path);
+            }
+        }
+
+        if (paths) {
+            lockstats_lock(&stubfile_lock);
+            _reload(paths);
+            lockstats_unlock(&stubfile_lock);
+            g_list_free_full(paths, g_free);
+        }
+    }
+
+    return NULL;
+}
+#endif
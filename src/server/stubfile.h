@@ -0,0 +1,33 @@
+/*
+ * stubfile.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_STUBFILE
+#define __H_STUBFILE
+
+// a stub file is a list of stubs, each a header line followed by its stanzas:
+// @id <id>, @query <xmlns> or @rule <template>, lines before the first header
+// are ignored, a key repeated in the same file adds the next reply
+
+int stubfile_load(const char *path);
+void stubfile_stop(void);
+
+#endif
@@ -0,0 +1,485 @@
+/*
+ * trace.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "server/log.h"
+#include "server/prime.h"
+#include "server/stanza.h"
+#include "server/lockstats.h"
+#include "server/trace.h"
+
+// a trace is the magic followed by records of a kind byte, microseconds
+// since the previous record, for replies the received stanza they answer
+// counting from 1, the length and the text, numbers are LEB128 varints
+#define TRACE_MAGIC "STBBRTR1"
+#define TRACE_MAGIC_LEN 8
+
+#define TRACE_RECV 'R'
+#define TRACE_REPLY 'S'
+#define TRACE_PUSH 'P'
+
+// stanzas replayed in one pass at maximum speed, so reads still get a turn
+#define TRACE_FLOOD_BATCH 64
+
+// a stanza the client was not answered with waits until the client has sent
+// as much as it had when it was recorded, then keeps its recorded spacing
+typedef struct trace_push_t {
+    int after;
+    gint64 gap_us;
+    char *text;
+} TracePush;
+
+// guards the recording, taken by the I/O thread only while recording
+StbbrMutex trace_lock = STBBR_MUTEX_INIT("trace_lock");
+
+// guards the replay, taken by the I/O thread only while replaying
+StbbrMutex replay_lock = STBBR_MUTEX_INIT("replay_lock");
+
+static FILE *record_file = NULL;
+static gint recording = 0;
+static gint64 record_last = 0;
+static int record_recvs = 0;
+static int record_current = 0;
+
+static TracePush *pushes = NULL;
+static int push_count = 0;
+static int push_next = 0;
+static int replay_speed = 1;
+static gint64 replay_mark = 0;
+static GArray *recv_times = NULL;
+static gint replaying = 0;
+
+static void _write_record(char kind, int recv, const char *text, size_t len);
+static void _write_varint(guint64 value);
+static gboolean _read_varint(const char **pos, const char *end, guint64 *value);
+static gboolean _skipped(const char *text, XMPPStanza *stanza);
+static void _pushes_free(void);
+
+int
+trace_record(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        log_println(STBBR_LOGERROR, "Could not open trace file: %s", path);
+        return 0;
+    }
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, file);
+
+    trace_record_stop();
+
+    lockstats_lock(&trace_lock);
+    record_file = file;
+    record_last = g_get_monotonic_time();
+    record_recvs = 0;
+    record_current = 0;
+    g_atomic_int_set(&recording, 1);
+    lockstats_unlock(&trace_lock);
+
+    log_println(STBBR_LOGINFO, "Recording to %s", path);
+
+    return 1;
+}
+
+void
+trace_record_stop(void)
+{
+    lockstats_lock(&trace_lock);
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+        log_println(STBBR_LOGINFO, "Recording stopped after %d received stanzas", record_recvs);
+    }
+    g_atomic_int_set(&recording, 0);
+    lockstats_unlock(&trace_lock);
+}
+
+void
+trace_recv(const char *stanza, size_t len)
+{
+    if (g_atomic_int_get(&recording)) {
+        lockstats_lock(&trace_lock);
+        if (record_file) {
+            record_recvs++;
+            record_current = record_recvs;
+            _write_record(TRACE_RECV, 0, stanza, len);
+        }
+        lockstats_unlock(&trace_lock);
+    }
+
+    if (g_atomic_int_get(&replaying)) {
+        lockstats_lock(&replay_lock);
+        if (recv_times) {
+            gint64 now = g_get_monotonic_time();
+            g_array_append_val(recv_times, now);
+        }
+        lockstats_unlock(&replay_lock);
+    }
+}
+
+void
+trace_recv_done(void)
+{
+    if (!g_atomic_int_get(&recording)) {
+        return;
+    }
+
+    lockstats_lock(&trace_lock);
+    record_current = 0;
+    lockstats_unlock(&trace_lock);
+}
+
+// the received stanza being answered, or 0
+int
+trace_current(void)
+{
+    if (!g_atomic_int_get(&recording)) {
+        return 0;
+    }
+
+    lockstats_lock(&trace_lock);
+    int current = record_current;
+    lockstats_unlock(&trace_lock);
+
+    return current;
+}
+
+// sent while a received stanza is being handled, so it is the reply to it
+void
+trace_sent(const char *stream, size_t len)
+{
+    if (!g_atomic_int_get(&recording)) {
+        return;
+    }
+
+    lockstats_lock(&trace_lock);
+    if (record_file) {
+        _write_record(record_current ? TRACE_REPLY : TRACE_PUSH, record_current, stream, len);
+    }
+    lockstats_unlock(&trace_lock);
+}
+
+// for replies written after the stanza they answer was handled
+void
+trace_sent_for(int recv, const char *stream, size_t len)
+{
+    if (!g_atomic_int_get(&recording)) {
+        return;
+    }
+
+    lockstats_lock(&trace_lock);
+    if (record_file) {
+        _write_record(recv ? TRACE_REPLY : TRACE_PUSH, recv, stream, len);
+    }
+    lockstats_unlock(&trace_lock);
+}
+
+// replies become id stubs, or rule stubs matching the recorded stanza when it
+// has no id, a speed of 0 replays as fast as the client reads, returns the
+// number of stubs and stanzas to push or -1
+int
+trace_replay(const char *path, int speed)
+{
+    if (speed < 0) {
+        return -1;
+    }
+
+    GMappedFile *mapping = g_mapped_file_new(path, FALSE, NULL);
+    if (!mapping) {
+        log_println(STBBR_LOGERROR, "Could not open trace file: %s", path);
+        return -1;
+    }
+    const char *pos = g_mapped_file_get_contents(mapping);
+    const char *end = pos + g_mapped_file_get_length(mapping);
+    if (end - pos < TRACE_MAGIC_LEN || memcmp(pos, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        log_println(STBBR_LOGERROR, "Not a trace file: %s", path);
+        g_mapped_file_unref(mapping);
+        return -1;
+    }
+    pos += TRACE_MAGIC_LEN;
+
+    GPtrArray *recvs = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *replies = g_ptr_array_new();
+    GArray *recv_at = g_array_new(FALSE, FALSE, sizeof(gint64));
+    GArray *loaded = g_array_new(FALSE, FALSE, sizeof(TracePush));
+    gint64 at = 0;
+    gint64 last_push = 0;
+    gboolean valid = TRUE;
+
+    while (pos < end) {
+        char kind = *pos++;
+        guint64 delta = 0;
+        guint64 recv = 0;
+        guint64 len = 0;
+        if (!_read_varint(&pos, end, &delta)
+                || (kind == TRACE_REPLY && !_read_varint(&pos, end, &recv))
+                || !_read_varint(&pos, end, &len)
+                || len > (guint64)(end - pos)) {
+            valid = FALSE;
+            break;
+        }
+        at += delta;
+
+        if (kind == TRACE_RECV) {
+            g_ptr_array_add(recvs, g_strndup(pos, len));
+            g_ptr_array_add(replies, NULL);
+            g_array_append_val(recv_at, at);
+        } else if (kind == TRACE_REPLY && recv >= 1 && recv <= recvs->len) {
+            GString *reply = g_ptr_array_index(replies, recv - 1);
+            if (!reply) {
+                reply = g_string_new("");
+                g_ptr_array_index(replies, recv - 1) = reply;
+            }
+            g_string_append_len(reply, pos, len);
+        } else if (kind == TRACE_PUSH) {
+            gint64 gate = recvs->len > 0 ? g_array_index(recv_at, gint64, recvs->len - 1) : 0;
+            TracePush push;
+            push.after = recvs->len;
+            push.gap_us = at - MAX(gate, last_push);
+            push.text = g_strndup(pos, len);
+            g_array_append_val(loaded, push);
+            last_push = at;
+        } else {
+            valid = FALSE;
+            break;
+        }
+        pos += len;
+    }
+    g_mapped_file_unref(mapping);
+
+    GList *stubs = NULL;
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    guint i;
+    for (i = 0; valid && i < recvs->len; i++) {
+        GString *reply = g_ptr_array_index(replies, i);
+        char *text = g_ptr_array_index(recvs, i);
+        XMPPStanza *stanza = reply ? stanza_parse(text) : NULL;
+        if (!stanza || _skipped(text, stanza)) {
+            stanza_free(stanza);
+            continue;
+        }
+
+        StubDef *stub = malloc(sizeof(StubDef));
+        stub->id = NULL;
+        stub->query = NULL;
+        stub->rule = NULL;
+        stub->stream = reply->str;
+        stub->source = NULL;
+        const char *id = stanza_get_id(stanza);
+        if (id) {
+            stub->id = g_strdup(id);
+        } else if (prime_rule_valid(text)) {
+            stub->rule = g_strdup(text);
+        } else {
+            free(stub);
+            stanza_free(stanza);
+            continue;
+        }
+        stanza_free(stanza);
+
+        char *key = stub->id ? stub->id : stub->rule;
+        stub->next = g_hash_table_contains(seen, key);
+        g_hash_table_add(seen, key);
+        stubs = g_list_append(stubs, stub);
+    }
+    g_hash_table_destroy(seen);
+
+    if (!valid) {
+        log_println(STBBR_LOGERROR, "Corrupt trace file: %s", path);
+        for (i = 0; i < loaded->len; i++) {
+            g_free(g_array_index(loaded, TracePush, i).text);
+        }
+        g_array_free(loaded, TRUE);
+    } else {
+        prime_for_all(stubs);
+
+        lockstats_lock(&replay_lock);
+        _pushes_free();
+        push_count = loaded->len;
+        pushes = (TracePush *)g_array_free(loaded, FALSE);
+        push_next = 0;
+        replay_speed = speed;
+        replay_mark = 0;
+        recv_times = g_array_new(FALSE, FALSE, sizeof(gint64));
+        g_atomic_int_set(&replaying, 1);
+        lockstats_unlock(&replay_lock);
+
+        if (speed == 0) {
+            log_println(STBBR_LOGINFO, "Replaying %s at maximum speed: %d stubs, %d stanzas", path,
+                g_list_length(stubs), push_count);
+        } else {
+            log_println(STBBR_LOGINFO, "Replaying %s at %dx: %d stubs, %d stanzas", path,
+                speed, g_list_length(stubs), push_count);
+        }
+    }
+
+    int count = valid ? (int)g_list_length(stubs) + push_count : -1;
+
+    GList *curr = stubs;
+    while (curr) {
+        StubDef *stub = curr->data;
+        g_free(stub->id);
+        g_free(stub->rule);
+        free(stub);
+        curr = g_list_next(curr);
+    }
+    g_list_free(stubs);
+    for (i = 0; i < replies->len; i++) {
+        GString *reply = g_ptr_array_index(replies, i);
+        if (reply) {
+            g_string_free(reply, TRUE);
+        }
+    }
+    g_ptr_array_free(replies, TRUE);
+    g_ptr_array_free(recvs, TRUE);
+    g_array_free(recv_at, TRUE);
+
+    return count;
+}
+
+void
+trace_replay_stop(void)
+{
+    lockstats_lock(&replay_lock);
+    _pushes_free();
+    g_atomic_int_set(&replaying, 0);
+    lockstats_unlock(&replay_lock);
+}
+
+int
+trace_replay_run(generator_send_func send_func, int max_wait_ms)
+{
+    if (!g_atomic_int_get(&replaying)) {
+        return max_wait_ms;
+    }
+
+    lockstats_lock(&replay_lock);
+    gint64 now = g_get_monotonic_time();
+    if (replay_mark == 0) {
+        replay_mark = now;
+    }
+
+    int wait_ms = max_wait_ms;
+    int sent = 0;
+    while (push_next < push_count && sent < TRACE_FLOOD_BATCH) {
+        TracePush *push = &pushes[push_next];
+        if ((int)recv_times->len < push->after) {
+            break;
+        }
+
+        gint64 gate = push->after > 0 ? g_array_index(recv_times, gint64, push->after - 1) : 0;
+        gint64 due = MAX(gate, replay_mark) + (replay_speed > 0 ? push->gap_us / replay_speed : 0);
+        if (due > now) {
+            wait_ms = MIN(wait_ms, (int)((due - now + 999) / 1000));
+            break;
+        }
+
+        if (!send_func(push->text)) {
+            break;
+        }
+        replay_mark = due;
+        push_next++;
+        sent++;
+    }
+    if (sent == TRACE_FLOOD_BATCH) {
+        wait_ms = 0;
+    }
+    lockstats_unlock(&replay_lock);
+
+    return wait_ms;
+}
+
+static void
+_write_record(char kind, int recv, const char *text, size_t len)
+{
+    gint64 now = g_get_monotonic_time();
+    fputc(kind, record_file);
+    _write_varint(now - record_last);
+    if (kind == TRACE_REPLY) {
+        _write_varint(recv);
+    }
+    _write_varint(len);
+    fwrite(text, 1, len, record_file);
+    record_last = now;
+}
+
+static void
+_write_varint(guint64 value)
+{
+    while (value >= 0x80) {
+        fputc((value & 0x7f) | 0x80, record_file);
+        value >>= 7;
+    }
+    fputc(value, record_file);
+}
+
+static gboolean
+_read_varint(const char **pos, const char *end, guint64 *value)
+{
+    int shift = 0;
+    *value = 0;
+    while (*pos < end && shift < 64) {
+        guchar byte = *(*pos)++;
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return TRUE;
+        }
+        shift += 7;
+    }
+
+    return FALSE;
+}
+
+// the server still does the stream header and authentication itself
+static gboolean
+_skipped(const char *text, XMPPStanza *stanza)
+{
+    while (g_ascii_isspace(*text)) {
+        text++;
+    }
+    if (g_str_has_prefix(text, "<?xml") || g_str_has_prefix(text, "<stream:stream")) {
+        return TRUE;
+    }
+
+    return stanza_get_child_by_ns(stanza, "jabber:iq:auth") != NULL;
+}
+
+static void
+_pushes_free(void)
+{
+    int i;
+    for (i = 0; i < push_count; i++) {
+        g_free(pushes[i].text);
+    }
+    g_free(pushes);
+    pushes = NULL;
+    push_count = 0;
+    push_next = 0;
+    if (recv_times) {
+        g_array_free(recv_times, TRUE);
+        recv_times = NULL;
+    }
+}
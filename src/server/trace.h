@@ -0,0 +1,47 @@
+/*
+ * trace.h
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __H_TRACE
+#define __H_TRACE
+
+#include <stddef.h>
+
+#include "server/generator.h"
+
+int trace_record(const char *path);
+void trace_record_stop(void);
+
+// called from the I/O thread around the handling of each received stanza
+void trace_recv(const char *stanza, size_t len);
+void trace_recv_done(void);
+int trace_current(void);
+
+void trace_sent(const char *stream, size_t len);
+void trace_sent_for(int recv, const char *stream, size_t len);
+
+int trace_replay(const char *path, int speed);
+void trace_replay_stop(void);
+
+// called from the I/O thread, returns how long until the next stanza is due
+int trace_replay_run(generator_send_func send_func, int max_wait_ms);
+
+#endif
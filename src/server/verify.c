@@ -28,9 +28,12 @@
 #include "server/stanza.h"
 #include "server/stanzas.h"
 #include "server/log.h"
+#include "server/server.h"
 
 static int timeoutsecs = 0;
 
+static long _find_with_timeout(XMPPStanza *stanza, long after, gboolean last);
+
 void
 verify_set_timeout(int seconds)
 {
@@ -56,14 +59,16 @@ verify_any(char *stanza_text, gboolean ign_timeout)
         GTimer *timer = g_timer_new();
         while (elapsed < timeoutsecs * 1.0) {
             result = stanzas_verify_any(stanza);
-            if (result) {
+            if (result || server_stopping()) {
                 break;
             }
 
             usleep(1000 * 50);
             elapsed = g_timer_elapsed(timer, NULL);
         }
+        g_timer_destroy(timer);
     }
+    stanza_free(stanza);
 
     if (result) {
         log_println(STBBR_LOGINFO, "VERIFY SUCCESS: %s", stanza_text);
@@ -87,14 +92,16 @@ verify_last(char *stanza_text)
         GTimer *timer = g_timer_new();
         while (elapsed < timeoutsecs * 1.0) {
             result = stanzas_verify_last(stanza);
-            if (result) {
+            if (result || server_stopping()) {
                 break;
             }
 
             usleep(1000 * 50);
             elapsed = g_timer_elapsed(timer, NULL);
         }
+        g_timer_destroy(timer);
     }
+    stanza_free(stanza);
 
     if (result) {
         log_println(STBBR_LOGINFO, "VERIFY LAST SUCCESS: %s", stanza_text);
@@ -104,3 +111,116 @@ verify_last(char *stanza_text)
 
     return result;
 }
+
+// the seq of the oldest match after the mark, or 0
+long
+verify_after(char *stanza_text, long after)
+{
+    XMPPStanza *stanza = stanza_parse(stanza_text);
+    long result = _find_with_timeout(stanza, after, FALSE);
+    stanza_free(stanza);
+
+    if (result) {
+        log_println(STBBR_LOGINFO, "VERIFY SUCCESS after %ld: %s", after, stanza_text);
+    } else {
+        log_println(STBBR_LOGINFO, "VERIFY FAIL after %ld: %s", after, stanza_text);
+    }
+
+    return result;
+}
+
+long
+verify_last_after(char *stanza_text, long after)
+{
+    XMPPStanza *stanza = stanza_parse(stanza_text);
+    long result = _find_with_timeout(stanza, after, TRUE);
+    stanza_free(stanza);
+
+    if (result) {
+        log_println(STBBR_LOGINFO, "VERIFY LAST SUCCESS after %ld: %s", after, stanza_text);
+    } else {
+        log_println(STBBR_LOGINFO, "VERIFY LAST FAIL after %ld: %s", after, stanza_text);
+    }
+
+    return result;
+}
+
+// every stanza must be received in the given order, with anything between,
+// a retry carries on from the stanzas already matched
+int
+verify_in_order(GList *stanza_texts)
+{
+    GList *templates = NULL;
+    GList *curr = stanza_texts;
+    while (curr) {
+        XMPPStanza *stanza = stanza_parse(curr->data);
+        if (!stanza) {
+            log_println(STBBR_LOGWARN, "VERIFY ORDER could not parse: %s", (char *)curr->data);
+            g_list_free_full(templates, (GDestroyNotify)stanza_free);
+            return 0;
+        }
+        templates = g_list_append(templates, stanza);
+        curr = g_list_next(curr);
+    }
+
+    int total = g_list_length(templates);
+    int matched = 0;
+    long checked = 0;
+    GTimer *timer = g_timer_new();
+    while (total > 0) {
+        long seq = stanzas_last_seq();
+        long last = 0;
+        matched += stanzas_find_in_order(g_list_nth(templates, matched), checked, &last);
+        if (matched == total || timeoutsecs <= 0 || server_stopping()
+                || g_timer_elapsed(timer, NULL) >= timeoutsecs * 1.0) {
+            break;
+        }
+        // nothing up to seq matched the next template
+        checked = MAX(last, seq);
+
+        usleep(1000 * 50);
+    }
+    g_timer_destroy(timer);
+    g_list_free_full(templates, (GDestroyNotify)stanza_free);
+
+    if (total > 0 && matched == total) {
+        log_println(STBBR_LOGINFO, "VERIFY ORDER SUCCESS: %d stanzas", total);
+        return 1;
+    }
+
+    if (total > 0) {
+        log_println(STBBR_LOGINFO, "VERIFY ORDER FAIL at %d of %d: %s", matched + 1, total,
+            (char *)g_list_nth_data(stanza_texts, matched));
+    }
+    return 0;
+}
+
+// a retry only looks at what arrived since the previous try
+static long
+_find_with_timeout(XMPPStanza *stanza, long after, gboolean last)
+{
+    if (!stanza) {
+        return 0;
+    }
+
+    long result = 0;
+    long checked = after;
+    GTimer *timer = g_timer_new();
+    while (TRUE) {
+        long seq = stanzas_last_seq();
+        if (last) {
+            result = stanzas_find_last(stanza, after);
+        } else {
+            result = stanzas_find(stanza, checked);
+        }
+        if (result || timeoutsecs <= 0 || server_stopping() || g_timer_elapsed(timer, NULL) >= timeoutsecs * 1.0) {
+            break;
+        }
+        checked = MAX(checked, seq);
+
+        usleep(1000 * 50);
+    }
+    g_timer_destroy(timer);
+
+    return result;
+}
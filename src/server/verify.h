@@ -26,5 +26,8 @@
 void verify_set_timeout(int seconds);
 int verify_last(char *stanza);
 int verify_any(char *stanza, gboolean ign_timeout);
+long verify_after(char *stanza, long after);
+long verify_last_after(char *stanza, long after);
+int verify_in_order(GList *stanzas);
 
 #endif
@@ -45,6 +45,20 @@ xmppclient_new(struct sockaddr_in client_addr, int socket)
     return client;
 }
 
+XMPPClient*
+xmppclient_new_unix(const char *path, int socket)
+{
+    XMPPClient *client = malloc(sizeof(XMPPClient));
+    client->ip = strdup(path);
+    client->port = 0;
+    client->sock = socket;
+    client->username = NULL;
+    client->password = NULL;
+    client->resource = NULL;
+
+    return client;
+}
+
 void
 xmppclient_end_session(XMPPClient *client)
 {
@@ -35,6 +35,7 @@ typedef struct xmpp_client_t {
 } XMPPClient;
 
 XMPPClient* xmppclient_new(struct sockaddr_in client_addr, int socket);
+XMPPClient* xmppclient_new_unix(const char *path, int socket);
 void xmppclient_end_session(XMPPClient *client);
 
 #endif
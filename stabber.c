@@ -23,6 +23,7 @@
 #include <glib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <stabber.h>
 #include <pthread.h>
 
@@ -33,6 +34,16 @@ main(int argc , char *argv[])
 {
     int port = 0;
     int httpport = 0;
+    int httpthreads = 1;
+    char *socketpath = NULL;
+    char *httpsocketpath = NULL;
+    int ctlport = 0;
+    char *ctlsocketpath = NULL;
+    char *stubspath = NULL;
+    gboolean autoreply = FALSE;
+    char *recordpath = NULL;
+    char *replaypath = NULL;
+    int speed = 1;
     char *loglevelarg = "INFO";
     stbbr_log_t loglevel = STBBR_LOGINFO;
 
@@ -40,6 +51,16 @@ main(int argc , char *argv[])
     {
         { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Listen port", NULL },
         { "http", 'h', 0, G_OPTION_ARG_INT, &httpport, "HTTP Listen port", NULL },
+        { "http-threads", 't', 0, G_OPTION_ARG_INT, &httpthreads, "HTTP worker threads (default 1)", NULL },
+        { "socket", 's', 0, G_OPTION_ARG_STRING, &socketpath, "Listen on a Unix domain socket instead of a port", "PATH" },
+        { "http-socket", 'S', 0, G_OPTION_ARG_STRING, &httpsocketpath, "HTTP Unix domain socket instead of a port", "PATH" },
+        { "control", 'c', 0, G_OPTION_ARG_INT, &ctlport, "Binary control protocol port", NULL },
+        { "control-socket", 'C', 0, G_OPTION_ARG_STRING, &ctlsocketpath, "Binary control protocol Unix domain socket", "PATH" },
+        { "stubs", 'f', 0, G_OPTION_ARG_STRING, &stubspath, "Load stubs from a file or directory, reloaded when changed", "PATH" },
+        { "autoreply", 'a', 0, G_OPTION_ARG_NONE, &autoreply, "Answer ping, disco#info, version and time requests to the server", NULL },
+        { "record", 'r', 0, G_OPTION_ARG_STRING, &recordpath, "Record the session to a trace file", "PATH" },
+        { "replay", 'R', 0, G_OPTION_ARG_STRING, &replaypath, "Replay the server side of a trace file", "PATH" },
+        { "speed", 'x', 0, G_OPTION_ARG_INT, &speed, "Replay speed, 1 for real time (default), 0 for as fast as possible", "N" },
         { "log",'l', 0, G_OPTION_ARG_STRING, &loglevelarg, "Set logging levels, DEBUG, INFO (default), WARN, ERROR", "LEVEL" },
         { NULL }
     };
@@ -58,8 +79,8 @@ main(int argc , char *argv[])
 
     g_option_context_free(context);
 
-    if (port == 0) {
-        printf("Port must be specified with -p <port>\n");
+    if (port == 0 && !socketpath) {
+        printf("Port must be specified with -p <port>, or a socket with -s <path>\n");
         return 1;
     }
 
@@ -76,7 +97,45 @@ main(int argc , char *argv[])
         return 1;
     }
 
+    // paths that cannot work fail before the server is listening
+    if (recordpath) {
+        char *recorddir = g_path_get_dirname(recordpath);
+        int writable = access(recorddir, W_OK) == 0;
+        g_free(recorddir);
+        if (!writable) {
+            printf("Could not record to %s\n", recordpath);
+            return 1;
+        }
+    }
+
+    if (replaypath && !g_file_test(replaypath, G_FILE_TEST_IS_REGULAR)) {
+        printf("Could not replay %s\n", replaypath);
+        return 1;
+    }
+
+    stbbr_http_threads(httpthreads);
+    stbbr_unix_sockets(socketpath, httpsocketpath);
+    stbbr_control(ctlport, ctlsocketpath);
+    stbbr_autoreply(autoreply);
     stbbr_start(loglevel, port, httpport);
 
+    if (stubspath && stbbr_load_stubs(stubspath) == -1) {
+        printf("Could not load stubs from %s\n", stubspath);
+        stbbr_stop();
+        return 1;
+    }
+
+    if (recordpath && !stbbr_record(recordpath)) {
+        printf("Could not record to %s\n", recordpath);
+        stbbr_stop();
+        return 1;
+    }
+
+    if (replaypath && stbbr_replay(replaypath, speed) == -1) {
+        printf("Could not replay %s\n", replaypath);
+        stbbr_stop();
+        return 1;
+    }
+
     pthread_exit(0);
 }
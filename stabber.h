@@ -30,20 +30,133 @@ typedef enum {
     STBBR_LOGERROR
 } stbbr_log_t;
 
+typedef struct {
+    int count;
+    double min;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} stbbr_rtt_t;
+
+#define STBBR_LOCK_BUCKETS 16
+
+typedef struct {
+    unsigned long acquisitions;
+    unsigned long contended;
+    double wait_total_ms;
+    double wait_max_ms;
+    double hold_total_ms;
+    double hold_max_ms;
+    unsigned long hold_hist[STBBR_LOCK_BUCKETS];
+} stbbr_lockstats_t;
+
+// delay and jitter apply to everything sent to the client, jitter is uniform
+// either side of the delay unless jitter_normal is set, a rate of 0 is
+// unlimited and fragment_bytes splits writes
+typedef struct {
+    int delay_ms;
+    int jitter_ms;
+    int jitter_normal;
+    int out_bytes_per_sec;
+    int in_bytes_per_sec;
+    int fragment_bytes;
+    int fragment_gap_ms;
+} stbbr_netem_t;
+
+// a roster of count contacts, percentages are out of 100, the rest of the
+// subscriptions are none, online contacts with a both or to subscription
+// send presence after the roster, the same seed gives the same roster
+typedef struct {
+    int count;
+    int groups;
+    int ungrouped_percent;
+    int both_percent;
+    int to_percent;
+    int from_percent;
+    int online_percent;
+    unsigned int seed;
+} stbbr_roster_t;
+
+// what goes first when the received history is over its limit, the oldest
+// stanzas go once the policy has nothing left to give up
+typedef enum {
+    STBBR_HISTORY_OLDEST,
+    STBBR_HISTORY_WATCHED,
+    STBBR_HISTORY_BODIES
+} stbbr_history_policy_t;
+
+// a limit of 0 is unlimited, bytes are an estimate of the memory used, with
+// hot_stanzas set only the newest are kept parsed and older ones compressed
+typedef struct {
+    int max_stanzas;
+    long max_bytes;
+    stbbr_history_policy_t policy;
+    int hot_stanzas;
+} stbbr_history_t;
+
+typedef struct {
+    int stanzas;
+    long bytes;
+    long evicted;
+    long bodies_dropped;
+    int cold_stanzas;
+    long cold_bytes;
+} stbbr_history_stats_t;
+
 int stbbr_start(stbbr_log_t loglevel, int port, int httpport);
+void stbbr_http_threads(int threads);
+void stbbr_unix_sockets(char *path, char *httppath);
+void stbbr_control(int port, char *path);
 void stbbr_stop(void);
 
 void stbbr_set_timeout(int seconds);
+void stbbr_netem(stbbr_netem_t *conditions);
 
 int stbbr_auth_passwd(char *password);
 int stbbr_for_id(char *id, char *stream);
+int stbbr_for_id_next(char *id, char *stream);
 int stbbr_for_query(char *query, char *stream);
+int stbbr_for_query_next(char *query, char *stream);
+int stbbr_for_rule(char *rule, char *stream);
+void stbbr_for_roster(stbbr_roster_t *roster);
+void stbbr_muc_room(char *room, int occupants);
+int stbbr_load_stubs(char *path);
+void stbbr_autoreply(int enabled);
 
 void stbbr_wait_for(char *id);
 
 int stbbr_received(char *stanza);
 int stbbr_last_received(char *stanza);
 
+long stbbr_mark(void);
+long stbbr_received_after(long mark, char *stanza);
+long stbbr_last_received_after(long mark, char *stanza);
+long stbbr_wait_for_after(long mark, char *id);
+int stbbr_received_next(long *cursor, char *stanza);
+void stbbr_wait_for_next(long *cursor, char *id);
+int stbbr_received_in_order(char *first, ...);
+
+void stbbr_history(stbbr_history_t *history);
+int stbbr_history_watch(char *pattern);
+void stbbr_history_stats(stbbr_history_stats_t *stats);
+
 void stbbr_send(char *stream);
+int stbbr_generate(char *template, int rate, int burst, int duration_ms, int count);
+void stbbr_generate_stop(void);
+int stbbr_muc_message(char *room, char *nick, char *body);
+
+int stbbr_record(char *path);
+void stbbr_record_stop(void);
+int stbbr_replay(char *path, int speed);
+void stbbr_replay_stop(void);
+
+int stbbr_rtt(char *ns, stbbr_rtt_t *stats);
+void stbbr_rtt_reset(void);
+
+void stbbr_lockstats_enable(int enabled);
+int stbbr_lockstats(char *lockname, stbbr_lockstats_t *stats);
+void stbbr_lockstats_reset(void);
 
 #endif
@@ -0,0 +1,427 @@
+/*
+ * stabberbench.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "stabber.h"
+
+#define STREAM_START "<?xml version=\"1.0\"?>" \
+    "<stream:stream to=\"localhost\" xmlns=\"jabber:client\" xmlns:stream=\"http://etherx.jabber.org/streams\" version=\"1.0\">"
+
+#define AUTH_GET "<iq type=\"get\" id=\"bench_auth1\">" \
+    "<query xmlns=\"jabber:iq:auth\"><username>bench</username></query>" \
+    "</iq>"
+
+#define AUTH_SET "<iq type=\"set\" id=\"bench_auth2\">" \
+    "<query xmlns=\"jabber:iq:auth\">" \
+        "<username>bench</username><password>password</password><resource>bench</resource>" \
+    "</query>" \
+    "</iq>"
+
+typedef struct bench_t {
+    int sock;
+    GString *inbuf;
+    GHashTable *inflight;
+    GQueue *free_ids;
+    GArray *latencies;
+    long sent;
+    long received;
+} Bench;
+
+static int _connect(int port);
+static int _send_all(int sock, const char *data);
+static int _read_until(Bench *bench, const char *marker, int timeout_ms);
+static int _read_available(Bench *bench);
+static void _consume_responses(Bench *bench);
+static void _send_iq(Bench *bench, long seq);
+static int _compare_gint64(gconstpointer a, gconstpointer b);
+static double _percentile(GArray *sorted, int permille);
+static double _cpu_secs(void);
+static double _thread_cpu_secs(void);
+
+int
+main(int argc, char *argv[])
+{
+    int port = 5240;
+    int rate = 0;
+    int duration = 5;
+    int window = 16;
+    int stubs = 100;
+
+    GOptionEntry entries[] =
+    {
+        { "port", 'p', 0, G_OPTION_ARG_INT, &port, "XMPP listen port (default 5240)", NULL },
+        { "rate", 'r', 0, G_OPTION_ARG_INT, &rate, "IQs per second, 0 (default) sends as fast as the window allows", NULL },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Duration in seconds (default 5)", NULL },
+        { "window", 'w', 0, G_OPTION_ARG_INT, &window, "Maximum IQs awaiting a response (default 16)", NULL },
+        { "stubs", 's', 0, G_OPTION_ARG_INT, &stubs, "Number of id stubs to prime (default 100)", NULL },
+        { NULL }
+    };
+
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_print("%s\n", error->message);
+        g_option_context_free(context);
+        g_error_free(error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (duration <= 0 || window <= 0 || stubs <= 0 || rate < 0) {
+        printf("Duration, window and stubs must be greater than 0, rate must not be negative.\n");
+        return 1;
+    }
+
+    // id stubs can only have one request in flight
+    if (window > stubs) {
+        window = stubs;
+    }
+
+    if (stbbr_start(STBBR_LOGERROR, port, 0) != 0) {
+        printf("Could not start Stabber on port %d\n", port);
+        return 1;
+    }
+
+    stbbr_auth_passwd("password");
+    stbbr_for_query("jabber:iq:roster",
+        "<iq type=\"result\">"
+            "<query xmlns=\"jabber:iq:roster\" ver=\"1\">"
+                "<item jid=\"buddy1@localhost\" subscription=\"both\" name=\"Buddy1\"/>"
+            "</query>"
+        "</iq>");
+
+    Bench bench;
+    bench.inbuf = g_string_new("");
+    bench.inflight = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    bench.free_ids = g_queue_new();
+    bench.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    bench.sent = 0;
+    bench.received = 0;
+
+    int i;
+    for (i = 0; i < stubs; i++) {
+        char *id = g_strdup_printf("bench_%d", i);
+        char *reply = g_strdup_printf("<iq id=\"%s\" type=\"result\"/>", id);
+        stbbr_for_id(id, reply);
+        g_queue_push_tail(bench.free_ids, id);
+        g_free(reply);
+    }
+
+    bench.sock = _connect(port);
+    if (bench.sock == -1) {
+        stbbr_stop();
+        return 1;
+    }
+
+    if (!_send_all(bench.sock, STREAM_START) || !_read_until(&bench, "</stream:features>", 5000)
+            || !_send_all(bench.sock, AUTH_GET) || !_read_until(&bench, "bench_auth1", 5000)
+            || !_send_all(bench.sock, AUTH_SET) || !_read_until(&bench, "bench_auth2", 5000)) {
+        printf("Stream negotiation with Stabber failed\n");
+        close(bench.sock);
+        stbbr_stop();
+        return 1;
+    }
+    g_string_truncate(bench.inbuf, 0);
+
+    double cpu_start = _cpu_secs();
+    double bench_cpu_start = _thread_cpu_secs();
+    gint64 start = g_get_monotonic_time();
+    gint64 end = start + (gint64)duration * G_USEC_PER_SEC;
+    gint64 interval = rate > 0 ? G_USEC_PER_SEC / rate : 0;
+    gint64 next_send = start;
+    long seq = 0;
+
+    gint64 now = start;
+    while (now < end) {
+        while (g_hash_table_size(bench.inflight) < window && now >= next_send && now < end) {
+            _send_iq(&bench, seq++);
+            next_send += interval;
+        }
+
+        int timeout = 1;
+        if (g_hash_table_size(bench.inflight) >= window || (interval > 0 && next_send > now)) {
+            timeout = (int)MAX(1, (next_send - now) / 1000);
+        }
+
+        struct pollfd pfd = { bench.sock, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) > 0 && !_read_available(&bench)) {
+            break;
+        }
+        _consume_responses(&bench);
+        now = g_get_monotonic_time();
+    }
+
+    // drain responses still in flight
+    gint64 drain_end = g_get_monotonic_time() + G_USEC_PER_SEC;
+    while (g_hash_table_size(bench.inflight) > 0 && g_get_monotonic_time() < drain_end) {
+        struct pollfd pfd = { bench.sock, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) > 0 && !_read_available(&bench)) {
+            break;
+        }
+        _consume_responses(&bench);
+    }
+
+    double elapsed = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+    double server_cpu = (_cpu_secs() - cpu_start) - (_thread_cpu_secs() - bench_cpu_start);
+    long stanzas = bench.sent + bench.received;
+
+    g_array_sort(bench.latencies, _compare_gint64);
+
+    printf("{\n");
+    printf("  \"connections\": 1,\n");
+    printf("  \"window\": %d,\n", window);
+    printf("  \"target_rate\": %d,\n", rate);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"iqs_sent\": %ld,\n", bench.sent);
+    printf("  \"iqs_answered\": %ld,\n", bench.received);
+    printf("  \"iqs_unanswered\": %u,\n", g_hash_table_size(bench.inflight));
+    printf("  \"stanzas_per_s\": %.1f,\n", stanzas / elapsed);
+    printf("  \"latency_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f },\n",
+        _percentile(bench.latencies, 500), _percentile(bench.latencies, 990),
+        _percentile(bench.latencies, 999), _percentile(bench.latencies, 1000));
+    printf("  \"server_cpu_us_per_stanza\": %.3f\n", stanzas > 0 ? server_cpu * 1000000.0 / stanzas : 0.0);
+    printf("}\n");
+
+    close(bench.sock);
+    stbbr_stop();
+
+    g_string_free(bench.inbuf, TRUE);
+    g_hash_table_destroy(bench.inflight);
+    g_queue_free_full(bench.free_ids, g_free);
+    g_array_free(bench.latencies, TRUE);
+
+    return 0;
+}
+
+static int
+_connect(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        printf("Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        printf("Could not connect to Stabber: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return sock;
+}
+
+static int
+_send_all(int sock, const char *data)
+{
+    size_t to_send = strlen(data);
+    while (to_send > 0) {
+        ssize_t sent = write(sock, data, to_send);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error sending to Stabber: %s\n", strerror(errno));
+            return 0;
+        }
+        to_send -= sent;
+        data += sent;
+    }
+
+    return 1;
+}
+
+static int
+_read_available(Bench *bench)
+{
+    char buf[4096];
+    ssize_t read_size = recv(bench->sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (read_size == 0) {
+        printf("Stabber closed the connection\n");
+        return 0;
+    }
+    if (read_size == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    g_string_append_len(bench->inbuf, buf, read_size);
+    return 1;
+}
+
+static int
+_read_until(Bench *bench, const char *marker, int timeout_ms)
+{
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+    while (!strstr(bench->inbuf->str, marker)) {
+        gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+        if (remaining <= 0) {
+            return 0;
+        }
+
+        struct pollfd pfd = { bench->sock, POLLIN, 0 };
+        if (poll(&pfd, 1, (int)remaining) > 0 && !_read_available(bench)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+_send_iq(Bench *bench, long seq)
+{
+    char *id = NULL;
+    char *iq = NULL;
+
+    // alternate between id stubs and query stubs
+    if (seq % 2 == 0 && !g_queue_is_empty(bench->free_ids)) {
+        id = g_queue_pop_head(bench->free_ids);
+        iq = g_strdup_printf("<iq id=\"%s\" type=\"get\"><ping xmlns=\"urn:xmpp:ping\"/></iq>", id);
+    } else {
+        id = g_strdup_printf("bench_q%ld", seq);
+        iq = g_strdup_printf("<iq id=\"%s\" type=\"get\"><query xmlns=\"jabber:iq:roster\"/></iq>", id);
+    }
+
+    gint64 *sent_at = malloc(sizeof(gint64));
+    *sent_at = g_get_monotonic_time();
+    g_hash_table_insert(bench->inflight, strdup(id), sent_at);
+
+    if (_send_all(bench->sock, iq)) {
+        bench->sent++;
+    }
+
+    g_free(id);
+    g_free(iq);
+}
+
+static void
+_consume_responses(Bench *bench)
+{
+    char *pos = bench->inbuf->str;
+    char *attr = NULL;
+
+    while ((attr = strstr(pos, " id=\"")) != NULL) {
+        char *value = attr + strlen(" id=\"");
+        char *close = strchr(value, '"');
+        if (!close) {
+            break;
+        }
+
+        char *id = g_strndup(value, close - value);
+        gint64 *sent_at = g_hash_table_lookup(bench->inflight, id);
+        if (sent_at) {
+            gint64 latency = g_get_monotonic_time() - *sent_at;
+            g_array_append_val(bench->latencies, latency);
+            bench->received++;
+            g_hash_table_remove(bench->inflight, id);
+
+            // the id stub can be used again
+            if (!g_str_has_prefix(id, "bench_q")) {
+                g_queue_push_tail(bench->free_ids, id);
+                id = NULL;
+            }
+        }
+        g_free(id);
+
+        pos = close + 1;
+        attr = NULL;
+    }
+
+    // keep an incomplete attribute for the next read
+    gsize keep_from = pos - bench->inbuf->str;
+    if (!attr) {
+        gsize tail = strlen(" id=\"");
+        if (bench->inbuf->len - keep_from > tail) {
+            keep_from = bench->inbuf->len - tail;
+        }
+    }
+    g_string_erase(bench->inbuf, 0, keep_from);
+}
+
+static int
+_compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 first = *(const gint64*)a;
+    gint64 second = *(const gint64*)b;
+
+    if (first < second) {
+        return -1;
+    } else if (first > second) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static double
+_percentile(GArray *sorted, int permille)
+{
+    if (sorted->len == 0) {
+        return 0.0;
+    }
+
+    guint index = (guint)(((guint64)(sorted->len - 1) * permille) / 1000);
+    return g_array_index(sorted, gint64, index) / 1000.0;
+}
+
+static double
+_cpu_secs(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static double
+_thread_cpu_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
@@ -0,0 +1,178 @@
+/*
+ * stabbercheck.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "server/stanza.h"
+#include "server/stanzas.h"
+#include "server/coldstore.h"
+
+// stanzas the serialiser and the cold store have to give back unchanged
+static const char *corpus[] = {
+    "<message id=\"m&amp;1\" to=\"a&lt;b&gt;@localhost\" type=\"chat\"><body>fish &amp; chips &lt;3 &gt; &quot;x&quot;</body></message>",
+    "<iq id=\"q&quot;1\" type=\"get\"><query xmlns=\"jabber:iq:roster\">\n    <item jid=\"buddy1@localhost\"/>\n    <item jid=\"buddy2@localhost\"/>\n</query></iq>",
+    "<message id=\"mixed1\"><body>before<b>bold</b>after</body></message>",
+    "<presence id=\"p1\" from=\"buddy1@localhost/tab&#9;and&#10;line\"><status>a &#13; b</status></presence>",
+    NULL
+};
+
+static int failures = 0;
+
+static gboolean _same(XMPPStanza *first, XMPPStanza *second);
+static void _check(gboolean ok, const char *name, const char *text);
+static void _check_round_trip(const char *text);
+static void _check_cold(void);
+
+int
+main(void)
+{
+    int i;
+    for (i = 0; corpus[i]; i++) {
+        _check_round_trip(corpus[i]);
+    }
+    _check_cold();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
+
+// serialised and read back, the stanza must be what was parsed
+static void
+_check_round_trip(const char *text)
+{
+    XMPPStanza *stanza = stanza_parse((char *)text);
+    _check(stanza != NULL, "parse", text);
+    if (!stanza) {
+        return;
+    }
+
+    char *serialised = stanza_to_string(stanza);
+    XMPPStanza *again = stanza_parse(serialised);
+    _check(again && _same(stanza, again), "round trip", serialised);
+
+    stanza_free(stanza);
+    if (again) {
+        stanza_free(again);
+    }
+    free(serialised);
+}
+
+// the corpus goes cold under a block of filler, and must still be found
+static void
+_check_cold(void)
+{
+    stbbr_history_t history;
+    memset(&history, 0, sizeof(history));
+    history.hot_stanzas = 16;
+    stanzas_set_limit(&history);
+
+    int i;
+    for (i = 0; corpus[i]; i++) {
+        stanzas_add(stanza_parse((char *)corpus[i]), corpus[i], strlen(corpus[i]));
+    }
+    for (i = 0; i < COLD_BLOCK_STANZAS + 16; i++) {
+        char *filler = g_strdup_printf("<message id=\"filler%d\"><body>%d</body></message>", i, i);
+        stanzas_add(stanza_parse(filler), filler, strlen(filler));
+        g_free(filler);
+    }
+
+    stbbr_history_stats_t stats;
+    stanzas_stats(&stats);
+    _check(stats.cold_stanzas > 0, "frozen", "history");
+
+    _check(stanzas_contains_id("m&1"), "cold id", corpus[0]);
+    _check(stanzas_contains_id("q\"1"), "cold id", corpus[1]);
+
+    GList *events = stanzas_since(0, G_N_ELEMENTS(corpus) - 1);
+    GList *curr = events;
+    for (i = 0; corpus[i]; i++) {
+        _check(curr && g_strcmp0(((StanzaEvent *)curr->data)->text, corpus[i]) == 0, "cold text", corpus[i]);
+        if (curr) {
+            curr = g_list_next(curr);
+        }
+    }
+    g_list_free_full(events, (GDestroyNotify)stanzas_event_free);
+
+    for (i = 0; corpus[i]; i++) {
+        XMPPStanza *stanza = stanza_parse((char *)corpus[i]);
+        _check(stanzas_find(stanza, 0) == i + 1, "cold find", corpus[i]);
+        stanza_free(stanza);
+    }
+
+    stanzas_free_all();
+    stanzas_set_limit(NULL);
+}
+
+static gboolean
+_same(XMPPStanza *first, XMPPStanza *second)
+{
+    if (g_strcmp0(first->name, second->name) != 0) {
+        return FALSE;
+    }
+    if (g_strcmp0(first->content ? first->content->str : NULL, second->content ? second->content->str : NULL) != 0) {
+        return FALSE;
+    }
+    if (g_list_length(first->attrs) != g_list_length(second->attrs)
+            || g_list_length(first->children) != g_list_length(second->children)) {
+        return FALSE;
+    }
+
+    GList *curr_first = first->attrs;
+    GList *curr_second = second->attrs;
+    while (curr_first) {
+        XMPPAttr *attr_first = curr_first->data;
+        XMPPAttr *attr_second = curr_second->data;
+        if (g_strcmp0(attr_first->name, attr_second->name) != 0 || g_strcmp0(attr_first->value, attr_second->value) != 0) {
+            return FALSE;
+        }
+        curr_first = g_list_next(curr_first);
+        curr_second = g_list_next(curr_second);
+    }
+
+    curr_first = first->children;
+    curr_second = second->children;
+    while (curr_first) {
+        if (!_same(curr_first->data, curr_second->data)) {
+            return FALSE;
+        }
+        curr_first = g_list_next(curr_first);
+        curr_second = g_list_next(curr_second);
+    }
+
+    return TRUE;
+}
+
+static void
+_check(gboolean ok, const char *name, const char *text)
+{
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, text);
+        failures++;
+    }
+}
@@ -0,0 +1,492 @@
+/*
+ * stabbermicrobench.c
+ *
+ * Copyright (C) 2015 James Booth <boothj5@gmail.com>
+ *
+ * This file is part of Stabber.
+ *
+ * Stabber is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Stabber is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Stabber.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "server/stanza.h"
+#include "server/stanzas.h"
+#include "server/prime.h"
+
+#define MIN_RUN_NS (50 * 1000 * 1000)
+#define BATCH 64
+
+typedef struct bench_t {
+    const char *name;
+    char *text;
+    XMPPStanza *stanza;
+    XMPPStanza *other;
+    char *id;
+    long history;
+} Bench;
+
+typedef void (*bench_func)(Bench *bench, long iterations);
+
+static long allocations = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// count every allocation made by Stabber and GLib during a run
+void*
+malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static int runs = 5;
+static char *filter = NULL;
+static gboolean first_result = TRUE;
+
+static void _run(Bench *bench, bench_func func);
+static gint64 _now_ns(void);
+static int _compare_double(gconstpointer a, gconstpointer b);
+static char* _roster(int items);
+static char* _presence(int n);
+static char* _muc_message(int n);
+static char* _avatar(int bytes);
+static void _fill_history(long count);
+
+static void _bench_parse(Bench *bench, long iterations);
+static void _bench_to_string(Bench *bench, long iterations);
+static void _bench_equal(Bench *bench, long iterations);
+static void _bench_verify_any(Bench *bench, long iterations);
+static void _bench_contains_id(Bench *bench, long iterations);
+static void _bench_get_for_query(Bench *bench, long iterations);
+static void _bench_get_for_id(Bench *bench, long iterations);
+
+int
+main(int argc, char *argv[])
+{
+    char *histories = "1000,100000,1000000";
+
+    // GLib versions with a slice allocator would hide allocations from the counter
+    setenv("G_SLICE", "always-malloc", 1);
+
+    GOptionEntry entries[] =
+    {
+        { "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Runs per benchmark, the median is reported (default 5)", NULL },
+        { "histories", 's', 0, G_OPTION_ARG_STRING, &histories, "Comma separated history sizes (default 1000,100000,1000000)", "SIZES" },
+        { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only run benchmarks whose name contains FILTER", "FILTER" },
+        { NULL }
+    };
+
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_print("%s\n", error->message);
+        g_option_context_free(context);
+        g_error_free(error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (runs <= 0) {
+        runs = 1;
+    }
+
+    char *roster = _roster(200);
+    char *presence = _presence(1);
+    char *message = _muc_message(1);
+    char *avatar = _avatar(8 * 1024);
+    char *oldest = _presence(0);
+    char *corpus_names[] = { "roster", "presence", "muc_message", "avatar" };
+    char *corpus[] = { roster, presence, message, avatar };
+
+    printf("[\n");
+
+    int i;
+    for (i = 0; i < G_N_ELEMENTS(corpus); i++) {
+        char *name = g_strdup_printf("stanza_parse/%s", corpus_names[i]);
+        Bench bench = { name, corpus[i], NULL, NULL, NULL, 0 };
+        _run(&bench, _bench_parse);
+        g_free(name);
+
+        name = g_strdup_printf("stanza_to_string/%s", corpus_names[i]);
+        bench.name = name;
+        bench.stanza = stanza_parse(corpus[i]);
+        _run(&bench, _bench_to_string);
+        g_free(name);
+
+        name = g_strdup_printf("stanzas_equal/%s", corpus_names[i]);
+        bench.name = name;
+        bench.other = stanza_parse(corpus[i]);
+        _run(&bench, _bench_equal);
+        g_free(name);
+
+        stanza_free(bench.stanza);
+        stanza_free(bench.other);
+    }
+
+    gchar **sizes = g_strsplit(histories, ",", -1);
+    for (i = 0; sizes[i]; i++) {
+        long history = strtol(sizes[i], NULL, 10);
+        if (history <= 0) {
+            continue;
+        }
+        _fill_history(history);
+
+        char *name = g_strdup_printf("stanzas_verify_any/miss/%ld", history);
+        char *expected = "<message id=\"*\" to=\"room@conference.localhost\" type=\"groupchat\"><body>not sent</body></message>";
+        Bench bench = { name, NULL, stanza_parse(expected), NULL, NULL, history };
+        _run(&bench, _bench_verify_any);
+        stanza_free(bench.stanza);
+        g_free(name);
+
+        name = g_strdup_printf("stanzas_verify_any/oldest/%ld", history);
+        bench.name = name;
+        bench.stanza = stanza_parse(oldest);
+        _run(&bench, _bench_verify_any);
+        stanza_free(bench.stanza);
+        bench.stanza = NULL;
+        g_free(name);
+
+        name = g_strdup_printf("stanzas_contains_id/wildcard_miss/%ld", history);
+        bench.name = name;
+        bench.id = "prof_iq_*";
+        _run(&bench, _bench_contains_id);
+        g_free(name);
+
+        stanzas_free_all();
+    }
+    g_strfreev(sizes);
+
+    prime_init();
+    for (i = 0; i < 100; i++) {
+        char *query = g_strdup_printf("urn:stabber:bench:%d", i);
+        prime_for_query(query, roster);
+        g_free(query);
+    }
+    Bench bench = { "prime_get_for_query", NULL, NULL, NULL, "urn:stabber:bench:42", 0 };
+    _run(&bench, _bench_get_for_query);
+
+    // thousands of patterns, the id only matches one of them
+    GList *stubs = NULL;
+    for (i = 0; i < 5000; i++) {
+        StubDef *stub = malloc(sizeof(StubDef));
+        stub->id = g_strdup_printf("client%d_msg_*", i);
+        stub->query = NULL;
+        stub->rule = NULL;
+        stub->stream = message;
+        stub->next = 0;
+        stub->source = NULL;
+        stubs = g_list_append(stubs, stub);
+    }
+    prime_for_all(stubs);
+    Bench pattern_bench = { "prime_get_for_id/pattern", NULL, NULL, NULL, "client4321_msg_9f2c1d7e", 0 };
+    _run(&pattern_bench, _bench_get_for_id);
+    GList *curr = stubs;
+    while (curr) {
+        g_free(((StubDef *)curr->data)->id);
+        free(curr->data);
+        curr = g_list_next(curr);
+    }
+    g_list_free(stubs);
+    prime_free_all();
+
+    printf("\n]\n");
+
+    free(roster);
+    free(presence);
+    free(message);
+    free(avatar);
+    free(oldest);
+
+    return 0;
+}
+
+static void
+_run(Bench *bench, bench_func func)
+{
+    if (filter && !strstr(bench->name, filter)) {
+        return;
+    }
+
+    // warm up and size the run so that it lasts at least MIN_RUN_NS
+    long iterations = 1;
+    while (TRUE) {
+        gint64 start = _now_ns();
+        func(bench, iterations);
+        gint64 elapsed = _now_ns() - start;
+        if (elapsed >= MIN_RUN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    GArray *ns_per_op = g_array_new(FALSE, FALSE, sizeof(double));
+    long allocs = 0;
+    int i;
+    for (i = 0; i < runs; i++) {
+        long allocs_start = allocations;
+        gint64 start = _now_ns();
+        func(bench, iterations);
+        gint64 elapsed = _now_ns() - start;
+        allocs = allocations - allocs_start;
+
+        double result = elapsed / (double)iterations;
+        g_array_append_val(ns_per_op, result);
+    }
+    g_array_sort(ns_per_op, _compare_double);
+
+    printf("%s  { \"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, \"allocs_per_op\": ",
+        first_result ? "" : ",\n", bench->name, iterations, g_array_index(ns_per_op, double, runs / 2),
+        g_array_index(ns_per_op, double, 0));
+#ifdef __GLIBC__
+    printf("%.1f }", allocs / (double)iterations);
+#else
+    printf("null }");
+#endif
+    fflush(stdout);
+    first_result = FALSE;
+
+    g_array_free(ns_per_op, TRUE);
+}
+
+// parsed stanzas are freed in batches, freeing does not allocate
+static void
+_bench_parse(Bench *bench, long iterations)
+{
+    XMPPStanza *parsed[BATCH];
+    long done = 0;
+    while (done < iterations) {
+        int batch = MIN(BATCH, iterations - done);
+        int i;
+        for (i = 0; i < batch; i++) {
+            parsed[i] = stanza_parse(bench->text);
+        }
+        for (i = 0; i < batch; i++) {
+            stanza_free(parsed[i]);
+        }
+        done += batch;
+    }
+}
+
+static void
+_bench_to_string(Bench *bench, long iterations)
+{
+    char *strings[BATCH];
+    long done = 0;
+    while (done < iterations) {
+        int batch = MIN(BATCH, iterations - done);
+        int i;
+        for (i = 0; i < batch; i++) {
+            strings[i] = stanza_to_string(bench->stanza);
+        }
+        for (i = 0; i < batch; i++) {
+            free(strings[i]);
+        }
+        done += batch;
+    }
+}
+
+static void
+_bench_equal(Bench *bench, long iterations)
+{
+    long i;
+    for (i = 0; i < iterations; i++) {
+        if (stanzas_equal(bench->stanza, bench->other) != 0) {
+            printf("Benchmark %s: stanzas not equal\n", bench->name);
+            exit(1);
+        }
+    }
+}
+
+static void
+_bench_verify_any(Bench *bench, long iterations)
+{
+    long i;
+    for (i = 0; i < iterations; i++) {
+        stanzas_verify_any(bench->stanza);
+    }
+}
+
+static void
+_bench_contains_id(Bench *bench, long iterations)
+{
+    long i;
+    for (i = 0; i < iterations; i++) {
+        stanzas_contains_id(bench->id);
+    }
+}
+
+static void
+_bench_get_for_query(Bench *bench, long iterations)
+{
+    long i;
+    for (i = 0; i < iterations; i++) {
+        PrimeStub *stub = prime_get_for_query(bench->id);
+        if (!stub) {
+            printf("Benchmark %s: stub not found\n", bench->name);
+            exit(1);
+        }
+        prime_stub_unref(stub);
+    }
+}
+
+static void
+_bench_get_for_id(Bench *bench, long iterations)
+{
+    long i;
+    for (i = 0; i < iterations; i++) {
+        PrimeStub *stub = prime_get_for_id(bench->id);
+        if (!stub) {
+            printf("Benchmark %s: stub not found\n", bench->name);
+            exit(1);
+        }
+        prime_stub_unref(stub);
+    }
+}
+
+// presence floods and MUC traffic, the presence that is verified is the oldest entry
+static void
+_fill_history(long count)
+{
+    long i;
+    for (i = 0; i < count; i++) {
+        char *text = (i % 3 == 2) ? _muc_message(i) : _presence(i);
+        stanzas_add(stanza_parse(text), text, strlen(text));
+        free(text);
+    }
+}
+
+static char*
+_roster(int items)
+{
+    GString *roster = g_string_new("<iq type=\"result\" id=\"roster_1\" to=\"stabber@localhost/profanity\">");
+    g_string_append(roster, "<query xmlns=\"jabber:iq:roster\" ver=\"362\">");
+    int i;
+    for (i = 0; i < items; i++) {
+        g_string_append_printf(roster,
+            "<item jid=\"buddy%d@localhost\" subscription=\"%s\" name=\"Buddy %d\"><group>Group %d</group></item>",
+            i, i % 4 == 0 ? "to" : "both", i, i % 7);
+    }
+    g_string_append(roster, "</query></iq>");
+
+    char *result = roster->str;
+    g_string_free(roster, FALSE);
+    return result;
+}
+
+static char*
+_presence(int n)
+{
+    GString *presence = g_string_new("");
+    g_string_append_printf(presence,
+        "<presence to=\"stabber@localhost/profanity\" from=\"buddy%d@localhost/mobile\" id=\"prof_presence_%d\">"
+            "<show>away</show>"
+            "<status>Out of office</status>"
+            "<priority>%d</priority>"
+            "<c xmlns=\"http://jabber.org/protocol/caps\" hash=\"sha-1\" node=\"http://profanity-im.github.io\" ver=\"a0Ba8Ah5V0AvhCnwPm/lAuyjC/o=\"/>"
+        "</presence>", n % 500, n, n % 10);
+
+    char *result = presence->str;
+    g_string_free(presence, FALSE);
+    return result;
+}
+
+static char*
+_muc_message(int n)
+{
+    GString *message = g_string_new("");
+    g_string_append_printf(message,
+        "<message id=\"prof_msg_%d\" to=\"stabber@localhost/profanity\" from=\"room@conference.localhost/occupant%d\" type=\"groupchat\">"
+            "<body>Message number %d in the room, with some text to make it a typical length.</body>"
+            "<delay xmlns=\"urn:xmpp:delay\" from=\"room@conference.localhost\" stamp=\"2015-06-01T12:00:00Z\"/>"
+            "<stanza-id xmlns=\"urn:xmpp:sid:0\" id=\"sid%d\" by=\"room@conference.localhost\"/>"
+        "</message>", n, n % 50, n, n);
+
+    char *result = message->str;
+    g_string_free(message, FALSE);
+    return result;
+}
+
+static char*
+_avatar(int bytes)
+{
+    guint8 *data = malloc(bytes);
+    GRand *rand = g_rand_new_with_seed(42);
+    int i;
+    for (i = 0; i < bytes; i++) {
+        data[i] = g_rand_int(rand) & 0xff;
+    }
+    g_rand_free(rand);
+
+    gchar *encoded = g_base64_encode(data, bytes);
+    free(data);
+
+    GString *vcard = g_string_new("<iq type=\"result\" id=\"vc1\" from=\"buddy1@localhost\" to=\"stabber@localhost/profanity\">");
+    g_string_append(vcard, "<vCard xmlns=\"vcard-temp\"><FN>Buddy One</FN><PHOTO><TYPE>image/png</TYPE><BINVAL>");
+    g_string_append(vcard, encoded);
+    g_string_append(vcard, "</BINVAL></PHOTO></vCard></iq>");
+    g_free(encoded);
+
+    char *result = vcard->str;
+    g_string_free(vcard, FALSE);
+    return result;
+}
+
+static int
+_compare_double(gconstpointer a, gconstpointer b)
+{
+    double first = *(const double*)a;
+    double second = *(const double*)b;
+
+    if (first < second) {
+        return -1;
+    } else if (first > second) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static gint64
+_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}